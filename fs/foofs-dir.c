@@ -0,0 +1,943 @@
+/*
+ * foofs-dir.c - foofs hashed directories
+ *
+ * A directory is a linear-hashing table of buckets. The dir's i_on_disk.a[0]
+ * is the bn of its index block, which holds the hash parameters and the bns
+ * of the bucket-table blocks. Each bucket-table block holds the heads of
+ * FOOFS_DTAB_ENTS buckets. A bucket is a chain of dirent blocks.
+ *
+ * A dirent block starts with an array of 8 byte slots (hash, offset, len,
+ * type), the names with their ino are packed from the end of the block
+ * towards the slots. So a lookup only walks the slots cache-lines until the
+ * 32bit hash matches, and only then compares a name.
+ *
+ * Buckets are split one at a time (linear hashing) as the directory grows,
+ * so a lookup scans about one block regardless of the size of the dir.
+ *
+ * Readdir goes in the order of the bit-reversed hash. A bucket holds all
+ * the hashes of some low bits, which is one contiguous range of reversed
+ * hashes, and a split cuts a range in two. So the readdir cookie is the
+ * reversed hash (and the count of same-hash names before it) and stays
+ * valid whatever adds, removes and splits happen between two calls.
+ *
+ * The Kernel serializes modifications of a directory against lookups and
+ * readdir in it, so there is no locking here.
+ *
+ * add_dentry, remove_dentry and a split are each one journal tx. Blocks
+ * already reachable are modified in their staged copy (_dblk_w()), and the
+ * chains are walked through foofs_tx_rd() so a tx sees its own changes.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <stddef.h>
+
+#include "zus.h"
+#include "b-minmax.h"
+#include "nv.h"
+#include "foofs.h"
+
+#define FOOFS_DIR_LOAD		32	/* Average entries per bucket */
+#define FOOFS_DTAB_ENTS		(PAGE_SIZE / sizeof(__le64))
+#define FOOFS_DIDX_TABLES	((PAGE_SIZE - 64) / sizeof(__le64))
+#define FOOFS_DIR_MAX_BUCKETS	(FOOFS_DIDX_TABLES * FOOFS_DTAB_ENTS)
+#define FOOFS_SPLIT_MAX_CHAIN	8	/* Longer buckets are not split */
+
+struct foofs_dindex {
+	__le64	nentries;
+	__le32	level;		/* 2^level buckets before the split point */
+	__le32	split;		/* Next bucket to split */
+	__le64	__pad[6];
+	__le64	tables[FOOFS_DIDX_TABLES];
+};
+
+/* What add/remove stage of the index, the tables are only for a split */
+#define FOOFS_DIDX_HDR		offsetof(struct foofs_dindex, tables)
+
+struct foofs_dslot {
+	__le32	hash;		/* 0 is a free slot */
+	__le16	off;		/* Of the foofs_dname in the block */
+	__u8	len;
+	__u8	type;		/* DT_XXX */
+};
+
+struct foofs_dname {
+	__le64	ino;
+	char	name[];
+};
+
+struct foofs_dblock {
+	__le64	next;		/* Next block in the bucket chain */
+	__le16	nslots;
+	__le16	top;		/* Lowest offset of a name */
+	__le16	live;		/* Slots in use */
+	__le16	used;		/* Bytes of live names */
+	struct foofs_dslot slots[];
+};
+
+/* Readdir cookie. 0 and 1 are "." and "..", then the reversed hash of an
+ * entry and the count of names with the same hash sorted before it
+ */
+#define FOOFS_DPOS_DUP_BITS	8
+#define FOOFS_DPOS_DUP_MAX	((1U << FOOFS_DPOS_DUP_BITS) - 1)
+#define FOOFS_DPOS_FIRST	2
+#define FOOFS_DPOS_END		(FOOFS_DPOS_FIRST + \
+				 (1UL << (32 + FOOFS_DPOS_DUP_BITS)))
+
+static loff_t _dpos(ulong rhash, uint dup)
+{
+	return FOOFS_DPOS_FIRST + ((rhash << FOOFS_DPOS_DUP_BITS) |
+				   min_t(uint, dup, FOOFS_DPOS_DUP_MAX));
+}
+
+static uint _drev(uint h)
+{
+	h = ((h >> 1) & 0x55555555) | ((h & 0x55555555) << 1);
+	h = ((h >> 2) & 0x33333333) | ((h & 0x33333333) << 2);
+	h = ((h >> 4) & 0x0f0f0f0f) | ((h & 0x0f0f0f0f) << 4);
+	h = ((h >> 8) & 0x00ff00ff) | ((h & 0x00ff00ff) << 8);
+	return (h >> 16) | (h << 16);
+}
+
+static uint _dhash(const char *name, uint len)
+{
+	uint h = 0x811c9dc5;
+	uint i;
+
+	for (i = 0; i < len; ++i) {
+		h ^= (__u8)name[i];
+		h *= 0x01000193;
+	}
+	/* FNV low bits are weak, and linear hashing only uses those */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+
+	return h ?: 1;
+}
+
+static uint _dname_size(uint len)
+{
+	return ALIGN(sizeof(struct foofs_dname) + len, sizeof(__le64));
+}
+
+static ulong _dnbuckets(struct foofs_dindex *di)
+{
+	return (1UL << di->level) + di->split;
+}
+
+static ulong _dbucket(struct foofs_dindex *di, uint hash)
+{
+	ulong b = hash & ((1UL << di->level) - 1);
+
+	if (b < di->split)
+		b = hash & ((1UL << (di->level + 1)) - 1);
+	return b;
+}
+
+static void *_baddr(struct foofs_sb_info *fsbi, ulong bn)
+{
+	return pmem_baddr(&fsbi->sbi.pmem, bn);
+}
+
+static struct foofs_dindex *_dindex(struct foofs_sb_info *fsbi,
+				    struct zus_inode *dir_zi)
+{
+	return dir_zi->i_on_disk.a[0] ? _baddr(fsbi, dir_zi->i_on_disk.a[0]) :
+					NULL;
+}
+
+/* May return NULL if the bucket-table for @b was not yet allocated */
+static __le64 *_dhead(struct foofs_sb_info *fsbi, struct foofs_dindex *di,
+		      ulong b)
+{
+	__le64 *table;
+
+	if (!di->tables[b / FOOFS_DTAB_ENTS])
+		return NULL;
+
+	table = _baddr(fsbi, di->tables[b / FOOFS_DTAB_ENTS]);
+	return &table[b % FOOFS_DTAB_ENTS];
+}
+
+static struct foofs_dname *_dname(struct foofs_dblock *db,
+				  struct foofs_dslot *ds)
+{
+	return (void *)db + ds->off;
+}
+
+static uint _dslots_end(struct foofs_dblock *db)
+{
+	return sizeof(*db) + db->nslots * sizeof(db->slots[0]);
+}
+
+/* Free bytes between the slots and the names */
+static uint _dblk_gap(struct foofs_dblock *db)
+{
+	return db->top - _dslots_end(db);
+}
+
+/* ~~~~ blocks of a directory ~~~~ */
+
+static ulong _dir_blk_alloc(struct foofs_tx *tx, struct zus_inode *dir_zi)
+{
+	struct foofs_sb_info *fsbi = tx->fsbi;
+	ulong bn = foofs_blk_alloc(fsbi);
+
+	if (unlikely(!bn))
+		return 0;
+
+	if (unlikely(!foofs_tx_fresh(tx, bn))) {
+		foofs_blk_free(fsbi, bn);
+		return 0;
+	}
+
+	pmem_memset_nt(_baddr(fsbi, bn), 0, PAGE_SIZE);
+	++dir_zi->i_blocks;
+	return bn;
+}
+
+static bool _dir_blk_release(struct foofs_tx *tx, struct zus_inode *dir_zi,
+			     ulong bn)
+{
+	if (unlikely(!foofs_tx_free(tx, bn)))
+		return false;
+
+	--dir_zi->i_blocks;
+	return true;
+}
+
+static void _dir_blk_free(struct foofs_sb_info *fsbi, struct zus_inode *dir_zi,
+			  ulong bn)
+{
+	foofs_blk_free(fsbi, bn);
+	--dir_zi->i_blocks;
+}
+
+static struct foofs_dblock *_dblk_new(struct foofs_tx *tx,
+				      struct zus_inode *dir_zi, ulong *bn)
+{
+	struct foofs_dblock *db;
+
+	*bn = _dir_blk_alloc(tx, dir_zi);
+	if (unlikely(!*bn))
+		return NULL;
+
+	db = _baddr(tx->fsbi, *bn);
+	db->top = PAGE_SIZE;
+	return db;
+}
+
+/* The block as @tx sees it */
+static struct foofs_dblock *_dblk_rd(struct foofs_tx *tx, ulong bn)
+{
+	return foofs_tx_rd(tx, _baddr(tx->fsbi, bn));
+}
+
+/* Writable copy of a block in @tx. NULL if @tx is full */
+static struct foofs_dblock *_dblk_w(struct foofs_tx *tx, ulong bn)
+{
+	return foofs_tx_stage(tx, _baddr(tx->fsbi, bn), PAGE_SIZE);
+}
+
+static bool _dlink_set(struct foofs_tx *tx, __le64 *link, ulong bn)
+{
+	__le64 *w = foofs_tx_stage(tx, link, sizeof(*link));
+
+	if (unlikely(!w))
+		return false;
+
+	*w = bn;
+	return true;
+}
+
+/* ~~~~ dirent block ~~~~ */
+
+static int _dblk_find(struct foofs_dblock *db, uint hash, struct zufs_str *str)
+{
+	uint i;
+
+	for (i = 0; i < db->nslots; ++i) {
+		struct foofs_dslot *ds = &db->slots[i];
+
+		if (ds->hash == hash && ds->len == str->len &&
+		    !memcmp(_dname(db, ds)->name, str->name, str->len))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Move all live names to the end of the block. Names are moved from the
+ * highest offset down, so a move never overwrites a name not yet moved.
+ */
+static void _dblk_compact(struct foofs_dblock *db)
+{
+	uint top = PAGE_SIZE, prev = PAGE_SIZE;
+
+	for (;;) {
+		struct foofs_dslot *best = NULL;
+		uint i, size;
+
+		for (i = 0; i < db->nslots; ++i) {
+			struct foofs_dslot *ds = &db->slots[i];
+
+			if (ds->hash && ds->off < prev &&
+			    (!best || best->off < ds->off))
+				best = ds;
+		}
+		if (!best)
+			break;
+
+		prev = best->off;
+		size = _dname_size(best->len);
+		top -= size;
+		memmove((void *)db + top, _dname(db, best), size);
+		best->off = top;
+	}
+
+	db->top = top;
+}
+
+static struct foofs_dslot *_dblk_free_slot(struct foofs_dblock *db)
+{
+	uint i;
+
+	for (i = 0; i < db->nslots; ++i)
+		if (!db->slots[i].hash)
+			return &db->slots[i];
+
+	return NULL;
+}
+
+/* Bytes a name of @len takes in @db, with a new slot if needed */
+static uint _dblk_need(struct foofs_dblock *db, uint len)
+{
+	return _dname_size(len) +
+	       (_dblk_free_slot(db) ? 0 : sizeof(struct foofs_dslot));
+}
+
+static bool _dblk_fits(struct foofs_dblock *db, uint len)
+{
+	return PAGE_SIZE - _dslots_end(db) - db->used >= _dblk_need(db, len);
+}
+
+static bool _dblk_insert(struct foofs_dblock *db, uint hash, ulong ino,
+			 uint type, const char *name, uint len)
+{
+	uint size = _dname_size(len);
+	struct foofs_dslot *ds = _dblk_free_slot(db);
+	struct foofs_dname *dn;
+
+	if (_dblk_gap(db) < _dblk_need(db, len)) {
+		if (!_dblk_fits(db, len))
+			return false;
+		_dblk_compact(db);
+	}
+
+	if (!ds)
+		ds = &db->slots[db->nslots++];
+
+	db->top -= size;
+	dn = (void *)db + db->top;
+	dn->ino = ino;
+	memcpy(dn->name, name, len);
+
+	ds->off = db->top;
+	ds->len = len;
+	ds->type = type;
+	ds->hash = hash;
+
+	++db->live;
+	db->used += size;
+	return true;
+}
+
+static void _dblk_remove(struct foofs_dblock *db, uint i)
+{
+	struct foofs_dslot *ds = &db->slots[i];
+
+	--db->live;
+	db->used -= _dname_size(ds->len);
+	ds->hash = 0;
+
+	while (db->nslots && !db->slots[db->nslots - 1].hash)
+		--db->nslots;
+	if (!db->live)
+		db->top = PAGE_SIZE;
+}
+
+/* ~~~~ buckets ~~~~ */
+
+static int _dbucket_insert(struct foofs_tx *tx, struct zus_inode *dir_zi,
+			   __le64 *head, uint hash, ulong ino, uint type,
+			   const char *name, uint len)
+{
+	struct foofs_dblock *db;
+	ulong bn;
+
+	for (bn = *(__le64 *)foofs_tx_rd(tx, head); bn; bn = db->next) {
+		db = _dblk_rd(tx, bn);
+		if (!_dblk_fits(db, len))
+			continue;
+
+		db = _dblk_w(tx, bn);
+		if (unlikely(!db))
+			return -ENOMEM;
+		_dblk_insert(db, hash, ino, type, name, len);
+		return 0;
+	}
+
+	/* New blocks go at the head of the chain */
+	db = _dblk_new(tx, dir_zi, &bn);
+	if (unlikely(!db))
+		return -ENOSPC;
+
+	db->next = *(__le64 *)foofs_tx_rd(tx, head);
+	_dblk_insert(db, hash, ino, type, name, len);
+	return _dlink_set(tx, head, bn) ? 0 : -ENOMEM;
+}
+
+/* Unlink and free the empty blocks of a bucket */
+static bool _dbucket_trim(struct foofs_tx *tx, struct zus_inode *dir_zi,
+			  __le64 *head)
+{
+	__le64 *link = head;
+	ulong bn;
+
+	while ((bn = *(__le64 *)foofs_tx_rd(tx, link))) {
+		struct foofs_dblock *db = _dblk_rd(tx, bn);
+
+		if (db->live) {
+			link = &((struct foofs_dblock *)
+					_baddr(tx->fsbi, bn))->next;
+			continue;
+		}
+
+		if (unlikely(!_dlink_set(tx, link, db->next) ||
+			     !_dir_blk_release(tx, dir_zi, bn)))
+			return false;
+	}
+
+	return true;
+}
+
+/* Count the blocks needed to hold the entries of bucket @b that move to
+ * bucket @to, when packed in fresh blocks. Same packing as _dsplit_move.
+ * Also returns the chain length in @chain.
+ */
+static ulong _dsplit_blocks(struct foofs_sb_info *fsbi, ulong bn, uint mask,
+			    ulong to, ulong *chain)
+{
+	uint space = PAGE_SIZE - sizeof(struct foofs_dblock);
+	uint gap = 0;
+	ulong n = 0;
+
+	*chain = 0;
+	for (; bn; bn = ((struct foofs_dblock *)_baddr(fsbi, bn))->next) {
+		struct foofs_dblock *db = _baddr(fsbi, bn);
+		uint i;
+
+		++*chain;
+		for (i = 0; i < db->nslots; ++i) {
+			struct foofs_dslot *ds = &db->slots[i];
+			uint need;
+
+			if (!ds->hash || (ds->hash & mask) != to)
+				continue;
+
+			need = sizeof(*ds) + _dname_size(ds->len);
+			if (gap < need) {
+				++n;
+				gap = space;
+			}
+			gap -= need;
+		}
+	}
+
+	return n;
+}
+
+static bool _dsplit_move(struct foofs_tx *tx, struct zus_inode *dir_zi,
+			 __le64 *from_head, __le64 *to_head, uint mask,
+			 ulong to, ulong *new_bns)
+{
+	struct foofs_dblock *new_db = NULL;
+	ulong n = 0, bn;
+
+	for (bn = *from_head; bn; bn = _dblk_rd(tx, bn)->next) {
+		struct foofs_dblock *db = _dblk_w(tx, bn);
+		uint i;
+
+		if (unlikely(!db))
+			return false;
+
+		for (i = 0; i < db->nslots; ++i) {
+			struct foofs_dslot *ds = &db->slots[i];
+			struct foofs_dname *dn = _dname(db, ds);
+
+			if (!ds->hash || (ds->hash & mask) != to)
+				continue;
+
+			if (!new_db || !_dblk_insert(new_db, ds->hash,
+						     dn->ino, ds->type,
+						     dn->name, ds->len)) {
+				new_db = _baddr(tx->fsbi, new_bns[n]);
+				new_db->next = *(__le64 *)foofs_tx_rd(tx,
+								      to_head);
+				if (unlikely(!_dlink_set(tx, to_head,
+							 new_bns[n++])))
+					return false;
+				_dblk_insert(new_db, ds->hash, dn->ino,
+					     ds->type, dn->name, ds->len);
+			}
+			_dblk_remove(db, i);
+		}
+	}
+
+	return _dbucket_trim(tx, dir_zi, from_head);
+}
+
+/* Split the next bucket, in its own tx. If there is no space for it, the
+ * dir just stays with longer chains.
+ */
+static void _dsplit(struct foofs_sb_info *fsbi, struct zus_inode *pmem_dir_zi)
+{
+	struct foofs_tx *tx = foofs_tx_begin(fsbi);
+	struct zus_inode *dir_zi;
+	struct foofs_dindex *di;
+	__le64 *from_head, *to_head;
+	ulong from, to, nblocks, chain, n, bn;
+	ulong *new_bns = NULL;
+	uint mask;
+
+	if (unlikely(!tx))
+		return;
+
+	dir_zi = foofs_tx_stage(tx, pmem_dir_zi, sizeof(*dir_zi));
+	di = dir_zi ? foofs_tx_stage(tx, _dindex(fsbi, dir_zi), PAGE_SIZE) :
+		      NULL;
+	if (unlikely(!di) || _dnbuckets(di) >= FOOFS_DIR_MAX_BUCKETS)
+		goto abort;
+
+	from = di->split;
+	to = from + (1UL << di->level);
+	mask = (1UL << (di->level + 1)) - 1;
+
+	if (!di->tables[to / FOOFS_DTAB_ENTS]) {
+		bn = _dir_blk_alloc(tx, dir_zi);
+		if (unlikely(!bn))
+			goto abort;
+		di->tables[to / FOOFS_DTAB_ENTS] = bn;
+	}
+
+	from_head = _dhead(fsbi, di, from);
+	to_head = _dhead(fsbi, di, to);
+
+	nblocks = _dsplit_blocks(fsbi, *from_head, mask, to, &chain);
+	if (chain > FOOFS_SPLIT_MAX_CHAIN) {
+		DBG("[%ld] bucket %ld chain=%ld not split\n",
+		    zi_ino(dir_zi), from, chain);
+		goto abort;
+	}
+
+	if (nblocks) {
+		new_bns = calloc(nblocks, sizeof(*new_bns));
+		if (unlikely(!new_bns))
+			goto abort;
+
+		for (n = 0; n < nblocks; ++n)
+			if (unlikely(!_dblk_new(tx, dir_zi, &new_bns[n])))
+				goto abort;
+	}
+
+	if (unlikely(!_dsplit_move(tx, dir_zi, from_head, to_head, mask, to,
+				   new_bns)))
+		goto abort;
+	free(new_bns);
+
+	if (++di->split == (1UL << di->level)) {
+		++di->level;
+		di->split = 0;
+	}
+
+	foofs_tx_commit(tx);
+	return;
+
+abort:
+	free(new_bns);
+	foofs_tx_abort(tx);
+}
+
+static struct foofs_dindex *_dindex_create(struct foofs_tx *tx,
+					   struct zus_inode *dir_zi)
+{
+	ulong idx_bn, tab_bn;
+
+	/* Both are fresh, the abort of @tx frees them */
+	idx_bn = _dir_blk_alloc(tx, dir_zi);
+	if (unlikely(!idx_bn))
+		return NULL;
+
+	tab_bn = _dir_blk_alloc(tx, dir_zi);
+	if (unlikely(!tab_bn))
+		return NULL;
+
+	((struct foofs_dindex *)_baddr(tx->fsbi, idx_bn))->tables[0] = tab_bn;
+	dir_zi->i_on_disk.a[0] = idx_bn;
+	return _baddr(tx->fsbi, idx_bn);
+}
+
+struct _dfind {
+	struct foofs_dblock *db;
+	__le64 *head;
+	int slot;
+};
+
+static bool _dir_find(struct foofs_sb_info *fsbi, struct zus_inode *dir_zi,
+		      struct zufs_str *str, struct _dfind *df)
+{
+	struct foofs_dindex *di = _dindex(fsbi, dir_zi);
+	uint hash = _dhash(str->name, str->len);
+	ulong bn;
+
+	if (!di)
+		return false;
+
+	df->head = _dhead(fsbi, di, _dbucket(di, hash));
+	for (bn = *df->head; bn; bn = df->db->next) {
+		df->db = _baddr(fsbi, bn);
+		df->slot = _dblk_find(df->db, hash, str);
+		if (df->slot >= 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* ~~~~ foofs_sbi_operations ~~~~ */
+
+ulong foofs_lookup(struct zus_inode_info *dir_ii, struct zufs_str *str)
+{
+	struct _dfind df;
+
+	DBG("[%.*s]\n", str->len, str->name);
+	if (str->len == 1 && str->name[0] == '.')
+		return dir_ii->zi->i_ino;
+	else if (str->len == 2 && !strncmp("..", str->name, 2))
+		return dir_ii->zi->i_dir.parent;
+
+	if (!_dir_find(FSBI(dir_ii->sbi), dir_ii->zi, str, &df))
+		return 0; /* NOT FOUND */
+
+	return _dname(df.db, &df.db->slots[df.slot])->ino;
+}
+
+int foofs_add_dentry(struct zus_inode_info *dir_ii,
+		     struct zus_inode_info *zii, struct zufs_str *str)
+{
+	struct foofs_sb_info *fsbi = FSBI(dir_ii->sbi);
+	uint hash = _dhash(str->name, str->len);
+	struct zus_inode *dir_zi, *zi;
+	struct foofs_dindex *di, *dih;
+	struct foofs_tx *tx;
+	bool split;
+	int err;
+
+	tx = foofs_tx_begin(fsbi);
+	if (unlikely(!tx))
+		return -ENOMEM;
+
+	dir_zi = foofs_tx_stage(tx, dir_ii->zi, sizeof(*dir_zi));
+	zi = foofs_tx_stage(tx, zii->zi, sizeof(*zi));
+	if (unlikely(!dir_zi || !zi)) {
+		err = -ENOMEM;
+		goto abort;
+	}
+
+	di = _dindex(fsbi, dir_zi);
+	if (!di) {
+		di = _dindex_create(tx, dir_zi);
+		if (unlikely(!di)) {
+			err = -ENOSPC;
+			goto abort;
+		}
+	}
+	/* Only the header, the tables are read from pmem @di */
+	dih = foofs_tx_stage(tx, di, FOOFS_DIDX_HDR);
+	if (unlikely(!dih)) {
+		err = -ENOMEM;
+		goto abort;
+	}
+
+	err = _dbucket_insert(tx, dir_zi, _dhead(fsbi, di, _dbucket(dih, hash)),
+			      hash, zi_ino(zi), IFTODT(zi->i_mode),
+			      str->name, str->len);
+	if (unlikely(err))
+		goto abort;
+
+	zus_std_add_dentry(dir_zi, zi);
+	split = ++dih->nentries > _dnbuckets(dih) * FOOFS_DIR_LOAD;
+
+	err = foofs_tx_commit(tx);
+	if (unlikely(err))
+		return err;
+
+	if (split)
+		_dsplit(fsbi, dir_ii->zi);
+
+	DBG("[%ld] [%.*s] ino=%ld\n",
+	    zi_ino(dir_ii->zi), str->len, str->name, zi_ino(zii->zi));
+	return 0;
+
+abort:
+	foofs_tx_abort(tx);
+	DBG("[%ld] [%.*s] => %d\n",
+	    zi_ino(dir_ii->zi), str->len, str->name, err);
+	return err;
+}
+
+int foofs_remove_dentry(struct zus_inode_info *dir_ii, struct zufs_str *str)
+{
+	struct foofs_sb_info *fsbi = FSBI(dir_ii->sbi);
+	struct zus_inode *dir_zi, *zi;
+	struct foofs_dindex *dih;
+	struct foofs_dblock *db;
+	struct foofs_tx *tx;
+	struct _dfind df;
+	ulong ino;
+
+	DBG("[%ld] [%.*s]\n", zi_ino(dir_ii->zi), str->len, str->name);
+
+	if (!_dir_find(fsbi, dir_ii->zi, str, &df))
+		return -ENOENT;
+
+	tx = foofs_tx_begin(fsbi);
+	if (unlikely(!tx))
+		return -ENOMEM;
+
+	ino = _dname(df.db, &df.db->slots[df.slot])->ino;
+	dir_zi = foofs_tx_stage(tx, dir_ii->zi, sizeof(*dir_zi));
+	zi = foofs_tx_stage(tx, find_zi(dir_ii->sbi, ino), sizeof(*zi));
+	dih = foofs_tx_stage(tx, _dindex(fsbi, dir_ii->zi), FOOFS_DIDX_HDR);
+	db = foofs_tx_stage(tx, df.db, PAGE_SIZE);
+	if (unlikely(!dir_zi || !zi || !dih || !db))
+		goto abort;
+
+	zus_std_remove_dentry(dir_zi, zi);
+
+	_dblk_remove(db, df.slot);
+	if (!db->live && unlikely(!_dbucket_trim(tx, dir_zi, df.head)))
+		goto abort;
+	--dih->nentries;
+
+	return foofs_tx_commit(tx);
+
+abort:
+	foofs_tx_abort(tx);
+	return -ENOMEM;
+}
+
+/* Hash bits that select bucket @b */
+static uint _dbucket_bits(struct foofs_dindex *di, ulong b)
+{
+	return (b < di->split || b >= (1UL << di->level)) ? di->level + 1 :
+							     di->level;
+}
+
+struct _dent {
+	uint rhash;
+	struct foofs_dblock *db;
+	struct foofs_dslot *ds;
+};
+
+static int _dent_cmp(const void *a, const void *b)
+{
+	const struct _dent *da = a, *db = b;
+	int cmp;
+
+	if (da->rhash != db->rhash)
+		return da->rhash < db->rhash ? -1 : 1;
+
+	cmp = memcmp(_dname(da->db, da->ds)->name, _dname(db->db, db->ds)->name,
+		     min_t(uint, da->ds->len, db->ds->len));
+	return cmp ?: (int)da->ds->len - (int)db->ds->len;
+}
+
+/* The live entries of a bucket in cookie order. *@n is their count */
+static struct _dent *_dbucket_sorted(struct foofs_sb_info *fsbi, ulong bn,
+				     ulong *n)
+{
+	struct _dent *ents;
+	ulong b;
+
+	*n = 0;
+	for (b = bn; b; b = ((struct foofs_dblock *)_baddr(fsbi, b))->next)
+		*n += ((struct foofs_dblock *)_baddr(fsbi, b))->live;
+	if (!*n)
+		return NULL;
+
+	ents = malloc(*n * sizeof(*ents));
+	if (unlikely(!ents))
+		return NULL;
+
+	*n = 0;
+	for (; bn; bn = ((struct foofs_dblock *)_baddr(fsbi, bn))->next) {
+		struct foofs_dblock *db = _baddr(fsbi, bn);
+		uint i;
+
+		for (i = 0; i < db->nslots; ++i) {
+			if (!db->slots[i].hash)
+				continue;
+			ents[*n].rhash = _drev(db->slots[i].hash);
+			ents[*n].db = db;
+			ents[*n].ds = &db->slots[i];
+			++*n;
+		}
+	}
+
+	qsort(ents, *n, sizeof(ents[0]), _dent_cmp);
+	return ents;
+}
+
+int foofs_readdir(void *app_ptr, struct zufs_ioc_readdir *zir)
+{
+	struct foofs_sb_info *fsbi = FSBI(zir->dir_ii->sbi);
+	struct zus_inode *dir_zi = zir->dir_ii->zi;
+	struct foofs_dindex *di = _dindex(fsbi, dir_zi);
+	struct zufs_readdir_iter rdi;
+	ulong rhash;
+	uint dup;
+
+	zufs_readdir_iter_init(&rdi, zir, app_ptr);
+
+	DBG("[0x%ld] pos 0x%lx\n", zi_ino(dir_zi), zir->pos);
+
+	if (zir->pos == 0) {
+		if (!zufs_zde_emit(&rdi, zi_ino(dir_zi), DT_DIR, 0, ".", 1))
+			return 0;
+		zir->pos = 1;
+	}
+	if (zir->pos == 1) {
+		if (!zufs_zde_emit(&rdi, dir_zi->i_dir.parent, DT_DIR, 1,
+				   "..", 2))
+			return 0;
+		zir->pos = FOOFS_DPOS_FIRST;
+	}
+	if (!di || zir->pos >= FOOFS_DPOS_END)
+		goto out;
+
+	rhash = (zir->pos - FOOFS_DPOS_FIRST) >> FOOFS_DPOS_DUP_BITS;
+	dup = (zir->pos - FOOFS_DPOS_FIRST) & FOOFS_DPOS_DUP_MAX;
+
+	/* Each round is the bucket of @rhash, from @rhash to its range end */
+	while (rhash <= 0xffffffffUL) {
+		ulong b = _dbucket(di, _drev(rhash));
+		ulong end = (ulong)_drev(b) + (1UL << (32 - _dbucket_bits(di, b)));
+		uint prev = 0, same = 0;
+		struct _dent *ents;
+		ulong i, n;
+
+		ents = _dbucket_sorted(fsbi, *_dhead(fsbi, di, b), &n);
+		if (unlikely(n && !ents))
+			return -ENOMEM;
+
+		for (i = 0; i < n; ++i) {
+			struct foofs_dname *dn = _dname(ents[i].db, ents[i].ds);
+			loff_t pos;
+
+			same = (i && ents[i].rhash == prev) ? same + 1 : 0;
+			prev = ents[i].rhash;
+			if (ents[i].rhash < rhash ||
+			    (ents[i].rhash == rhash && same < dup))
+				continue;
+
+			pos = _dpos(ents[i].rhash, same);
+			zir->pos = pos;
+			if (unlikely(!zufs_zde_emit(&rdi, dn->ino,
+						    ents[i].ds->type, pos,
+						    dn->name,
+						    ents[i].ds->len))) {
+				free(ents);
+				return 0;
+			}
+		}
+		free(ents);
+
+		rhash = end;
+		dup = 0;
+	}
+
+out:
+	zir->pos = FOOFS_DPOS_END;
+	return 0;
+}
+
+/* ~~~~ foofs.c helpers ~~~~ */
+
+static ulong _dir_walk(struct foofs_sb_info *fsbi, struct zus_inode *dir_zi,
+		       void (*blk_fn)(struct foofs_sb_info *fsbi,
+				      struct zus_inode *dir_zi, ulong bn))
+{
+	struct foofs_dindex *di = _dindex(fsbi, dir_zi);
+	ulong t, count = 0;
+
+	if (!di)
+		return 0;
+
+	for (t = 0; t < FOOFS_DIDX_TABLES; ++t) {
+		__le64 *table;
+		ulong b;
+
+		if (!di->tables[t])
+			continue;
+
+		table = _baddr(fsbi, di->tables[t]);
+		for (b = 0; b < FOOFS_DTAB_ENTS; ++b) {
+			ulong bn = table[b];
+
+			while (bn) {
+				ulong next = ((struct foofs_dblock *)
+						_baddr(fsbi, bn))->next;
+
+				blk_fn(fsbi, dir_zi, bn);
+				++count;
+				bn = next;
+			}
+		}
+		blk_fn(fsbi, dir_zi, di->tables[t]);
+		++count;
+	}
+
+	blk_fn(fsbi, dir_zi, dir_zi->i_on_disk.a[0]);
+	return count + 1;
+}
+
+static void _mark_blk(struct foofs_sb_info *fsbi, struct zus_inode *dir_zi,
+		      ulong bn)
+{
+	foofs_blk_mark_used(fsbi, bn);
+}
+
+/* At mount, returns the blocks this dir holds */
+ulong foofs_dir_mark_blocks(struct foofs_sb_info *fsbi,
+			    struct zus_inode *dir_zi)
+{
+	return _dir_walk(fsbi, dir_zi, _mark_blk);
+}
+
+void foofs_dir_free(struct foofs_sb_info *fsbi, struct zus_inode *dir_zi)
+{
+	_dir_walk(fsbi, dir_zi, _dir_blk_free);
+	dir_zi->i_on_disk.a[0] = 0;
+}
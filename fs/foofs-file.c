@@ -0,0 +1,1572 @@
+/*
+ * foofs-file.c - foofs regular files
+ *
+ * A file's data is mapped by a B+tree of extents rooted at the file's
+ * i_on_disk.a[0] (0 for a file with no blocks). Each tree node is one pmem
+ * block. A leaf entry maps [index, index + len) file blocks to [bn, bn + len)
+ * on pmem. An index entry points at a child node whose lowest mapped file
+ * block is not below the entry's index.
+ *
+ * Files grow by extents about the size of their current end (so small files
+ * stay small). Past the first 2M of a file, or once the file is bigger than
+ * 2M, a hole covering a whole 2M window of the file is mapped by a single 2M
+ * aligned extent, so DAX mmap can use huge pages.
+ *
+ * New blocks are zeroed before they are mapped. Each change of the tree (an
+ * insert with its splits, a splice, the removal of an extent) is one
+ * foofs_tx together with the root and i_blocks in the inode, so a crash
+ * leaves the tree as before or as after it. The blocks a change unmaps are
+ * only put once it is committed. A crash never exposes stale data, at worst
+ * it leaks the blocks of a tree that was being freed till the next mount
+ * scan.
+ *
+ * fallocate maps unwritten extents: their blocks are not zeroed, they read
+ * as a hole and are zeroed (where not written) when first written or
+ * faulted for write. SEEK_DATA/SEEK_HOLE also see them as holes.
+ *
+ * clone and copy_file_range map the source's data extents in the
+ * destination too, the blocks are then counted in fsbi->refs. A write, a
+ * write fault or a truncate that lands in a shared block first moves it to
+ * blocks of the file's own (copy on write). The old blocks are only put
+ * after the new ones are mapped, a crash leaves either.
+ *
+ * A new file starts inline (see FOOFS_INLINE_SLOTS): read, write and
+ * truncate serve it from the slots after its inode with no block lookup.
+ * It moves to a block of its own, in one tx, when it grows past the slots
+ * or when a block is needed (mmap, fallocate, a clone into it).
+ *
+ * File data that write, clone and the zeroing of new blocks store is
+ * non-temporal and fenced before the op returns. The tree is durable when
+ * its tx commits. A new i_size is a plain store that stays in the CPU
+ * caches, like the stores of an application to a writable mmap. fsync
+ * (foofs_sync) flushes them: the inode when its size grew since the last
+ * fsync, and the mapped data range of a file that was mapped for write.
+ * An fsync of a file that was only overwritten flushes nothing. Concurrent
+ * fsyncs are one group commit (zus_gcommit) and share one fence.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <linux/falloc.h>
+
+#include "zus.h"
+#include "b-minmax.h"
+#include "nv.h"
+#include "foofs.h"
+
+/* The Kernel's WRITE in zufs_ioc_get_block.rw */
+#define FOOFS_GB_WRITE		1
+
+#define FOOFS_XLEN_SHIFT	48
+#define FOOFS_XUNWRITTEN	(1UL << (FOOFS_XLEN_SHIFT - 1))
+#define FOOFS_XBN_MASK		(FOOFS_XUNWRITTEN - 1)
+#define FOOFS_XMAX_LEN		((1UL << (64 - FOOFS_XLEN_SHIFT)) - 1)
+#define FOOFS_XMAX_DEPTH	8
+
+struct foofs_xent {
+	__le64 index;	/* First file block */
+	__le64 val;	/* leaf: bn | flags | len << FOOFS_XLEN_SHIFT,
+			 * index: child bn
+			 */
+};
+
+#define FOOFS_XENTS	((PAGE_SIZE - 16) / sizeof(struct foofs_xent))
+
+struct foofs_xnode {
+	__le16 nr;
+	__le16 depth;	/* 0 is a leaf */
+	__le32 pad;
+	__le64 pad2;
+	struct foofs_xent ents[FOOFS_XENTS];
+};
+
+/* Result of a lookup of one file block */
+struct _xmap {
+	ulong bn;	/* 0 for a hole */
+	bool unwritten;	/* @bn is allocated but reads as a hole */
+	ulong run;	/* Mapped (or hole) blocks from the looked up one on */
+	bool has_prev;	/* There is an extent before the hole */
+	ulong prev_end;	/* The file block after it */
+	ulong prev_end_bn; /* The pmem block after it */
+};
+
+static inline ulong _xbn(struct foofs_xent *xe)
+{
+	return xe->val & FOOFS_XBN_MASK;
+}
+
+/* bn and flags, what _xset wants to keep an extent as it is */
+static inline ulong _xraw(struct foofs_xent *xe)
+{
+	return xe->val & ((1UL << FOOFS_XLEN_SHIFT) - 1);
+}
+
+static inline ulong _xlen(struct foofs_xent *xe)
+{
+	return xe->val >> FOOFS_XLEN_SHIFT;
+}
+
+static inline void _xset(struct foofs_xent *xe, ulong index, ulong bn,
+			 ulong len)
+{
+	xe->index = index;
+	xe->val = bn | (len << FOOFS_XLEN_SHIFT);
+}
+
+static struct foofs_xnode *_xnode(struct foofs_sb_info *fsbi, ulong bn)
+{
+	return pmem_baddr(&fsbi->sbi.pmem, bn);
+}
+
+/* Last entry with index <= @idx, or 0 if none */
+static uint _xsearch(struct foofs_xnode *xn, ulong idx)
+{
+	uint lo = 0, hi = xn->nr;
+
+	while (lo < hi) {
+		uint mid = (lo + hi) / 2;
+
+		if (xn->ents[mid].index <= idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? lo - 1 : 0;
+}
+
+static void _xlookup(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		     ulong idx, struct _xmap *m)
+{
+	ulong next = ~0UL;
+	struct foofs_xnode *xn;
+	struct foofs_xent *xe;
+	uint i;
+
+	memset(m, 0, sizeof(*m));
+	m->run = ~0UL;
+	if (!zi->i_on_disk.a[0])
+		return;
+
+	xn = _xnode(fsbi, zi->i_on_disk.a[0]);
+	while (xn->depth) {
+		i = _xsearch(xn, idx);
+		if (i + 1 < xn->nr)
+			next = min_t(ulong, next, xn->ents[i + 1].index);
+		xn = _xnode(fsbi, xn->ents[i].val);
+	}
+	if (unlikely(!xn->nr))
+		return;
+
+	i = _xsearch(xn, idx);
+	xe = &xn->ents[i];
+	if (xe->index <= idx) {
+		if (idx < xe->index + _xlen(xe)) {
+			m->bn = _xbn(xe) + idx - xe->index;
+			m->unwritten = xe->val & FOOFS_XUNWRITTEN;
+			m->run = xe->index + _xlen(xe) - idx;
+			return;
+		}
+		m->has_prev = true;
+		m->prev_end = xe->index + _xlen(xe);
+		m->prev_end_bn = _xbn(xe) + _xlen(xe);
+		if (i + 1 < xn->nr)
+			next = min_t(ulong, next, xn->ents[i + 1].index);
+	} else {
+		next = min_t(ulong, next, xe->index);
+	}
+
+	if (next != ~0UL)
+		m->run = next - idx;
+}
+
+/* A change of a file's extent tree, in one foofs_tx. The nodes it changes
+ * and the inode are staged (@zi is the staged inode), the nodes it
+ * allocates are fresh and the ones it frees are released by the commit.
+ * Until then it is all as before on pmem, an abort leaves nothing behind.
+ */
+struct _xtx {
+	struct foofs_sb_info *fsbi;
+	struct foofs_tx *tx;
+	struct zus_inode *zi;
+};
+
+static int _xtx_begin(struct _xtx *x, struct foofs_sb_info *fsbi,
+		      struct zus_inode *zi)
+{
+	x->fsbi = fsbi;
+	x->tx = foofs_tx_begin(fsbi);
+	if (unlikely(!x->tx))
+		return -ENOMEM;
+
+	x->zi = foofs_tx_stage(x->tx, zi, sizeof(*zi));
+	if (unlikely(!x->zi)) {
+		foofs_tx_abort(x->tx);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Commit the tx, or abort it on @err */
+static int _xtx_end(struct _xtx *x, int err)
+{
+	if (unlikely(err)) {
+		foofs_tx_abort(x->tx);
+		return err;
+	}
+	return foofs_tx_commit(x->tx);
+}
+
+/* Node @bn as the tx sees it */
+static struct foofs_xnode *_xrd(struct _xtx *x, ulong bn)
+{
+	return foofs_tx_rd(x->tx, _xnode(x->fsbi, bn));
+}
+
+/* Node @bn to change. NULL when the tx is full */
+static struct foofs_xnode *_xwr(struct _xtx *x, ulong bn)
+{
+	return foofs_tx_stage(x->tx, _xnode(x->fsbi, bn), PAGE_SIZE);
+}
+
+static ulong _xblk_fresh(struct foofs_tx *tx)
+{
+	ulong bn = foofs_blk_alloc(tx->fsbi);
+
+	if (unlikely(!bn))
+		return 0;
+
+	if (unlikely(!foofs_tx_fresh(tx, bn))) {
+		foofs_blk_free(tx->fsbi, bn);
+		return 0;
+	}
+	return bn;
+}
+
+static ulong _xnode_alloc(struct _xtx *x, uint depth)
+{
+	ulong bn = _xblk_fresh(x->tx);
+	struct foofs_xnode *xn;
+
+	if (unlikely(!bn))
+		return 0;
+
+	xn = _xnode(x->fsbi, bn);
+	memset(xn, 0, sizeof(*xn));
+	xn->depth = depth;
+	++x->zi->i_blocks;
+	return bn;
+}
+
+static int _xnode_free(struct _xtx *x, ulong bn)
+{
+	if (unlikely(!foofs_tx_free(x->tx, bn)))
+		return -ENOMEM;
+	--x->zi->i_blocks;
+	return 0;
+}
+
+static void _xput(struct foofs_xnode *xn, uint pos, struct foofs_xent *xe)
+{
+	memmove(&xn->ents[pos + 1], &xn->ents[pos],
+		(xn->nr - pos) * sizeof(*xe));
+	xn->ents[pos] = *xe;
+	++xn->nr;
+}
+
+/* Map [@index, @index + @len) to @bn. The range must be a hole */
+static int _xinsert(struct _xtx *x, ulong index, ulong bn, ulong len)
+{
+	struct {
+		ulong bn;
+		uint pos;
+	} path[FOOFS_XMAX_DEPTH];
+	ulong nbn = x->zi->i_on_disk.a[0];
+	struct foofs_xnode *xn;
+	struct foofs_xent xe;
+	int l = 0;
+	uint i;
+
+	_xset(&xe, index, bn, len);
+	if (!nbn) {
+		nbn = _xnode_alloc(x, 0);
+		if (unlikely(!nbn))
+			return -ENOSPC;
+		_xput(_xnode(x->fsbi, nbn), 0, &xe);
+		x->zi->i_on_disk.a[0] = nbn;
+		return 0;
+	}
+
+	for (;; ++l) {
+		xn = _xrd(x, nbn);
+		i = _xsearch(xn, index);
+		path[l].bn = nbn;
+		if (!xn->depth)
+			break;
+
+		/* The hole runs over the index of the next child (whose
+		 * first entries were removed), so it goes in there. An
+		 * extent never crosses an index, lookups would miss its end
+		 */
+		if (i + 1 < xn->nr && xn->ents[i + 1].index < index + len)
+			++i;
+
+		/* Keep the index at or below everything in the child */
+		if (index < xn->ents[i].index) {
+			xn = _xwr(x, nbn);
+			if (unlikely(!xn))
+				return -ENOMEM;
+			xn->ents[i].index = index;
+		}
+		path[l].pos = i;
+		nbn = xn->ents[i].val;
+	}
+
+	if (xn->nr && xn->ents[i].index <= index) {
+		struct foofs_xent *prev = &xn->ents[i];
+
+		if (prev->index + _xlen(prev) == index &&
+		    _xraw(prev) + _xlen(prev) == bn &&
+		    _xlen(prev) + len <= FOOFS_XMAX_LEN) {
+			xn = _xwr(x, nbn);
+			if (unlikely(!xn))
+				return -ENOMEM;
+			prev = &xn->ents[i];
+			_xset(prev, prev->index, _xraw(prev), _xlen(prev) + len);
+			return 0;
+		}
+		path[l].pos = i + 1;
+	} else {
+		path[l].pos = 0;
+	}
+
+	for (; l >= 0; --l) {
+		uint pos = path[l].pos, half;
+		struct foofs_xnode *right;
+		ulong rbn;
+
+		xn = _xwr(x, path[l].bn);
+		if (unlikely(!xn))
+			return -ENOMEM;
+		if (xn->nr < FOOFS_XENTS) {
+			_xput(xn, pos, &xe);
+			return 0;
+		}
+
+		/* An append leaves the left node full */
+		half = (pos == xn->nr) ? xn->nr : xn->nr / 2;
+		rbn = _xnode_alloc(x, xn->depth);
+		if (unlikely(!rbn))
+			return -ENOSPC;
+
+		right = _xnode(x->fsbi, rbn);
+		right->nr = xn->nr - half;
+		memcpy(right->ents, &xn->ents[half], right->nr * sizeof(xe));
+		xn->nr = half;
+		if (pos <= half && half != FOOFS_XENTS)
+			_xput(xn, pos, &xe);
+		else
+			_xput(right, pos - half, &xe);
+
+		xe.index = right->ents[0].index;
+		xe.val = rbn;
+		if (l) {
+			++path[l - 1].pos;
+			continue;
+		}
+
+		if (unlikely(xn->depth + 1 >= FOOFS_XMAX_DEPTH))
+			return -EFBIG;
+
+		/* A new root above the old one and @right */
+		rbn = _xnode_alloc(x, xn->depth + 1);
+		if (unlikely(!rbn))
+			return -ENOSPC;
+		right = _xnode(x->fsbi, rbn);
+		right->nr = 2;
+		right->ents[0].index = xn->ents[0].index;
+		right->ents[0].val = x->zi->i_on_disk.a[0];
+		right->ents[1] = xe;
+		x->zi->i_on_disk.a[0] = rbn;
+	}
+
+	return 0;
+}
+
+/* The leaf entry that maps @idx, NULL for a hole. Its node is at @leaf */
+static struct foofs_xent *_xfind(struct _xtx *x, ulong idx, ulong *leaf)
+{
+	ulong bn = x->zi->i_on_disk.a[0];
+	struct foofs_xnode *xn;
+	struct foofs_xent *xe;
+
+	if (!bn)
+		return NULL;
+
+	xn = _xrd(x, bn);
+	while (xn->depth) {
+		bn = xn->ents[_xsearch(xn, idx)].val;
+		xn = _xrd(x, bn);
+	}
+	if (unlikely(!xn->nr))
+		return NULL;
+
+	*leaf = bn;
+	xe = &xn->ents[_xsearch(xn, idx)];
+	return (xe->index <= idx && idx < xe->index + _xlen(xe)) ? xe : NULL;
+}
+
+/* Remove the leaf entry at @idx, and the nodes it leaves empty */
+static int _xdel(struct _xtx *x, ulong idx)
+{
+	struct {
+		ulong bn;
+		uint pos;
+	} path[FOOFS_XMAX_DEPTH];
+	ulong bn = x->zi->i_on_disk.a[0];
+	struct foofs_xnode *xn;
+	int l, err;
+
+	for (l = 0; l < FOOFS_XMAX_DEPTH; ++l) {
+		xn = _xrd(x, bn);
+		path[l].bn = bn;
+		path[l].pos = _xsearch(xn, idx);
+		if (!xn->depth)
+			break;
+		bn = xn->ents[path[l].pos].val;
+	}
+
+	for (; l >= 0; --l) {
+		uint pos = path[l].pos;
+
+		xn = _xrd(x, path[l].bn);
+		if (1 < xn->nr) {
+			xn = _xwr(x, path[l].bn);
+			if (unlikely(!xn))
+				return -ENOMEM;
+			memmove(&xn->ents[pos], &xn->ents[pos + 1],
+				(xn->nr - pos - 1) * sizeof(xn->ents[0]));
+			--xn->nr;
+			return 0;
+		}
+
+		/* Its last entry, the node goes */
+		err = _xnode_free(x, path[l].bn);
+		if (unlikely(err))
+			return err;
+	}
+	x->zi->i_on_disk.a[0] = 0;
+	return 0;
+}
+
+/* Unmap [@idx, @idx + @len), which is inside one extent, and map @bn (and
+ * its flags) there instead if not 0
+ */
+static int _xsplice(struct _xtx *x, ulong idx, ulong len, ulong bn)
+{
+	struct foofs_xnode *xn;
+	struct foofs_xent *xe;
+	ulong leaf, ei, eb, el;
+	int err;
+
+	xe = _xfind(x, idx, &leaf);
+	if (unlikely(!xe || xe->index + _xlen(xe) < idx + len)) {
+		ERROR("[%lld] idx=0x%lx len=0x%lx is not one extent\n",
+		      x->zi->i_ino, idx, len);
+		return -EIO;
+	}
+
+	ei = xe->index;
+	eb = _xraw(xe);
+	el = _xlen(xe);
+	if (idx == ei && len == el && !bn)
+		return _xdel(x, ei);
+
+	xn = _xwr(x, leaf);
+	if (unlikely(!xn))
+		return -ENOMEM;
+	xe = &xn->ents[_xsearch(xn, idx)];
+	if (idx == ei && len == el) {
+		_xset(xe, ei, bn, el);
+		return 0;
+	}
+
+	if (idx == ei) {
+		_xset(xe, idx + len, eb + len, el - len);
+	} else {
+		_xset(xe, ei, eb, idx - ei);
+		if (idx + len < ei + el) {
+			err = _xinsert(x, idx + len, eb + idx + len - ei,
+				       ei + el - idx - len);
+			if (unlikely(err))
+				return err;
+		}
+	}
+	if (!bn)
+		return 0;
+
+	return _xinsert(x, idx, bn, len);
+}
+
+/* _xinsert() in a tx of its own, the @len blocks are counted in i_blocks */
+static int _xinsert_tx(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		       ulong index, ulong bn, ulong len)
+{
+	struct _xtx x;
+	int err = _xtx_begin(&x, fsbi, zi);
+
+	if (unlikely(err))
+		return err;
+
+	err = _xinsert(&x, index, bn, len);
+	if (likely(!err))
+		x.zi->i_blocks += len;
+	return _xtx_end(&x, err);
+}
+
+/* _xsplice() in a tx of its own, @blocks is added to i_blocks. A crash
+ * leaves the old or the new mapping.
+ */
+static int _xsplice_tx(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		       ulong idx, ulong len, ulong bn, long blocks)
+{
+	struct _xtx x;
+	int err = _xtx_begin(&x, fsbi, zi);
+
+	if (unlikely(err))
+		return err;
+
+	err = _xsplice(&x, idx, len, bn);
+	if (likely(!err))
+		x.zi->i_blocks += blocks;
+	return _xtx_end(&x, err);
+}
+
+/* Unmap file blocks [@from, @to). A tx for each extent, its blocks are put
+ * once it is committed
+ */
+static int _xpunch(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		   ulong from, ulong to)
+{
+	while (from < to) {
+		struct _xmap m;
+		ulong n;
+		int err;
+
+		_xlookup(fsbi, zi, from, &m);
+		n = min_t(ulong, m.run, to - from);
+		if (m.bn) {
+			err = _xsplice_tx(fsbi, zi, from, n, 0, -(long)n);
+			if (unlikely(err))
+				return err;
+			foofs_ext_put(fsbi, m.bn, n);
+		}
+		from += n;
+	}
+
+	return 0;
+}
+
+/* Put the data and free the nodes of the tree at @bn, that no inode maps
+ * any more. A crash in the middle leaks the rest till the next mount.
+ */
+static void _xfree_tree(struct foofs_sb_info *fsbi, ulong bn)
+{
+	struct foofs_xnode *xn = _xnode(fsbi, bn);
+	uint i;
+
+	for (i = 0; i < xn->nr; ++i) {
+		struct foofs_xent *xe = &xn->ents[i];
+
+		if (xn->depth)
+			_xfree_tree(fsbi, xe->val);
+		else
+			foofs_ext_put(fsbi, _xbn(xe), _xlen(xe));
+	}
+	foofs_blk_free(fsbi, bn);
+}
+
+/* Unmap all file blocks from @from on */
+static int _xtruncate(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		      ulong from)
+{
+	ulong root = zi->i_on_disk.a[0];
+	struct _xtx x;
+	int err;
+
+	if (!root)
+		return 0;
+	if (from)
+		return _xpunch(fsbi, zi, from, ~0UL);
+
+	/* All of it. The tree is cut off the inode, then freed */
+	err = _xtx_begin(&x, fsbi, zi);
+	if (unlikely(err))
+		return err;
+	x.zi->i_on_disk.a[0] = 0;
+	x.zi->i_blocks = 0;
+	err = _xtx_end(&x, 0);
+	if (unlikely(err))
+		return err;
+
+	_xfree_tree(fsbi, root);
+	return 0;
+}
+
+/* Allocate and map blocks for the hole at @idx, described by @m */
+static int _xalloc(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		   ulong idx, struct _xmap *m)
+{
+	ulong win = idx & ~(FOOFS_HUGE_BLOCKS - 1);
+	ulong hole_end = (m->run == ~0UL) ? ~0UL : idx + m->run;
+	ulong start, want, goal, bn, len;
+	bool huge;
+	int err;
+
+	huge = (win >= FOOFS_HUGE_BLOCKS ||
+		win + FOOFS_HUGE_BLOCKS <= pmem_o2p_up(zi->i_size)) &&
+	       (!m->has_prev || m->prev_end <= win) &&
+	       win + FOOFS_HUGE_BLOCKS <= hole_end;
+	if (huge) {
+		start = win;
+		want = FOOFS_HUGE_BLOCKS;
+	} else {
+		start = idx;
+		want = min_t(ulong, hole_end, win + FOOFS_HUGE_BLOCKS) - idx;
+		want = min_t(ulong, want, idx ?: 1);
+	}
+	goal = m->has_prev ? m->prev_end_bn + (start - m->prev_end) : 0;
+
+	bn = foofs_ext_alloc(fsbi, goal, want, huge, &len);
+	if (unlikely(!bn))
+		return -ENOSPC;
+	if (unlikely(start + len <= idx)) {
+		/* Not the aligned extent we wanted. At @idx it must not run
+		 * past the hole
+		 */
+		start = idx;
+		if (hole_end - idx < len) {
+			foofs_ext_free(fsbi, bn + hole_end - idx,
+				       len - (hole_end - idx));
+			len = hole_end - idx;
+		}
+	}
+
+	/* The commit's fence makes the zeros durable before the mapping */
+	pmem_memset_nt(pmem_baddr(&fsbi->sbi.pmem, bn), 0, len << PAGE_SHIFT);
+
+	err = _xinsert_tx(fsbi, zi, start, bn, len);
+	if (unlikely(err)) {
+		foofs_ext_free(fsbi, bn, len);
+		return err;
+	}
+
+	m->bn = bn + idx - start;
+	m->run = len - (idx - start);
+	return 0;
+}
+
+/* Give the shared [@idx, @idx + @len) of @m blocks of the file's own. The
+ * blocks a write of [@wpos, @wend) covers whole are not copied. May move
+ * less than @len, @m is then the new mapping.
+ */
+static int _xcow(struct foofs_sb_info *fsbi, struct zus_inode *zi, ulong idx,
+		 ulong len, struct _xmap *m, ulong wpos, ulong wend)
+{
+	struct zus_pmem *pmem = &fsbi->sbi.pmem;
+	ulong old = m->bn, bn, got, b;
+	int err;
+
+	bn = foofs_ext_alloc(fsbi, 0, len, false, &got);
+	if (unlikely(!bn))
+		return -ENOSPC;
+
+	for (b = 0; b < got; ++b) {
+		ulong bpos = (idx + b) << PAGE_SHIFT;
+
+		if (bpos < wpos || wend < bpos + PAGE_SIZE)
+			pmem_memcpy_nt(pmem_baddr(pmem, bn + b),
+				       pmem_baddr(pmem, old + b), PAGE_SIZE);
+	}
+	/* The copy must land before the new blocks are mapped */
+	pmem_fence();
+
+	err = _xsplice_tx(fsbi, zi, idx, got, bn, 0);
+	if (unlikely(err)) {
+		foofs_ext_free(fsbi, bn, got);
+		return err;
+	}
+	/* Not mapped here any more, durably */
+	foofs_ext_put(fsbi, old, got);
+
+	m->bn = bn;
+	m->run = got;
+	return 0;
+}
+
+/* Zero the unwritten block @idx of @m and map it as written */
+static int _xwritten(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		     ulong idx, struct _xmap *m)
+{
+	int err;
+
+	pmem_memset_nt(pmem_baddr(&fsbi->sbi.pmem, m->bn), 0, PAGE_SIZE);
+	pmem_fence();
+
+	err = _xsplice_tx(fsbi, zi, idx, 1, m->bn, 0);
+	if (unlikely(err))
+		return err;
+
+	m->unwritten = false;
+	m->run = 1;
+	return 0;
+}
+
+/* Make block @idx of the mapping @m one of the file's own that can be
+ * stored to directly, for a write fault: a hole is allocated, an unwritten
+ * block is zeroed and a shared one copied. @m is then the new mapping.
+ */
+static int _xown(struct foofs_sb_info *fsbi, struct zus_inode *zi, ulong idx,
+		 struct _xmap *m)
+{
+	ulong run;
+
+	if (!m->bn)
+		return _xalloc(fsbi, zi, idx, m);
+	if (m->unwritten)
+		return _xwritten(fsbi, zi, idx, m);
+	if (foofs_ext_shared(fsbi, m->bn, 1, &run))
+		return _xcow(fsbi, zi, idx, 1, m, 0, 0);
+	return 0;
+}
+
+/* Zero [@pos, @end) inside one block, so it reads as zeros from now on */
+static int _xzero(struct foofs_sb_info *fsbi, struct zus_inode *zi, ulong pos,
+		  ulong end)
+{
+	ulong idx = pos >> PAGE_SHIFT, run;
+	struct _xmap m;
+	int err;
+
+	_xlookup(fsbi, zi, idx, &m);
+	if (!m.bn || m.unwritten)
+		return 0;
+
+	if (foofs_ext_shared(fsbi, m.bn, 1, &run)) {
+		err = _xcow(fsbi, zi, idx, 1, &m, 0, 0);
+		if (unlikely(err))
+			return err;
+	}
+
+	pmem_memset_nt(pmem_baddr(&fsbi->sbi.pmem, m.bn) +
+		       (pos & (PAGE_SIZE - 1)), 0, end - pos);
+	pmem_fence();
+	return 0;
+}
+
+/* Make a file with no blocks hold @size bytes inline. False if it cannot,
+ * it then has to use blocks.
+ */
+static bool _iroom(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		   ulong size)
+{
+	ulong have = foofs_inline_slots(zi);
+	ulong want = (size + ZUFS_INODE_SIZE - 1) / ZUFS_INODE_SIZE;
+
+	if (zi->i_on_disk.a[0])
+		return false;
+	if (want <= have)
+		return true;
+	if (FOOFS_INLINE_SLOTS < want ||
+	    !foofs_inline_claim(fsbi, zi_ino(zi), have, want))
+		return false;
+
+	/* Owned before they are written */
+	zi->i_on_disk.a[1] = want;
+	pmem_persist(&zi->i_on_disk, sizeof(zi->i_on_disk));
+	return true;
+}
+
+/* Move an inline file's data to a block of its own. One tx, a crash leaves
+ * the data in the slots or in the block (and the slots zeros).
+ */
+static int _xuninline(struct foofs_sb_info *fsbi, struct zus_inode *zi)
+{
+	ulong slots = foofs_inline_slots(zi), size = zi->i_size;
+	struct zus_inode *szi;
+	struct foofs_xnode *xn;
+	struct foofs_xent xe;
+	struct foofs_tx *tx;
+	ulong bn, root;
+	void *addr;
+	int err;
+
+	if (likely(!slots))
+		return 0;
+
+	if (!size) {
+		/* Nothing to move, the slots are zeros */
+		zi->i_on_disk.a[1] = 0;
+		pmem_persist(&zi->i_on_disk, sizeof(zi->i_on_disk));
+		goto out;
+	}
+
+	tx = foofs_tx_begin(fsbi);
+	if (unlikely(!tx))
+		return -ENOMEM;
+
+	bn = _xblk_fresh(tx);
+	root = bn ? _xblk_fresh(tx) : 0;
+	if (unlikely(!root)) {
+		foofs_tx_abort(tx);
+		return -ENOSPC;
+	}
+
+	/* Fresh blocks, flushed by the commit */
+	addr = pmem_baddr(&fsbi->sbi.pmem, bn);
+	memcpy(addr, foofs_inline(zi), size);
+	memset(addr + size, 0, PAGE_SIZE - size);
+
+	xn = _xnode(fsbi, root);
+	memset(xn, 0, sizeof(*xn));
+	_xset(&xe, 0, bn, 1);
+	_xput(xn, 0, &xe);
+
+	szi = foofs_tx_stage(tx, zi, (1 + slots) * sizeof(*zi));
+	if (unlikely(!szi)) {
+		foofs_tx_abort(tx);
+		return -ENOMEM;
+	}
+	szi->i_on_disk.a[0] = root;
+	szi->i_on_disk.a[1] = 0;
+	szi->i_blocks += 2;
+	memset(foofs_inline(szi), 0, slots * sizeof(*zi));
+
+	err = foofs_tx_commit(tx);
+	if (unlikely(err))
+		return err;
+out:
+	foofs_inline_free(fsbi, zi_ino(zi), slots);
+	return 0;
+}
+
+/* Bytes up to @max from @off in the first of @run blocks */
+static ulong _run_bytes(ulong run, ulong off, ulong max)
+{
+	if (run > (off + max) >> PAGE_SHIFT)
+		return max;
+	return min_t(ulong, max, run * PAGE_SIZE - off);
+}
+
+/* Grow @zii to @size. A plain store, foofs_sync() then flushes the inode */
+static void _set_size(struct zus_inode_info *zii, ulong size)
+{
+	zii->zi->i_size = size;
+	__atomic_add_fetch(&FII(zii)->mgen, 1, __ATOMIC_RELAXED);
+}
+
+int foofs_read(void *app_ptr, struct zufs_ioc_IO *io)
+{
+	struct zus_inode_info *zii = io->zus_ii;
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	struct zus_inode *zi = zii->zi;
+	ulong pos = io->filepos;
+	ulong end = min_t(ulong, pos + io->hdr.len, zi->i_size);
+
+	pthread_rwlock_rdlock(&FII(zii)->lock);
+	if (foofs_inline_slots(zi)) {
+		end = min_t(ulong, end, foofs_inline_max(zi));
+		if (pos < end)
+			memcpy(app_ptr, foofs_inline(zi) + pos, end - pos);
+		goto out;
+	}
+
+	while (pos < end) {
+		ulong off = pos & (PAGE_SIZE - 1);
+		struct _xmap m;
+		ulong n;
+
+		_xlookup(fsbi, zi, pos >> PAGE_SHIFT, &m);
+		n = _run_bytes(m.run, off, end - pos);
+		if (m.bn && !m.unwritten)
+			memcpy(app_ptr, pmem_baddr(&zii->sbi->pmem, m.bn) + off,
+			       n);
+		else
+			memset(app_ptr, 0, n);
+
+		app_ptr += n;
+		pos += n;
+	}
+out:
+	pthread_rwlock_unlock(&FII(zii)->lock);
+
+	return 0;
+}
+
+/* Copy @buf to the file from @pos up to @end, @pos is advanced by what was
+ * written. The caller holds the write lock, fences and sets the size.
+ */
+static int _xwrite(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		   const void *buf, ulong *pos, ulong end)
+{
+	while (*pos < end) {
+		ulong idx = *pos >> PAGE_SHIFT;
+		ulong off = *pos & (PAGE_SIZE - 1);
+		struct _xmap m;
+		ulong n, run;
+		void *addr;
+		int err = 0;
+
+		_xlookup(fsbi, zi, idx, &m);
+		if (!m.bn) {
+			err = _xalloc(fsbi, zi, idx, &m);
+		} else {
+			n = min_t(ulong, m.run, pmem_o2p_up(end) - idx);
+			if (m.unwritten)
+				m.run = n;
+			else if (foofs_ext_shared(fsbi, m.bn, n, &run))
+				err = _xcow(fsbi, zi, idx, run, &m, *pos, end);
+			else
+				m.run = run;
+		}
+		if (unlikely(err))
+			return err;
+
+		n = _run_bytes(m.run, off, end - *pos);
+		addr = pmem_baddr(&fsbi->sbi.pmem, m.bn);
+		if (unlikely(m.unwritten)) {
+			ulong tail = (m.run << PAGE_SHIFT) - off - n;
+
+			if (off)
+				pmem_memset_nt(addr, 0, off);
+			if (tail)
+				pmem_memset_nt(addr + off + n, 0, tail);
+		}
+		pmem_memcpy_nt(addr + off, buf, n);
+
+		/* Mapped as written only once all of it is */
+		if (unlikely(m.unwritten)) {
+			pmem_fence();
+			err = _xsplice_tx(fsbi, zi, idx, m.run, m.bn, 0);
+			if (unlikely(err))
+				return err;
+		}
+
+		buf += n;
+		*pos += n;
+	}
+
+	return 0;
+}
+
+/* _xwrite() of a file that may be inline. It is while it fits */
+static int _iwrite(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		   const void *buf, ulong *pos, ulong end)
+{
+	int err;
+
+	if (_iroom(fsbi, zi, max_t(ulong, end, zi->i_size))) {
+		pmem_memcpy_nt(foofs_inline(zi) + *pos, buf, end - *pos);
+		*pos = end;
+		return 0;
+	}
+
+	err = _xuninline(fsbi, zi);
+	if (unlikely(err))
+		return err;
+	return _xwrite(fsbi, zi, buf, pos, end);
+}
+
+int foofs_write(void *app_ptr, struct zufs_ioc_IO *io)
+{
+	struct zus_inode_info *zii = io->zus_ii;
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	struct zus_inode *zi = zii->zi;
+	ulong pos = io->filepos;
+	int err;
+
+	pthread_rwlock_wrlock(&FII(zii)->lock);
+	err = _iwrite(fsbi, zi, app_ptr, &pos, pos + io->hdr.len);
+	/* One fence for all the copies above */
+	pmem_fence();
+
+	if (zi->i_size < pos)
+		_set_size(zii, pos);
+	pthread_rwlock_unlock(&FII(zii)->lock);
+
+	return err;
+}
+
+int foofs_get_block(struct zus_inode_info *zii,
+		    struct zufs_ioc_get_block *get_block)
+{
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	ulong idx = get_block->index, run;
+	struct zus_inode *zi = zii->zi;
+	struct _xmap m;
+	bool own;	/* Needs a block of its own */
+	int err = 0;
+
+	pthread_rwlock_rdlock(&FII(zii)->lock);
+	_xlookup(fsbi, zi, idx, &m);
+	/* An mmap of an inline file needs the data in a block first */
+	own = foofs_inline_slots(zi) ||
+	      ((get_block->rw & FOOFS_GB_WRITE) &&
+	       (!m.bn || m.unwritten ||
+		foofs_ext_shared(fsbi, m.bn, 1, &run)));
+	if (get_block->rw & FOOFS_GB_WRITE)
+		__atomic_store_n(&FII(zii)->wmapped, true, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&FII(zii)->lock);
+
+	if (own) {
+		pthread_rwlock_wrlock(&FII(zii)->lock);
+		err = _xuninline(fsbi, zi);
+		_xlookup(fsbi, zi, idx, &m);
+		if (likely(!err) && (get_block->rw & FOOFS_GB_WRITE))
+			err = _xown(fsbi, zi, idx, &m);
+		pthread_rwlock_unlock(&FII(zii)->lock);
+		/* The zeroing must land before the app stores through the map */
+		pmem_fence();
+	}
+
+	/* A read of a hole returns 0, the Kernel maps its zero page */
+	get_block->pmem_bn = m.unwritten ? 0 : m.bn;
+	return err;
+}
+
+/* What a foofs_sync() caller needs flushed */
+struct _sync_req {
+	struct zus_gcommit_req zgr;	/* Must be first */
+	struct zus_inode_info *zii;
+	bool meta;		/* The inode, for a new i_size */
+	ulong mgen;		/* Of the flushed inode, set by the commit */
+	ulong first, end;	/* Mapped data blocks, none if equal */
+};
+
+/* Flush the written blocks of [@first, @end) */
+static void _xflush(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		    ulong first, ulong end)
+{
+	while (first < end) {
+		struct _xmap m;
+		ulong n;
+
+		_xlookup(fsbi, zi, first, &m);
+		n = min_t(ulong, m.run, end - first);
+		if (m.bn && !m.unwritten)
+			pmem_flush(pmem_baddr(&fsbi->sbi.pmem, m.bn),
+				   n << PAGE_SHIFT);
+		first += n;
+	}
+}
+
+/* The zus_gcommit of all the foofs_sync()s that came together. What an
+ * earlier request of the same file already flushed is not flushed again.
+ * The flushes write the lines back from whichever cache holds them, so the
+ * one fence after them here persists the files of all the callers. Only
+ * then the flushed mgen is published in sgen.
+ */
+int foofs_sync_commit(struct zus_gcommit *zgc, struct zus_gcommit_req *reqs)
+{
+	struct _sync_req *sr, *o;
+
+	for (sr = (void *)reqs; sr; sr = (void *)sr->zgr.next) {
+		struct zus_inode_info *zii = sr->zii;
+		bool meta = sr->meta, data = sr->first < sr->end;
+
+		for (o = (void *)reqs; o != sr; o = (void *)o->zgr.next) {
+			if (o->zii != zii)
+				continue;
+			if (o->meta)
+				meta = false;
+			if (o->first <= sr->first && sr->end <= o->end)
+				data = false;
+		}
+		sr->meta = meta;
+		if (!meta && !data)
+			continue;
+
+		pthread_rwlock_rdlock(&FII(zii)->lock);
+		if (meta) {
+			sr->mgen = __atomic_load_n(&FII(zii)->mgen,
+						   __ATOMIC_RELAXED);
+			pmem_flush(zii->zi, sizeof(*zii->zi));
+		}
+		if (data)
+			_xflush(FSBI(zii->sbi), zii->zi, sr->first, sr->end);
+		pthread_rwlock_unlock(&FII(zii)->lock);
+	}
+	pmem_fence();
+
+	/* One commit at a time, so sgen only grows */
+	for (sr = (void *)reqs; sr; sr = (void *)sr->zgr.next)
+		if (sr->meta)
+			__atomic_store_n(&FII(sr->zii)->sgen, sr->mgen,
+					 __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* ZUS_OP_SYNC of [offset, offset + length), a 0 length is to the end.
+ * Directories have nothing to flush, all their changes are journaled.
+ */
+int foofs_sync(struct zus_inode_info *zii, struct zufs_ioc_range *ioc_range)
+{
+	struct foofs_inode_info *fii = FII(zii);
+	struct _sync_req sr = { .zii = zii };
+	ulong size = zii->zi->i_size;
+	ulong end = ioc_range->offset + ioc_range->length;
+
+	if (!zi_isreg(zii->zi))
+		return 0;
+
+	sr.meta = __atomic_load_n(&fii->mgen, __ATOMIC_RELAXED) !=
+		  __atomic_load_n(&fii->sgen, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&fii->wmapped, __ATOMIC_RELAXED) &&
+	    ioc_range->offset < size) {
+		if (!ioc_range->length || end < ioc_range->offset ||
+		    size < end)
+			end = size;
+		sr.first = ioc_range->offset >> PAGE_SHIFT;
+		sr.end = pmem_o2p_up(end);
+	}
+	if (!sr.meta && sr.first == sr.end)
+		return 0;
+
+	return zus_gcommit(&FSBI(zii->sbi)->sync_gc, &sr.zgr);
+}
+
+int foofs_setattr(struct zus_inode_info *zii, uint enable_bits,
+		  ulong truncate_size)
+{
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	struct zus_inode *zi = zii->zi, *szi;
+	struct foofs_tx *tx;
+	int err = 0;
+
+	/* The Kernel already updated the rest of the inode in place */
+	if (!(enable_bits & STATX_SIZE) || !zi_isreg(zi)) {
+		pmem_persist(zi, sizeof(*zi));
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&FII(zii)->lock);
+	if (foofs_inline_slots(zi) && !_iroom(fsbi, zi, truncate_size)) {
+		err = _xuninline(fsbi, zi);
+		if (unlikely(err))
+			goto out;
+	}
+
+	if (foofs_inline_slots(zi)) {
+		/* So growing the file again reads zeros */
+		if (truncate_size < zi->i_size)
+			pmem_memset_nt(foofs_inline(zi) + truncate_size, 0,
+				       zi->i_size - truncate_size);
+	} else if (truncate_size < zi->i_size) {
+		ulong off = truncate_size & (PAGE_SIZE - 1);
+
+		err = _xtruncate(fsbi, zi, pmem_o2p_up(truncate_size));
+		if (unlikely(err))
+			goto out;
+
+		/* So growing the file again reads zeros */
+		if (off) {
+			err = _xzero(fsbi, zi, truncate_size,
+				     truncate_size - off + PAGE_SIZE);
+			if (unlikely(err))
+				goto out;
+		}
+	}
+
+	/* The rest of the inode the Kernel changed is fenced by the commit */
+	pmem_flush(zi, sizeof(*zi));
+	tx = foofs_tx_begin(fsbi);
+	szi = tx ? foofs_tx_stage(tx, zi, sizeof(*zi)) : NULL;
+	if (likely(szi)) {
+		szi->i_size = truncate_size;
+		err = foofs_tx_commit(tx);
+	} else {
+		if (tx)
+			foofs_tx_abort(tx);
+		err = -ENOMEM;
+	}
+out:
+	pthread_rwlock_unlock(&FII(zii)->lock);
+
+	return err;
+}
+
+/* Map unwritten extents over the holes in file blocks [@from, @to). Holes
+ * that cover a whole 2M window of the file get a 2M aligned extent.
+ */
+static int _xprealloc(struct foofs_sb_info *fsbi, struct zus_inode *zi,
+		      ulong from, ulong to)
+{
+	while (from < to) {
+		ulong n, want, goal, bn, len;
+		struct _xmap m;
+		bool huge;
+		int err;
+
+		_xlookup(fsbi, zi, from, &m);
+		n = min_t(ulong, m.run, to - from);
+		if (m.bn) {
+			from += n;
+			continue;
+		}
+
+		huge = !(from & (FOOFS_HUGE_BLOCKS - 1)) &&
+		       FOOFS_HUGE_BLOCKS <= n;
+		want = FOOFS_HUGE_BLOCKS - (from & (FOOFS_HUGE_BLOCKS - 1));
+		want = min_t(ulong, want, n);
+		goal = m.has_prev ? m.prev_end_bn + (from - m.prev_end) : 0;
+
+		bn = foofs_ext_alloc(fsbi, goal, want, huge, &len);
+		if (unlikely(!bn))
+			return -ENOSPC;
+
+		err = _xinsert_tx(fsbi, zi, from, bn | FOOFS_XUNWRITTEN, len);
+		if (unlikely(err)) {
+			foofs_ext_free(fsbi, bn, len);
+			return err;
+		}
+		from += len;
+	}
+
+	return 0;
+}
+
+/* ZUS_OP_FALLOCATE. @opflags is the fallocate(2) mode: preallocate (with
+ * or without KEEP_SIZE), PUNCH_HOLE or ZERO_RANGE.
+ */
+int foofs_fallocate(struct zus_inode_info *zii,
+		    struct zufs_ioc_range *ioc_range)
+{
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	struct zus_inode *zi = zii->zi;
+	ulong pos = ioc_range->offset, end = pos + ioc_range->length;
+	uint mode = ioc_range->opflags;
+	int err = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (unlikely(!zi_isreg(zi) || end <= pos))
+		return -EINVAL;
+
+	pthread_rwlock_wrlock(&FII(zii)->lock);
+	err = _xuninline(fsbi, zi);
+	if (!err && (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) {
+		ulong from = pmem_o2p_up(pos), to = end >> PAGE_SHIFT;
+
+		if (to < from) {
+			err = _xzero(fsbi, zi, pos, end);
+		} else {
+			if (pos & (PAGE_SIZE - 1))
+				err = _xzero(fsbi, zi, pos, from << PAGE_SHIFT);
+			if (!err && (end & (PAGE_SIZE - 1)))
+				err = _xzero(fsbi, zi, to << PAGE_SHIFT, end);
+			if (!err)
+				err = _xpunch(fsbi, zi, from, to);
+		}
+	}
+	if (!err && !(mode & FALLOC_FL_PUNCH_HOLE))
+		err = _xprealloc(fsbi, zi, pos >> PAGE_SHIFT,
+				 pmem_o2p_up(end));
+
+	if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && zi->i_size < end)
+		_set_size(zii, end);
+	pthread_rwlock_unlock(&FII(zii)->lock);
+
+	return err;
+}
+
+/* ZUS_OP_LLSEEK of SEEK_DATA and SEEK_HOLE, the Kernel does the rest */
+int foofs_seek(struct zus_inode_info *zii, struct zufs_ioc_seek *ioc_seek)
+{
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	struct zus_inode *zi = zii->zi;
+	bool data = ioc_seek->whence == SEEK_DATA;
+	ulong pos = ioc_seek->offset_in, size;
+	int err = 0;
+
+	if (unlikely(!data && ioc_seek->whence != SEEK_HOLE))
+		return -EINVAL;
+
+	pthread_rwlock_rdlock(&FII(zii)->lock);
+	size = zi->i_size;
+	if (size <= pos) {
+		err = -ENXIO;
+		goto out;
+	}
+
+	/* An inline file is all data, up to EOF */
+	if (foofs_inline_slots(zi)) {
+		ioc_seek->offset_out = data ? pos : size;
+		goto out;
+	}
+
+	while (pos < size) {
+		ulong idx = pos >> PAGE_SHIFT;
+		struct _xmap m;
+
+		_xlookup(fsbi, zi, idx, &m);
+		if ((m.bn && !m.unwritten) == data)
+			break;
+		if (m.run == ~0UL)
+			pos = size; /* A hole to the end */
+		else
+			pos = (idx + m.run) << PAGE_SHIFT;
+	}
+
+	if (size <= pos) {
+		if (data)
+			err = -ENXIO;
+		pos = size;
+	}
+	ioc_seek->offset_out = pos;
+out:
+	pthread_rwlock_unlock(&FII(zii)->lock);
+	return err;
+}
+
+/* Copy the bytes of a clone whose blocks do not line up between the files */
+static int _xcopy(struct foofs_sb_info *fsbi, struct zus_inode *src,
+		  struct zus_inode *dst, ulong pos_in, ulong pos_out, ulong len)
+{
+	static const char zeros[PAGE_SIZE];
+	ulong end = pos_in + len;
+
+	while (pos_in < end) {
+		ulong off = pos_in & (PAGE_SIZE - 1);
+		const void *from = zeros;
+		struct _xmap m;
+		ulong n;
+		int err;
+
+		if (foofs_inline_slots(src)) {
+			from = foofs_inline(src) + pos_in;
+			n = end - pos_in;
+		} else {
+			_xlookup(fsbi, src, pos_in >> PAGE_SHIFT, &m);
+			n = _run_bytes(m.run, off, end - pos_in);
+			if (m.bn && !m.unwritten)
+				from = pmem_baddr(&fsbi->sbi.pmem, m.bn) + off;
+			else
+				n = min_t(ulong, n, sizeof(zeros));
+		}
+
+		err = _iwrite(fsbi, dst, from, &pos_out, pos_out + n);
+		if (unlikely(err))
+			return err;
+		pos_in += n;
+	}
+
+	return 0;
+}
+
+/* Map @src's blocks [@sidx, @sidx + @nb) at @didx of @dst too, where @dst
+ * has a hole
+ */
+static int _xshare(struct foofs_sb_info *fsbi, struct zus_inode *src,
+		   struct zus_inode *dst, ulong sidx, ulong didx, ulong nb)
+{
+	ulong i = 0;
+
+	while (i < nb) {
+		struct _xmap m;
+		ulong n;
+		int err;
+
+		_xlookup(fsbi, src, sidx + i, &m);
+		n = min_t(ulong, m.run, nb - i);
+		/* Unwritten is left a hole, it reads the same */
+		if (m.bn && !m.unwritten) {
+			err = foofs_ext_get(fsbi, m.bn, n);
+			if (unlikely(err))
+				return err;
+			err = _xinsert_tx(fsbi, dst, didx + i, m.bn, n);
+			if (unlikely(err)) {
+				foofs_ext_put(fsbi, m.bn, n);
+				return err;
+			}
+		}
+		i += n;
+	}
+
+	return 0;
+}
+
+/* The source only needs its tree to stay put, the destination is written */
+static void _lock_two(struct zus_inode_info *src, struct zus_inode_info *dst)
+{
+	if (src == dst) {
+		pthread_rwlock_wrlock(&FII(dst)->lock);
+	} else if (src < dst) {
+		pthread_rwlock_rdlock(&FII(src)->lock);
+		pthread_rwlock_wrlock(&FII(dst)->lock);
+	} else {
+		pthread_rwlock_wrlock(&FII(dst)->lock);
+		pthread_rwlock_rdlock(&FII(src)->lock);
+	}
+}
+
+static void _unlock_two(struct zus_inode_info *src, struct zus_inode_info *dst)
+{
+	pthread_rwlock_unlock(&FII(dst)->lock);
+	if (src != dst)
+		pthread_rwlock_unlock(&FII(src)->lock);
+}
+
+/* ZUS_OP_CLONE (FICLONE, FICLONERANGE) and ZUS_OP_COPY (copy_file_range).
+ * Whole blocks that line up are shared, O(extents), only the unaligned
+ * head and tail of a COPY are copied. A CLONE must be block aligned except
+ * for a tail that ends at the source's EOF. A source ever mapped writable
+ * by get_block is always copied.
+ */
+int foofs_clone(struct zufs_ioc_clone *ioc_clone)
+{
+	struct zus_inode_info *src_ii = ioc_clone->src_zus_ii;
+	struct zus_inode_info *dst_ii = ioc_clone->dst_zus_ii;
+	struct foofs_sb_info *fsbi = FSBI(src_ii->sbi);
+	struct zus_inode *src = src_ii->zi, *dst = dst_ii->zi;
+	bool clone = ioc_clone->hdr.operation == ZUS_OP_CLONE;
+	ulong pos_in = ioc_clone->pos_in, pos_out = ioc_clone->pos_out;
+	ulong len = ioc_clone->len, head, nb;
+	int err = 0;
+
+	if (unlikely(src_ii->sbi != dst_ii->sbi))
+		return -EXDEV;
+	if (unlikely(!zi_isreg(src) || !zi_isreg(dst)))
+		return -EINVAL;
+
+	_lock_two(src_ii, dst_ii);
+	if (src->i_size <= pos_in)
+		goto out;
+
+	/* A CLONE of 0 bytes is to the source's EOF */
+	if ((clone && !len) || src->i_size - pos_in < len)
+		len = src->i_size - pos_in;
+
+	if (unlikely(src_ii == dst_ii && pos_in < pos_out + len &&
+		     pos_out < pos_in + len)) {
+		err = -EINVAL;
+		goto out;
+	}
+	if (clone && (((pos_in | pos_out) & (PAGE_SIZE - 1)) ||
+		      ((len & (PAGE_SIZE - 1)) &&
+		       (pos_in + len != src->i_size ||
+			pos_out + len < dst->i_size)))) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* A copy inside an inline file must not move the data under it */
+	if (src == dst && foofs_inline_slots(dst) &&
+	    !_iroom(fsbi, dst, max_t(ulong, pos_out + len, dst->i_size))) {
+		err = _xuninline(fsbi, dst);
+		if (unlikely(err))
+			goto out;
+	}
+
+	/* Blocks can only be shared at the same offset in a block. An
+	 * inline source has none, it is copied. So is one that was mapped
+	 * writable to an mmap, its stores would go to the shared blocks
+	 * and show in @dst too.
+	 */
+	if (foofs_inline_slots(src) ||
+	    ((pos_in ^ pos_out) & (PAGE_SIZE - 1)) ||
+	    __atomic_load_n(&FII(src_ii)->wmapped, __ATOMIC_RELAXED))
+		head = len;
+	else
+		head = min_t(ulong, len, -pos_in & (PAGE_SIZE - 1));
+
+	err = _xcopy(fsbi, src, dst, pos_in, pos_out, head);
+	if (unlikely(err))
+		goto out;
+	pos_in += head;
+	pos_out += head;
+	len -= head;
+
+	/* A tail to the source's EOF is shared whole, the rest of its block
+	 * reads zeros as it should past the destination's new EOF
+	 */
+	nb = len >> PAGE_SHIFT;
+	if ((len & (PAGE_SIZE - 1)) && pos_in + len == src->i_size &&
+	    dst->i_size <= pos_out + len)
+		++nb;
+	if (nb) {
+		ulong didx = pos_out >> PAGE_SHIFT;
+		ulong done = min_t(ulong, len, nb << PAGE_SHIFT);
+
+		err = _xuninline(fsbi, dst);
+		if (likely(!err))
+			err = _xpunch(fsbi, dst, didx, didx + nb);
+		if (likely(!err))
+			err = _xshare(fsbi, src, dst, pos_in >> PAGE_SHIFT,
+				      didx, nb);
+		if (unlikely(err))
+			goto out;
+		pos_in += done;
+		pos_out += done;
+		len -= done;
+	}
+
+	err = _xcopy(fsbi, src, dst, pos_in, pos_out, len);
+	if (unlikely(err))
+		goto out;
+	pos_out += len;
+
+	pmem_fence();
+	if (dst->i_size < pos_out)
+		_set_size(dst_ii, pos_out);
+out:
+	_unlock_two(src_ii, dst_ii);
+	return err;
+}
+
+/* @zi is a copy, the inode is already gone */
+void foofs_file_free(struct foofs_sb_info *fsbi, struct zus_inode *zi)
+{
+	if (zi->i_on_disk.a[0])
+		_xfree_tree(fsbi, zi->i_on_disk.a[0]);
+}
+
+static ulong _xmark(struct foofs_sb_info *fsbi, ulong bn)
+{
+	struct foofs_xnode *xn = _xnode(fsbi, bn);
+	ulong count = 1;
+	uint i;
+
+	foofs_blk_mark_used(fsbi, bn);
+	for (i = 0; i < xn->nr; ++i) {
+		struct foofs_xent *xe = &xn->ents[i];
+
+		if (xn->depth) {
+			count += _xmark(fsbi, xe->val);
+			continue;
+		}
+		count += foofs_ext_mark_used(fsbi, _xbn(xe), _xlen(xe));
+	}
+
+	return count;
+}
+
+/* At mount, mark the tree and data blocks of @zi. Returns the count of the
+ * ones no other file marked before
+ */
+ulong foofs_file_mark_blocks(struct foofs_sb_info *fsbi, struct zus_inode *zi)
+{
+	if (!zi->i_on_disk.a[0])
+		return 0;
+
+	return _xmark(fsbi, zi->i_on_disk.a[0]);
+}
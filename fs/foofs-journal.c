@@ -0,0 +1,440 @@
+/*
+ * foofs-journal.c - foofs metadata journal
+ *
+ * A metadata operation runs as a transaction (tx). It does not write live
+ * metadata in place. It stages a DRAM copy of every object it modifies
+ * (inodes, dir blocks, parts of them) with foofs_tx_stage(), and changes only
+ * the copy. Newly allocated blocks are not reachable before the tx commits,
+ * so they are written in place (foofs_tx_fresh()).
+ *
+ * On commit, the 8 byte words that changed in the staged copies are written
+ * as one redo record to the thread's journal, together with a header that
+ * checksums it, and the fresh blocks are flushed. A fence makes all of that
+ * durable at once, this is the commit point. Only then the words are stored
+ * in place, and after a second fence the record is retired. A third fence
+ * makes the retire durable before the commit returns.
+ *
+ * Concurrent commits are one group commit (zus_gcommit): whichever commit
+ * leads writes the records of all the txs that queued meanwhile, each to
+ * its own journal, and the three fences are paid once for all of them.
+ *
+ * At mount, foofs_journal_recover() replays all the records not retired
+ * (in commit order) and so completes any tx that was cut in the middle.
+ * Since a record is retired before its tx returns, a live one is newer
+ * than anything committed after it to what it covers: a later tx on the
+ * same object must lock it after this commit returned. Replaying it stores
+ * the same words again, or completes it.
+ *
+ * Blocks a tx frees are only released to the allocator once its record is
+ * retired, so a replay never writes into a block that was reused.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "zus.h"
+#include "nv.h"
+#include "foofs.h"
+
+#define FOOFS_JMAGIC		0x4c4e524a4f4f4655UL	/* "UFOOJRNL" */
+
+/* At the start of each on-pmem journal. One cache-line */
+struct foofs_jhdr {
+	__le64 magic;
+	__le64 seq;	/* 0 when retired */
+	__le64 nwords;
+	__le64 csum;	/* Of all the above and the words */
+	__le64 pad[4];
+};
+
+/* Store @val at byte offset @off of the pmem */
+struct foofs_jword {
+	__le64 off;
+	__le64 val;
+};
+
+#define FOOFS_JWORDS	((FOOFS_JOURNAL_BLOCKS * PAGE_SIZE - \
+			  sizeof(struct foofs_jhdr)) / sizeof(struct foofs_jword))
+
+static struct foofs_jhdr *_jhdr(struct foofs_sb_info *fsbi,
+				struct foofs_journal *j)
+{
+	return pmem_baddr(&fsbi->sbi.pmem, j->bn);
+}
+
+static ulong _jcsum(struct foofs_jhdr *jh, struct foofs_jword *jw)
+{
+	ulong h = 0xcbf29ce484222325UL;
+	ulong i;
+
+	h = (h ^ jh->magic) * 0x100000001b3UL;
+	h = (h ^ jh->seq) * 0x100000001b3UL;
+	h = (h ^ jh->nwords) * 0x100000001b3UL;
+	for (i = 0; i < jh->nwords; ++i) {
+		h = (h ^ jw[i].off) * 0x100000001b3UL;
+		h = (h ^ jw[i].val) * 0x100000001b3UL;
+	}
+
+	return h;
+}
+
+/* ~~~~ tx ~~~~ */
+
+static struct foofs_tx_region *_tx_find(struct foofs_tx *tx, void *p,
+					size_t len)
+{
+	uint i;
+
+	for (i = 0; i < tx->nregions; ++i) {
+		struct foofs_tx_region *r = &tx->regions[i];
+
+		if (r->pmem <= p && p + len <= r->pmem + r->len)
+			return r;
+	}
+
+	return NULL;
+}
+
+static bool _tx_is_fresh(struct foofs_tx *tx, void *p)
+{
+	ulong bn = pmem_addr_2_offset(&tx->fsbi->sbi.pmem, p) >> PAGE_SHIFT;
+	uint i;
+
+	for (i = 0; i < tx->nfresh; ++i)
+		if (tx->fresh[i] == bn)
+			return true;
+
+	return false;
+}
+
+struct foofs_tx *foofs_tx_begin(struct foofs_sb_info *fsbi)
+{
+	int ztno = zus_getztno();
+	struct foofs_journal *j;
+
+	j = &fsbi->journals[(ztno < 0 ? 0 : ztno) % FOOFS_JOURNALS];
+	pthread_mutex_lock(&j->lock);
+
+	if (unlikely(!j->arena)) {
+		j->arena = malloc(FOOFS_TX_ARENA);
+		j->wbuf = malloc(FOOFS_JWORDS * sizeof(struct foofs_jword));
+		if (unlikely(!j->arena || !j->wbuf)) {
+			free(j->arena);
+			free(j->wbuf);
+			j->arena = NULL;
+			j->wbuf = NULL;
+			pthread_mutex_unlock(&j->lock);
+			return NULL;
+		}
+	}
+
+	memset(&j->tx, 0, sizeof(j->tx));
+	j->tx.fsbi = fsbi;
+	j->tx.j = j;
+	return &j->tx;
+}
+
+void *foofs_tx_stage(struct foofs_tx *tx, void *p, size_t len)
+{
+	struct foofs_journal *j = tx->j;
+	struct foofs_tx_region *r;
+	uint i;
+
+	r = _tx_find(tx, p, len);
+	if (r)
+		return r->work + (p - r->pmem);
+	if (_tx_is_fresh(tx, p))
+		return p;
+
+	for (i = 0; i < tx->nregions; ++i) {
+		r = &tx->regions[i];
+		if (p < r->pmem + r->len && r->pmem < p + len) {
+			ERROR("staging %p+%zu overlaps %p+%u\n", p, len,
+			      r->pmem, r->len);
+			return NULL;
+		}
+	}
+
+	if (unlikely(tx->nregions == FOOFS_TX_REGIONS ||
+		     tx->arena_used + 2 * len > FOOFS_TX_ARENA)) {
+		DBG("tx full regions=%u arena=%zu\n", tx->nregions,
+		    tx->arena_used);
+		return NULL;
+	}
+
+	r = &tx->regions[tx->nregions++];
+	r->pmem = p;
+	r->len = len;
+	r->orig = j->arena + tx->arena_used;
+	r->work = r->orig + len;
+	tx->arena_used += 2 * len;
+
+	memcpy(r->orig, p, len);
+	memcpy(r->work, p, len);
+	return r->work;
+}
+
+void *foofs_tx_rd(struct foofs_tx *tx, void *p)
+{
+	struct foofs_tx_region *r = _tx_find(tx, p, 1);
+
+	return r ? r->work + (p - r->pmem) : p;
+}
+
+bool foofs_tx_fresh(struct foofs_tx *tx, ulong bn)
+{
+	if (unlikely(tx->nfresh == FOOFS_TX_BLOCKS))
+		return false;
+
+	tx->fresh[tx->nfresh++] = bn;
+	return true;
+}
+
+bool foofs_tx_free(struct foofs_tx *tx, ulong bn)
+{
+	if (unlikely(tx->nfreed == FOOFS_TX_BLOCKS))
+		return false;
+
+	tx->freed[tx->nfreed++] = bn;
+	return true;
+}
+
+static void _tx_end(struct foofs_tx *tx)
+{
+	pthread_mutex_unlock(&tx->j->lock);
+}
+
+void foofs_tx_abort(struct foofs_tx *tx)
+{
+	uint i;
+
+	for (i = 0; i < tx->nfresh; ++i)
+		foofs_blk_free(tx->fsbi, tx->fresh[i]);
+	_tx_end(tx);
+}
+
+/* Collect the changed words of all regions into the journal's wbuf */
+static long _tx_words(struct foofs_tx *tx)
+{
+	struct zus_pmem *pmem = &tx->fsbi->sbi.pmem;
+	struct foofs_jword *jw = tx->j->wbuf;
+	ulong n = 0;
+	uint i;
+
+	for (i = 0; i < tx->nregions; ++i) {
+		struct foofs_tx_region *r = &tx->regions[i];
+		ulong *orig = r->orig, *work = r->work;
+		ulong off = pmem_addr_2_offset(pmem, r->pmem);
+		uint w;
+
+		for (w = 0; w < r->len / sizeof(ulong); ++w) {
+			if (orig[w] == work[w])
+				continue;
+			if (unlikely(n == FOOFS_JWORDS))
+				return -ENOSPC;
+			jw[n].off = off + w * sizeof(ulong);
+			jw[n].val = work[w];
+			++n;
+		}
+	}
+
+	return n;
+}
+
+/* Store the words in place. Flushes each cache-line once, no fence */
+static void _japply(struct zus_pmem *pmem, struct foofs_jword *jw, ulong n)
+{
+	void *line = NULL;
+	ulong i;
+
+	for (i = 0; i < n; ++i) {
+		ulong *p = pmem->p_pmem_addr + jw[i].off;
+		void *l = (void *)((ulong)p & ~(ZUS_CACHELINE_SIZE - 1UL));
+
+		__atomic_store_n(p, jw[i].val, __ATOMIC_RELAXED);
+		if (l != line) {
+			if (line)
+				pmem_flush(line, ZUS_CACHELINE_SIZE);
+			line = l;
+		}
+	}
+	if (line)
+		pmem_flush(line, ZUS_CACHELINE_SIZE);
+}
+
+/* Write @tx's record and flush its fresh blocks, no fence */
+static void _jwrite(struct foofs_tx *tx)
+{
+	struct foofs_sb_info *fsbi = tx->fsbi;
+	struct foofs_jhdr *jh = _jhdr(fsbi, tx->j);
+	struct foofs_jhdr h = {};
+	uint i;
+
+	if (tx->nwords) {
+		h.magic = FOOFS_JMAGIC;
+		/* Only the leader assigns, in the order of the replay */
+		h.seq = ++fsbi->jseq;
+		h.nwords = tx->nwords;
+		h.csum = _jcsum(&h, tx->j->wbuf);
+
+		pmem_memcpy_nt(jh + 1, tx->j->wbuf,
+			       h.nwords * sizeof(struct foofs_jword));
+		pmem_memcpy_nt(jh, &h, sizeof(h));
+	}
+	for (i = 0; i < tx->nfresh; ++i)
+		pmem_flush(pmem_baddr(&fsbi->sbi.pmem, tx->fresh[i]),
+			   PAGE_SIZE);
+}
+
+/* The zus_gcommit of all the txs that came together, @reqs. Each step is
+ * done for all of them before its fence.
+ */
+static int _tx_gcommit(struct zus_gcommit *zgc, struct zus_gcommit_req *reqs)
+{
+	struct foofs_tx *tx;
+
+	for (tx = (void *)reqs; tx; tx = (void *)tx->zgr.next)
+		_jwrite(tx);
+	pmem_fence();
+
+	for (tx = (void *)reqs; tx; tx = (void *)tx->zgr.next)
+		if (tx->nwords)
+			_japply(&tx->fsbi->sbi.pmem, tx->j->wbuf, tx->nwords);
+	pmem_fence();
+
+	/* Durable before we return. Else a later tx of another journal
+	 * could change the same words and retire first, and a replay of
+	 * this record would then undo it
+	 */
+	for (tx = (void *)reqs; tx; tx = (void *)tx->zgr.next) {
+		struct foofs_jhdr *jh = _jhdr(tx->fsbi, tx->j);
+
+		if (!tx->nwords)
+			continue;
+		__atomic_store_n(&jh->seq, 0, __ATOMIC_RELAXED);
+		pmem_flush(&jh->seq, sizeof(jh->seq));
+	}
+	pmem_fence();
+
+	return 0;
+}
+
+int foofs_tx_commit(struct foofs_tx *tx)
+{
+	struct foofs_sb_info *fsbi = tx->fsbi;
+	long n = _tx_words(tx);
+	uint i;
+	int err;
+
+	if (unlikely(n < 0)) {
+		ERROR("tx too big for the journal\n");
+		foofs_tx_abort(tx);
+		return n;
+	}
+
+	/* Our stores so far (the zeroing of fresh blocks) are ordered by the
+	 * lock that queues us, the leader's fences make them durable too
+	 */
+	tx->nwords = n;
+	err = zus_gcommit(&fsbi->tx_gc, &tx->zgr);
+
+	for (i = 0; i < tx->nfreed; ++i)
+		foofs_blk_free(fsbi, tx->freed[i]);
+
+	_tx_end(tx);
+	return err;
+}
+
+/* ~~~~ mount ~~~~ */
+
+int foofs_journal_init(struct foofs_sb_info *fsbi, ulong first_bn)
+{
+	uint i;
+
+	fsbi->journals = aligned_alloc(ZUS_CACHELINE_SIZE,
+				       FOOFS_JOURNALS * sizeof(*fsbi->journals));
+	if (unlikely(!fsbi->journals))
+		return -ENOMEM;
+
+	memset(fsbi->journals, 0, FOOFS_JOURNALS * sizeof(*fsbi->journals));
+	for (i = 0; i < FOOFS_JOURNALS; ++i) {
+		pthread_mutex_init(&fsbi->journals[i].lock, NULL);
+		fsbi->journals[i].bn = first_bn + i * FOOFS_JOURNAL_BLOCKS;
+	}
+	zus_gcommit_init(&fsbi->tx_gc, _tx_gcommit);
+
+	return 0;
+}
+
+void foofs_journal_fini(struct foofs_sb_info *fsbi)
+{
+	uint i;
+
+	if (!fsbi->journals)
+		return;
+
+	zus_gcommit_fini(&fsbi->tx_gc);
+	for (i = 0; i < FOOFS_JOURNALS; ++i) {
+		pthread_mutex_destroy(&fsbi->journals[i].lock);
+		free(fsbi->journals[i].arena);
+		free(fsbi->journals[i].wbuf);
+	}
+	free(fsbi->journals);
+	fsbi->journals = NULL;
+}
+
+static int _jseq_cmp(const void *a, const void *b)
+{
+	const struct foofs_jhdr *ja = *(struct foofs_jhdr * const *)a;
+	const struct foofs_jhdr *jb = *(struct foofs_jhdr * const *)b;
+
+	return (ja->seq > jb->seq) - (ja->seq < jb->seq);
+}
+
+/* Replay the records of a crashed mount. Before the allocators are built */
+int foofs_journal_recover(struct foofs_sb_info *fsbi)
+{
+	struct foofs_jhdr *live[FOOFS_JOURNALS];
+	ulong max_seq = 0;
+	uint i, n = 0;
+
+	for (i = 0; i < FOOFS_JOURNALS; ++i) {
+		struct foofs_jhdr *jh = _jhdr(fsbi, &fsbi->journals[i]);
+
+		if (jh->magic != FOOFS_JMAGIC || !jh->seq ||
+		    jh->nwords > FOOFS_JWORDS ||
+		    jh->csum != _jcsum(jh, (void *)(jh + 1)))
+			continue;
+
+		live[n++] = jh;
+		if (max_seq < jh->seq)
+			max_seq = jh->seq;
+	}
+
+	qsort(live, n, sizeof(live[0]), _jseq_cmp);
+	for (i = 0; i < n; ++i) {
+		INFO("journal replay seq=%lld words=%lld\n", live[i]->seq,
+		     live[i]->nwords);
+		_japply(&fsbi->sbi.pmem, (void *)(live[i] + 1),
+			live[i]->nwords);
+	}
+	pmem_fence();
+
+	for (i = 0; i < n; ++i) {
+		live[i]->seq = 0;
+		pmem_flush(&live[i]->seq, sizeof(live[i]->seq));
+	}
+	pmem_fence();
+
+	fsbi->jseq = max_seq;
+	return 0;
+}
@@ -20,11 +20,10 @@
 
 #include "zus.h"
 #include "b-minmax.h"
+#include "nv.h"
+#include "foofs.h"
 
 // #define FOO_DEF_SBI_MODE (S_IRUGO | S_IXUGO | S_IWUSR)
-#define FOOFS_ROOT_NO 1
-#define FOOFS_INODES_RATIO 20
-#define FOOFS_INO_PER_BLOCK (PAGE_SIZE / ZUFS_INODE_SIZE)
 
 /* FooFS uses mkfs.m1fs for the device table so
  * keep the info sync with most current m1fs.
@@ -38,83 +37,817 @@ enum {
 	M1FS_SUPER_MAGIC	= 0x5346314d /* M1FS in BE */
 };
 
-static struct zus_inode *find_zi(struct zus_sb_info *sbi, ulong ino)
+/* ~~~~ inode and block allocators, usage counters ~~~~ */
+
+static struct foofs_pcpu *_my_pcpu(struct foofs_sb_info *fsbi)
+{
+	int ztno = zus_getztno();
+
+	return &fsbi->pcpu[(ztno < 0 ? 0 : ztno) % fsbi->num_pcpu];
+}
+
+static void _usage_add(struct foofs_sb_info *fsbi, long inodes, long blocks)
 {
-	struct zus_inode *zi_array = pmem_baddr(&sbi->pmem, 1);
+	struct foofs_pcpu *pc = _my_pcpu(fsbi);
+
+	if (inodes)
+		__atomic_fetch_add(&pc->used_inodes, inodes, __ATOMIC_RELAXED);
+	if (blocks)
+		__atomic_fetch_add(&pc->used_blocks, blocks, __ATOMIC_RELAXED);
+}
+
+/* Only called from statfs, the lone reader of the counters */
+static void _usage_fold(struct foofs_sb_info *fsbi, ulong *inodes,
+			ulong *blocks)
+{
+	long sum_i = 0, sum_b = 0;
+	uint i;
 
-	return &zi_array[ino];
+	for (i = 0; i < fsbi->num_pcpu; ++i) {
+		struct foofs_pcpu *pc = &fsbi->pcpu[i];
+
+		sum_i += __atomic_load_n(&pc->used_inodes, __ATOMIC_RELAXED);
+		sum_b += __atomic_load_n(&pc->used_blocks, __ATOMIC_RELAXED);
+	}
+
+	*inodes = sum_i > 0 ? sum_i : 0;
+	*blocks = sum_b > 0 ? sum_b : 0;
 }
 
-static struct zus_inode *find_free_ino(struct zus_sb_info *sbi)
+static int _bm_init(struct foofs_bitmap *bm, ulong nbits)
 {
-	struct zus_inode *zi_array = pmem_baddr(&sbi->pmem, 1);
-	ulong max_ino = pmem_blocks(&sbi->pmem) / FOOFS_INODES_RATIO *
-							FOOFS_INO_PER_BLOCK;
 	ulong i;
 
-	for (i = 1; i < max_ino; ++i) {
-		if (!zi_array[i].i_mode) {
-			zi_array[i].i_ino = i;
-			return &zi_array[i];
+	bm->words = (nbits + FOOFS_BITS_PER_LONG - 1) / FOOFS_BITS_PER_LONG;
+	bm->map = calloc(bm->words ?: 1, sizeof(ulong));
+	if (unlikely(!bm->map))
+		return -ENOMEM;
+
+	/* The tail of the last word does not exist */
+	for (i = nbits; i < bm->words * FOOFS_BITS_PER_LONG; ++i)
+		bm->map[i / FOOFS_BITS_PER_LONG] |=
+					1UL << (i % FOOFS_BITS_PER_LONG);
+	return 0;
+}
+
+static void _bm_fini(struct foofs_bitmap *bm)
+{
+	free(bm->map);
+	bm->map = NULL;
+}
+
+/* Only used at mount, by the parallel scan */
+static bool _bm_test_and_set(struct foofs_bitmap *bm, ulong nr)
+{
+	ulong mask = 1UL << (nr % FOOFS_BITS_PER_LONG);
+	ulong *word = &bm->map[nr / FOOFS_BITS_PER_LONG];
+
+	return __atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask;
+}
+
+/* Grab all the free members of one bitmap word into @r */
+static bool _bm_reserve_word(struct foofs_bitmap *bm, struct foofs_resv *r)
+{
+	ulong n;
+
+	for (n = 0; n < bm->words; ++n) {
+		ulong w = (r->hint + n) % bm->words;
+		ulong *word = &bm->map[w];
+		ulong old = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+		while (old != ~0UL) {
+			if (__atomic_compare_exchange_n(word, &old, ~0UL, false,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_RELAXED)) {
+				r->word = w;
+				r->bits = ~old;
+				r->hint = w + 1;
+				return true;
+			}
 		}
 	}
 
-	return NULL;
+	return false;
+}
+
+/* Returns 0 if bitmap is full. (bit 0 is always reserved by callers) */
+static ulong _bm_alloc(struct foofs_bitmap *bm, struct foofs_resv *r,
+		       struct foofs_pcpu *pc)
+{
+	ulong nr = 0;
+
+	pthread_spin_lock(&pc->lock);
+	if (likely(r->bits || _bm_reserve_word(bm, r))) {
+		nr = r->word * FOOFS_BITS_PER_LONG + __builtin_ctzl(r->bits);
+		r->bits &= r->bits - 1;
+	}
+	pthread_spin_unlock(&pc->lock);
+
+	return nr;
 }
 
-static ulong _get_fill(struct zus_sb_info *sbi)
+/* @n contiguous members of the reserved word that do not cross an
+ * inode-table block. Returns 0 if it has no such run.
+ */
+static ulong _bm_alloc_run(struct foofs_bitmap *bm, struct foofs_resv *r,
+			   struct foofs_pcpu *pc, uint n)
+{
+	ulong starts = (1UL << (FOOFS_INO_PER_BLOCK - n + 1)) - 1;
+	ulong nr = 0, run;
+	uint i;
+
+	for (i = FOOFS_INO_PER_BLOCK; i < FOOFS_BITS_PER_LONG;
+	     i += FOOFS_INO_PER_BLOCK)
+		starts |= starts << FOOFS_INO_PER_BLOCK;
+
+	pthread_spin_lock(&pc->lock);
+	if (likely(r->bits || _bm_reserve_word(bm, r))) {
+		run = r->bits & starts;
+		for (i = 1; i < n; ++i)
+			run &= r->bits >> i;
+		if (run) {
+			uint first = __builtin_ctzl(run);
+
+			nr = r->word * FOOFS_BITS_PER_LONG + first;
+			r->bits &= ~(((1UL << n) - 1) << first);
+		}
+	}
+	pthread_spin_unlock(&pc->lock);
+
+	return nr;
+}
+
+static void _bm_free(struct foofs_bitmap *bm, ulong nr)
+{
+	__atomic_fetch_and(&bm->map[nr / FOOFS_BITS_PER_LONG],
+			   ~(1UL << (nr % FOOFS_BITS_PER_LONG)),
+			   __ATOMIC_RELEASE);
+}
+
+/* On first use by a thread, point its hints at inodes and blocks that
+ * live on the thread's own NUMA node.
+ */
+static void _pcpu_place(struct foofs_sb_info *fsbi, struct foofs_pcpu *pc)
+{
+	struct zus_pmem *pmem = &fsbi->sbi.pmem;
+	uint slot = pc - fsbi->pcpu;
+	int node = zus_getnuma();
+	ulong bn;
+
+	pthread_spin_lock(&pc->lock);
+	if (pc->placed)
+		goto out;
+
+	bn = pmem_numa_hint(pmem, node, 1, fsbi->meta_blocks, slot,
+			    fsbi->num_pcpu);
+	pc->ino.hint = (bn - 1) * FOOFS_INO_PER_BLOCK / FOOFS_BITS_PER_LONG;
+
+	bn = pmem_numa_hint(pmem, node, fsbi->meta_blocks, pmem_blocks(pmem),
+			    slot, fsbi->num_pcpu);
+	pc->blk.hint = bn / FOOFS_BITS_PER_LONG;
+	pc->ag = bn / FOOFS_AG_BLOCKS;
+	pc->ag_hint = pc->blk.hint;
+
+	pc->placed = true;
+out:
+	pthread_spin_unlock(&pc->lock);
+}
+
+static ulong _ino_alloc(struct foofs_sb_info *fsbi)
+{
+	struct foofs_pcpu *pc = _my_pcpu(fsbi);
+
+	if (unlikely(!pc->placed))
+		_pcpu_place(fsbi, pc);
+	return _bm_alloc(&fsbi->inos, &pc->ino, pc);
+}
+
+/* An inode and its @slots inline slots. 0 if there is no such run at hand */
+static ulong _ino_alloc_inline(struct foofs_sb_info *fsbi, ulong slots)
+{
+	struct foofs_pcpu *pc = _my_pcpu(fsbi);
+
+	if (unlikely(!pc->placed))
+		_pcpu_place(fsbi, pc);
+	return _bm_alloc_run(&fsbi->inos, &pc->ino, pc, 1 + slots);
+}
+
+static void _ino_free(struct foofs_sb_info *fsbi, ulong ino)
+{
+	_bm_free(&fsbi->inos, ino);
+}
+
+/* Add slots (@have, @want] to the ones after inode @ino. False if any of
+ * them is taken by another inode.
+ */
+bool foofs_inline_claim(struct foofs_sb_info *fsbi, ulong ino, ulong have,
+			ulong want)
+{
+	ulong first = ino + have + 1;
+	ulong mask = ((1UL << (want - have)) - 1) <<
+					(first % FOOFS_BITS_PER_LONG);
+	ulong w = first / FOOFS_BITS_PER_LONG, old;
+	struct foofs_pcpu *pc = _my_pcpu(fsbi);
+	bool got;
+
+	/* Never past the inode-table block, so all in one bitmap word */
+	if (FOOFS_INO_PER_BLOCK <= ino % FOOFS_INO_PER_BLOCK + want)
+		return false;
+
+	/* Still reserved by this thread, most likely since it allocated
+	 * @ino. Slots reserved by another thread are set in the bitmap, so
+	 * they fail below like taken ones.
+	 */
+	pthread_spin_lock(&pc->lock);
+	got = pc->ino.word == w && (pc->ino.bits & mask) == mask;
+	if (got)
+		pc->ino.bits &= ~mask;
+	pthread_spin_unlock(&pc->lock);
+	if (got)
+		goto claimed;
+
+	old = __atomic_load_n(&fsbi->inos.map[w], __ATOMIC_RELAXED);
+	do {
+		if (old & mask)
+			return false;
+	} while (!__atomic_compare_exchange_n(&fsbi->inos.map[w], &old,
+					      old | mask, false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+claimed:
+	_usage_add(fsbi, want - have, 0);
+	return true;
+}
+
+/* The slots must already be zeros on pmem */
+void foofs_inline_free(struct foofs_sb_info *fsbi, ulong ino, ulong slots)
 {
-	struct zus_inode *zi_array = pmem_baddr(&sbi->pmem, 1);
-	ulong max_ino = pmem_blocks(&sbi->pmem) / FOOFS_INODES_RATIO *
-							FOOFS_INO_PER_BLOCK;
-	ulong used_files = 0;
 	ulong i;
 
-	for (i = 1; i < max_ino; ++i) {
-		if (zi_array[i].i_mode)
-			++used_files;
+	for (i = 1; i <= slots; ++i)
+		_ino_free(fsbi, ino + i);
+	_usage_add(fsbi, -(long)slots, 0);
+}
+
+ulong foofs_blk_alloc(struct foofs_sb_info *fsbi)
+{
+	struct foofs_pcpu *pc = _my_pcpu(fsbi);
+	ulong bn;
+
+	if (unlikely(!pc->placed))
+		_pcpu_place(fsbi, pc);
+
+	bn = _bm_alloc(&fsbi->blocks, &pc->blk, pc);
+
+	if (likely(bn))
+		_usage_add(fsbi, 0, 1);
+	return bn;
+}
+
+void foofs_blk_free(struct foofs_sb_info *fsbi, ulong bn)
+{
+	_bm_free(&fsbi->blocks, bn);
+	_usage_add(fsbi, 0, -1);
+}
+
+void foofs_blk_mark_used(struct foofs_sb_info *fsbi, ulong bn)
+{
+	if (_bm_test_and_set(&fsbi->blocks, bn))
+		ERROR("bn=0x%lx is cross linked\n", bn);
+}
+
+/* Claim the free bits from @nr on, as long as they are contiguous, up to
+ * @want. Returns how many were claimed, 0 if @nr is used.
+ */
+static ulong _bm_claim_run(struct foofs_bitmap *bm, ulong nr, ulong want)
+{
+	ulong got = 0;
+
+	while (got < want && nr < bm->words * FOOFS_BITS_PER_LONG) {
+		ulong off = nr % FOOFS_BITS_PER_LONG;
+		ulong *word = &bm->map[nr / FOOFS_BITS_PER_LONG];
+		ulong old = __atomic_load_n(word, __ATOMIC_RELAXED);
+		ulong n, mask;
+
+		do {
+			ulong rest = old >> off;
+
+			n = rest ? (ulong)__builtin_ctzl(rest) :
+				   FOOFS_BITS_PER_LONG - off;
+			n = min_t(ulong, n, want - got);
+			if (!n)
+				return got;
+			mask = (n == FOOFS_BITS_PER_LONG) ? ~0UL :
+							((1UL << n) - 1) << off;
+		} while (!__atomic_compare_exchange_n(word, &old, old | mask,
+						      false, __ATOMIC_ACQ_REL,
+						      __ATOMIC_RELAXED));
+		got += n;
+		nr += n;
+		if (off + n < FOOFS_BITS_PER_LONG)
+			break; /* Run ended inside the word */
 	}
 
-	return used_files;
+	return got;
 }
 
-enum {MAX_NAME = 16};
-enum {MAX_ENTS = PAGE_SIZE /  (MAX_NAME + 8)};
-struct foofs_dir {
-	struct __foo_dir_ent {
-		ulong ino;
-		char name[MAX_NAME];
-	} ents[MAX_ENTS];
-};
+/* Search one allocation group. @huge wants a FOOFS_HUGE_BLOCKS aligned run */
+static ulong _ag_alloc(struct foofs_sb_info *fsbi, struct foofs_pcpu *pc,
+		       ulong ag, ulong want, bool huge, ulong *len)
+{
+	const ulong huge_words = FOOFS_HUGE_BLOCKS / FOOFS_BITS_PER_LONG;
+	const ulong ag_words = FOOFS_AG_BLOCKS / FOOFS_BITS_PER_LONG;
+	struct foofs_bitmap *bm = &fsbi->blocks;
+	ulong first = ag * ag_words;
+	ulong last = min_t(ulong, first + ag_words, bm->words);
+	ulong start, w, n;
+
+	start = (pc->ag_hint >= first && pc->ag_hint < last) ?
+							pc->ag_hint : first;
+
+	for (n = 0; huge && n < last - first; n += huge_words) {
+		ulong rel = (ALIGN(start - first, huge_words) + n) %
+							(last - first);
+		ulong i;
+
+		w = first + rel - rel % huge_words;
+		if (w + huge_words > last)
+			continue;
+		for (i = 0; i < huge_words; ++i)
+			if (__atomic_load_n(&bm->map[w + i], __ATOMIC_RELAXED))
+				break;
+		if (i < huge_words)
+			continue;
+
+		*len = _bm_claim_run(bm, w * FOOFS_BITS_PER_LONG, want);
+		if (*len) {
+			pc->ag_hint = w + huge_words;
+			return w * FOOFS_BITS_PER_LONG;
+		}
+	}
+
+	for (n = 0; n < last - first; ++n) {
+		ulong word, nr;
+
+		w = first + (start - first + n) % (last - first);
+		word = __atomic_load_n(&bm->map[w], __ATOMIC_RELAXED);
+		if (word == ~0UL)
+			continue;
+
+		nr = w * FOOFS_BITS_PER_LONG + __builtin_ctzl(~word);
+		*len = _bm_claim_run(bm, nr, want);
+		if (*len) {
+			pc->ag_hint = w;
+			return nr;
+		}
+	}
+
+	return 0;
+}
+
+/* Allocate up to @want contiguous blocks, first trying right at @goal.
+ * Returns the first bn or 0 on ENOSPC, the number of blocks at @len.
+ */
+ulong foofs_ext_alloc(struct foofs_sb_info *fsbi, ulong goal, ulong want,
+		      bool huge, ulong *len)
+{
+	struct foofs_pcpu *pc = _my_pcpu(fsbi);
+	ulong bn = 0, n;
+
+	if (unlikely(!pc->placed))
+		_pcpu_place(fsbi, pc);
+
+	if (goal && goal < pmem_blocks(&fsbi->sbi.pmem) &&
+	    (!huge || !(goal % FOOFS_HUGE_BLOCKS))) {
+		*len = _bm_claim_run(&fsbi->blocks, goal, want);
+		if (*len) {
+			bn = goal;
+			goto out;
+		}
+	}
+
+	/* Lockless, the pc->ag_hint is only a hint */
+	for (n = 0; n < fsbi->num_ags && !bn; ++n)
+		bn = _ag_alloc(fsbi, pc, (pc->ag + n) % fsbi->num_ags, want,
+			       huge, len);
+	if (unlikely(!bn && huge))
+		return foofs_ext_alloc(fsbi, 0, want, false, len);
+	/* The blocks of deleted files may still be on their way back */
+	if (unlikely(!bn) && zus_reclaim_drain())
+		return foofs_ext_alloc(fsbi, goal, want, huge, len);
+
+out:
+	if (likely(bn))
+		_usage_add(fsbi, 0, *len);
+	return bn;
+}
+
+void foofs_ext_free(struct foofs_sb_info *fsbi, ulong bn, ulong len)
+{
+	ulong i;
+
+	for (i = 0; i < len; ++i)
+		_bm_free(&fsbi->blocks, bn + i);
+	_usage_add(fsbi, 0, -(long)len);
+}
+
+/* ~~~~ reference counts of the data blocks shared by clone ~~~~ */
+
+/* Last run starting at or below @bn, -1 if none */
+static long _refs_find(struct foofs_refs *r, ulong bn)
+{
+	ulong lo = 0, hi = r->nr;
+
+	while (lo < hi) {
+		ulong mid = (lo + hi) / 2;
+
+		if (r->ents[mid].bn <= bn)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (long)lo - 1;
+}
+
+/* Room for @want runs, so the updates below cannot fail half way */
+static int _refs_reserve(struct foofs_refs *r, ulong want)
+{
+	struct foofs_xref *ents;
+	ulong size = r->size ?: 64;
+
+	if (want <= r->size)
+		return 0;
+
+	while (size < want)
+		size *= 2;
+	ents = realloc(r->ents, size * sizeof(*ents));
+	if (unlikely(!ents))
+		return -ENOMEM;
+
+	r->ents = ents;
+	r->size = size;
+	return 0;
+}
+
+/* @nr is also read without the lock, by the no-sharing fast paths */
+static void _refs_insert(struct foofs_refs *r, ulong pos, ulong bn, ulong len,
+			 ulong refs)
+{
+	memmove(&r->ents[pos + 1], &r->ents[pos],
+		(r->nr - pos) * sizeof(*r->ents));
+	r->ents[pos].bn = bn;
+	r->ents[pos].len = len;
+	r->ents[pos].refs = refs;
+	__atomic_store_n(&r->nr, r->nr + 1, __ATOMIC_RELAXED);
+}
+
+static void _refs_remove(struct foofs_refs *r, ulong pos)
+{
+	memmove(&r->ents[pos], &r->ents[pos + 1],
+		(r->nr - pos - 1) * sizeof(*r->ents));
+	__atomic_store_n(&r->nr, r->nr - 1, __ATOMIC_RELAXED);
+}
+
+/* So that no run crosses @bn. Needs one reserved slot */
+static void _refs_split(struct foofs_refs *r, ulong bn)
+{
+	long i = _refs_find(r, bn);
+	struct foofs_xref *x;
+
+	if (i < 0)
+		return;
+
+	x = &r->ents[i];
+	if (x->bn == bn || x->bn + x->len <= bn)
+		return;
+
+	_refs_insert(r, i + 1, bn, x->bn + x->len - bn, x->refs);
+	r->ents[i].len = bn - r->ents[i].bn;
+}
+
+/* Join back the runs of [@first, @last] that became alike */
+static void _refs_merge(struct foofs_refs *r, ulong first, ulong last)
+{
+	ulong i = first ? first - 1 : 0;
+
+	while (i <= last && i + 1 < r->nr) {
+		struct foofs_xref *x = &r->ents[i], *next = x + 1;
+
+		if (x->bn + x->len == next->bn && x->refs == next->refs) {
+			x->len += next->len;
+			_refs_remove(r, i + 1);
+			if (last)
+				--last;
+		} else {
+			++i;
+		}
+	}
+}
+
+/* First run at or after @bn, after a _refs_split at @bn */
+static ulong _refs_first(struct foofs_refs *r, ulong bn)
+{
+	long i = _refs_find(r, bn);
+
+	return (i >= 0 && r->ents[i].bn == bn) ? (ulong)i : (ulong)(i + 1);
+}
+
+/* One more owner of the data blocks [@bn, @bn + @len) */
+int foofs_ext_get(struct foofs_sb_info *fsbi, ulong bn, ulong len)
+{
+	struct foofs_refs *r = &fsbi->refs;
+	ulong end = bn + len, cur = bn, first, pos, n;
+	int err;
+
+	pthread_mutex_lock(&r->lock);
+
+	/* Each run in the range leaves at most one gap before it */
+	pos = _refs_first(r, bn);
+	for (n = 0; pos + n < r->nr && r->ents[pos + n].bn < end; ++n)
+		;
+	err = _refs_reserve(r, r->nr + 2 * n + 3);
+	if (unlikely(err))
+		goto out;
+
+	_refs_split(r, bn);
+	_refs_split(r, end);
+	first = pos = _refs_first(r, bn);
+	while (cur < end) {
+		struct foofs_xref *x = &r->ents[pos];
+
+		if (pos < r->nr && x->bn == cur) {
+			++x->refs;
+			cur += x->len;
+		} else {
+			ulong next = (pos < r->nr && x->bn < end) ? x->bn : end;
+
+			_refs_insert(r, pos, cur, next - cur, 1);
+			cur = next;
+		}
+		++pos;
+	}
+	_refs_merge(r, first, pos);
+out:
+	pthread_mutex_unlock(&r->lock);
+	return err;
+}
+
+/* One owner less. Blocks that had no other owner are freed */
+void foofs_ext_put(struct foofs_sb_info *fsbi, ulong bn, ulong len)
+{
+	struct foofs_refs *r = &fsbi->refs;
+	ulong end = bn + len, cur = bn, first, pos;
+
+	if (!__atomic_load_n(&r->nr, __ATOMIC_RELAXED)) {
+		foofs_ext_free(fsbi, bn, len);
+		return;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	if (unlikely(_refs_reserve(r, r->nr + 2))) {
+		/* Leaked till the next mount recounts them */
+		ERROR("no memory to unshare bn=0x%lx len=0x%lx\n", bn, len);
+		goto out;
+	}
 
-static struct foofs_dir *_foo_dir(struct zus_inode_info *dir_ii)
+	_refs_split(r, bn);
+	_refs_split(r, end);
+	first = pos = _refs_first(r, bn);
+	while (cur < end) {
+		struct foofs_xref *x = &r->ents[pos];
+
+		if (pos < r->nr && x->bn == cur) {
+			cur += x->len;
+			if (--x->refs)
+				++pos;
+			else
+				_refs_remove(r, pos);
+		} else {
+			ulong next = (pos < r->nr && x->bn < end) ? x->bn : end;
+
+			foofs_ext_free(fsbi, cur, next - cur);
+			cur = next;
+		}
+	}
+	_refs_merge(r, first, pos);
+out:
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Is @bn mapped by more than one file. @run is the number of blocks, up to
+ * @len, from @bn on that are the same.
+ *
+ * Sharing of a file's blocks only ever grows under the file's lock held by
+ * the caller (clone locks both files), so no runs means none of ours.
+ */
+bool foofs_ext_shared(struct foofs_sb_info *fsbi, ulong bn, ulong len,
+		      ulong *run)
+{
+	struct foofs_refs *r = &fsbi->refs;
+	bool shared = false;
+	ulong next;
+	long i;
+
+	*run = len;
+	if (!__atomic_load_n(&r->nr, __ATOMIC_RELAXED))
+		return false;
+
+	pthread_mutex_lock(&r->lock);
+	i = _refs_find(r, bn);
+	if (i >= 0 && bn < r->ents[i].bn + r->ents[i].len) {
+		shared = true;
+		next = r->ents[i].bn + r->ents[i].len;
+	} else {
+		next = ((ulong)(i + 1) < r->nr) ? r->ents[i + 1].bn : ~0UL;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	if (next - bn < len)
+		*run = next - bn;
+	return shared;
+}
+
+/* At mount, mark the data blocks of one extent. Blocks some other file
+ * already marked are shared with it. Returns how many were not marked yet.
+ */
+ulong foofs_ext_mark_used(struct foofs_sb_info *fsbi, ulong bn, ulong len)
 {
-	return pmem_baddr(&dir_ii->sbi->pmem,  dir_ii->zi->i_ino + 1);
+	ulong i, marked = 0, shared = 0;
+	int err;
+
+	for (i = 0; i <= len; ++i) {
+		if (i < len && _bm_test_and_set(&fsbi->blocks, bn + i)) {
+			++shared;
+			continue;
+		}
+
+		if (shared) {
+			err = foofs_ext_get(fsbi, bn + i - shared, shared);
+			if (unlikely(err))
+				fsbi->refs.err = err;
+			shared = 0;
+		}
+		marked += (i < len);
+	}
+
+	return marked;
 }
 
-static struct __foo_dir_ent *_find_de(struct zus_inode_info *dir_ii,
-				      struct zufs_str *str)
+static void _alloc_fini(struct foofs_sb_info *fsbi)
 {
-	struct foofs_dir *dir;
-	int i;
+	uint i;
 
-	dir = _foo_dir(dir_ii);
-	for (i = 0; i < MAX_ENTS; ++i)
-		if (0 == strncmp(dir->ents[i].name, str->name, str->len))
-			return &dir->ents[i];
-	return NULL; /* NOT FOUND */
+	if (fsbi->pcpu) {
+		for (i = 0; i < fsbi->num_pcpu; ++i)
+			pthread_spin_destroy(&fsbi->pcpu[i].lock);
+		free(fsbi->pcpu);
+		fsbi->pcpu = NULL;
+	}
+	_bm_fini(&fsbi->blocks);
+	_bm_fini(&fsbi->inos);
+
+	free(fsbi->refs.ents);
+	fsbi->refs.ents = NULL;
+	fsbi->refs.nr = fsbi->refs.size = 0;
+	pthread_mutex_destroy(&fsbi->refs.lock);
 }
 
-static struct __foo_dir_ent *_find_empty_de(struct zus_inode_info *dir_ii)
+struct _scan {
+	struct foofs_sb_info *fsbi;
+	long used_inodes;
+	long used_blocks;
+};
+
+/* The inodes in inode-table blocks [@bn, @end). Runs in parallel with the
+ * other ranges, on the CPUs local to them.
+ */
+static void _scan_inodes(void *arg, ulong bn, ulong end)
 {
-	struct foofs_dir *dir;
-	int i;
+	struct _scan *scan = arg;
+	struct foofs_sb_info *fsbi = scan->fsbi;
+	struct zus_inode *zi_array = pmem_baddr(&fsbi->sbi.pmem, 1);
+	ulong ino = max_t(ulong, (bn - 1) * FOOFS_INO_PER_BLOCK, 1);
+	ulong last = min_t(ulong, (end - 1) * FOOFS_INO_PER_BLOCK,
+			   fsbi->max_ino);
+	long used_inodes = 0, used_blocks = 0;
+
+	for (; ino < last; ++ino) {
+		struct zus_inode *zi = &zi_array[ino];
+		ulong slots, i;
+
+		if (!zi->i_mode)
+			continue;
+
+		slots = zi_isdir(zi) ? 0 : foofs_inline_slots(zi);
+		if (unlikely(FOOFS_INLINE_SLOTS < slots ||
+			     FOOFS_INO_PER_BLOCK <=
+					ino % FOOFS_INO_PER_BLOCK + slots)) {
+			ERROR("[%ld] bad inline slots=%ld\n", ino, slots);
+			slots = 0;
+		}
+
+		/* Cut between new_inode and add_dentry, or between
+		 * remove_dentry and free_inode. A live dir also links to
+		 * itself.
+		 */
+		if (ino != FOOFS_ROOT_NO &&
+		    zi->i_nlink < (zi_isdir(zi) ? 2U : 1U)) {
+			DBG("[%ld] orphan mode=0x%x nlink=%d\n", ino,
+			    zi->i_mode, zi->i_nlink);
+			memset(zi, 0, (1 + slots) * sizeof(*zi));
+			pmem_flush(zi, (1 + slots) * sizeof(*zi));
+			ino += slots;
+			continue;
+		}
+
+		_bm_test_and_set(&fsbi->inos, ino);
+		++used_inodes;
+		if (zi_isdir(zi))
+			used_blocks += foofs_dir_mark_blocks(fsbi, zi);
+		else if (zi_isreg(zi))
+			used_blocks += foofs_file_mark_blocks(fsbi, zi);
+		else if (zi_islnk(zi) && zi->i_on_disk.a[0]) {
+			foofs_blk_mark_used(fsbi, zi->i_on_disk.a[0]);
+			++used_blocks;
+		}
+
+		/* Not inodes, skip over the data */
+		for (i = 1; i <= slots; ++i)
+			_bm_test_and_set(&fsbi->inos, ino + i);
+		used_inodes += slots;
+		ino += slots;
+	}
 
-	dir = _foo_dir(dir_ii);
-	for (i = 0; i < MAX_ENTS; ++i)
-		if (!dir->ents[i].ino)
-			return &dir->ents[i];
-	return NULL; /* ENOSPC */
+	/* The orphan flushes above were issued on this CPU, a fence of the
+	 * mount thread does not order them
+	 */
+	pmem_fence();
+
+	__atomic_fetch_add(&scan->used_inodes, used_inodes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&scan->used_blocks, used_blocks, __ATOMIC_RELAXED);
+}
+
+/* Rebuild the in-DRAM allocators from the inode table and directories */
+static int _alloc_init(struct foofs_sb_info *fsbi)
+{
+	ulong blocks = pmem_blocks(&fsbi->sbi.pmem);
+	struct _scan scan = { .fsbi = fsbi };
+	ulong i;
+	int err;
+
+	pthread_mutex_init(&fsbi->refs.lock, NULL);
+	fsbi->refs.err = 0;
+
+	err = _bm_init(&fsbi->inos, fsbi->max_ino);
+	if (unlikely(err))
+		goto fail;
+	err = _bm_init(&fsbi->blocks, blocks);
+	if (unlikely(err))
+		goto fail;
+	fsbi->num_ags = (blocks + FOOFS_AG_BLOCKS - 1) / FOOFS_AG_BLOCKS ?: 1;
+
+	fsbi->num_pcpu = zus_max_ztno();
+	fsbi->pcpu = aligned_alloc(sizeof(*fsbi->pcpu),
+				   fsbi->num_pcpu * sizeof(*fsbi->pcpu));
+	if (unlikely(!fsbi->pcpu)) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	memset(fsbi->pcpu, 0, fsbi->num_pcpu * sizeof(*fsbi->pcpu));
+	for (i = 0; i < fsbi->num_pcpu; ++i) {
+		struct foofs_pcpu *pc = &fsbi->pcpu[i];
+
+		pthread_spin_init(&pc->lock, PTHREAD_PROCESS_PRIVATE);
+		pc->ino.hint = i * fsbi->inos.words / fsbi->num_pcpu;
+		pc->blk.hint = i * fsbi->blocks.words / fsbi->num_pcpu;
+	}
+
+	/* ino 0 is never used */
+	_bm_test_and_set(&fsbi->inos, 0);
+	for (i = 0; i < fsbi->meta_blocks && i < blocks; ++i)
+		_bm_test_and_set(&fsbi->blocks, i);
+
+	zus_pmem_parallel_for(&fsbi->sbi.pmem, 1,
+			      1 + (fsbi->max_ino + FOOFS_INO_PER_BLOCK - 1) /
+				  FOOFS_INO_PER_BLOCK,
+			      _scan_inodes, &scan);
+
+	pmem_fence();
+
+	err = fsbi->refs.err;
+	if (unlikely(err)) {
+		ERROR("no memory for the shared blocks => %d\n", err);
+		goto fail;
+	}
+
+	fsbi->pcpu[0].used_inodes = scan.used_inodes;
+	fsbi->pcpu[0].used_blocks = fsbi->meta_blocks + scan.used_blocks;
+	return 0;
+
+fail:
+	_alloc_fini(fsbi);
+	return err;
 }
 
 static void _init_root(struct zus_sb_info *sbi)
@@ -124,6 +857,8 @@ static void _init_root(struct zus_sb_info *sbi)
 
 	memset(root, 0, sizeof(*root));
 
+	root->i_ino = FOOFS_ROOT_NO;
+	root->i_dir.parent = FOOFS_ROOT_NO;
 	root->i_nlink = 2;
 	root->i_mode = S_IFDIR | 0644;
 	root->i_uid = 0;
@@ -133,6 +868,19 @@ static void _init_root(struct zus_sb_info *sbi)
 	timespec_to_mt(&root->i_atime, &now);
 	timespec_to_mt(&root->i_mtime, &now);
 	timespec_to_mt(&root->i_ctime, &now);
+	pmem_persist(root, sizeof(*root));
+}
+
+/* A journal's record is retired when its header is clear */
+static void _init_journals(struct foofs_sb_info *fsbi)
+{
+	uint i;
+
+	for (i = 0; i < FOOFS_JOURNALS; ++i)
+		pmem_memset_nt(pmem_baddr(&fsbi->sbi.pmem,
+					  fsbi->journals[i].bn),
+			       0, ZUS_CACHELINE_SIZE);
+	pmem_fence();
 }
 
 /* ~~~~~~~~~~~~~~~~ Vectors ~~~~~~~~~~~~~~~~~~~~~*/
@@ -141,76 +889,142 @@ static const struct zus_sbi_operations	foofs_sbi_operations;
 static const struct zus_zfi_operations	foofs_zfi_operations;
 
 /* ~~~~ foofs_sbi_operations ~~~~ */
+static struct zus_pool g_sbi_pool;
+
 static
 struct zus_sb_info *foofs_sbi_alloc(struct zus_fs_info *zfi)
 {
-	struct zus_sb_info *sbi = calloc(1, sizeof(struct zus_sb_info));
+	struct foofs_sb_info *fsbi = zus_pool_alloc(&g_sbi_pool);
 
-	if (!sbi)
+	if (!fsbi)
 		return NULL;
 
-	sbi->op = &foofs_sbi_operations;
-	return sbi;
+	memset(fsbi, 0, sizeof(*fsbi));
+	if (unlikely(zus_pool_init(&fsbi->zii_pool, "foofs_zii",
+				   sizeof(struct foofs_inode_info)))) {
+		zus_pool_free(&g_sbi_pool, fsbi);
+		return NULL;
+	}
+
+	fsbi->sbi.op = &foofs_sbi_operations;
+	return &fsbi->sbi;
 }
 
 static void foofs_sbi_free(struct zus_sb_info *sbi)
 {
-	free(sbi);
+	struct foofs_sb_info *fsbi = FSBI(sbi);
+
+	zus_pool_fini(&fsbi->zii_pool);
+	zus_pool_free(&g_sbi_pool, fsbi);
 }
 
 static
 int foofs_sbi_init(struct zus_sb_info *sbi, struct zufs_ioc_mount *zim)
 {
-	_init_root(sbi);
+	struct foofs_sb_info *fsbi = FSBI(sbi);
+	ulong blocks = pmem_blocks(&sbi->pmem);
+	ulong itable = blocks / FOOFS_INODES_RATIO;
+	struct zus_inode *root;
+	int err;
+
+	fsbi->meta_blocks = 1 + itable + FOOFS_JOURNALS * FOOFS_JOURNAL_BLOCKS;
+	fsbi->max_ino = itable * FOOFS_INO_PER_BLOCK;
+	if (unlikely(fsbi->meta_blocks >= blocks)) {
+		ERROR("device too small blocks=%ld\n", blocks);
+		return -EINVAL;
+	}
+
+	err = foofs_journal_init(fsbi, 1 + itable);
+	if (unlikely(err))
+		return err;
+	zus_gcommit_init(&fsbi->sync_gc, foofs_sync_commit);
+
+	root = find_zi(sbi, FOOFS_ROOT_NO);
+	if (zi_isdir(root) && zi_ino(root) == FOOFS_ROOT_NO) {
+		err = foofs_journal_recover(fsbi);
+		if (unlikely(err))
+			goto fail;
+	} else {
+		INFO("new filesystem\n");
+		_init_journals(fsbi);
+		_init_root(sbi);
+	}
+
+	err = _alloc_init(fsbi);
+	if (unlikely(err))
+		goto fail;
+
 	sbi->z_root = zus_iget(sbi, FOOFS_ROOT_NO);
-	if (unlikely(!sbi->z_root))
-		return -ENOMEM;
+	if (unlikely(!sbi->z_root)) {
+		_alloc_fini(fsbi);
+		err = -ENOMEM;
+		goto fail;
+	}
 
 	return 0;
+
+fail:
+	zus_gcommit_fini(&fsbi->sync_gc);
+	foofs_journal_fini(fsbi);
+	return err;
 }
 
 static int foofs_sbi_fini(struct zus_sb_info *sbi)
 {
 	// zus_iput(sbi->z_root); was this done already
+	/* Queued frees still point at us */
+	zus_reclaim_drain();
+	_alloc_fini(FSBI(sbi));
+	zus_gcommit_fini(&FSBI(sbi)->sync_gc);
+	foofs_journal_fini(FSBI(sbi));
 	return 0;
 }
 
 static
 struct zus_inode_info *foofs_zii_alloc(struct zus_sb_info *sbi)
 {
-	struct zus_inode_info *zii = calloc(1, sizeof(struct zus_inode_info));
+	struct foofs_inode_info *fii = zus_pool_alloc(&FSBI(sbi)->zii_pool);
 
-	if (!zii)
+	if (!fii)
 		return NULL;
 
-	zii->op = &foofs_zii_operations;
-	return zii;
+	memset(fii, 0, sizeof(*fii));
+	pthread_rwlock_init(&fii->lock, NULL);
+	fii->zii.op = &foofs_zii_operations;
+	return &fii->zii;
 }
 
 static
 void foofs_zii_free(struct zus_inode_info *zii)
 {
-	free(zii);
+	pthread_rwlock_destroy(&FII(zii)->lock);
+	zus_pool_free(&FSBI(zii->sbi)->zii_pool, zii);
 }
 
 static int foofs_statfs(struct zus_sb_info *sbi, struct zufs_ioc_statfs *ioc)
 {
-	uint num_files = _get_fill(sbi);
+	struct foofs_sb_info *fsbi = FSBI(sbi);
+	ulong used_inodes, used_blocks;
+
+	_usage_fold(fsbi, &used_inodes, &used_blocks);
 
 	ioc->statfs_out.f_type		= M1FS_SUPER_MAGIC;
 	ioc->statfs_out.f_bsize		= PAGE_SIZE;
 
 	ioc->statfs_out.f_blocks	= pmem_blocks(&sbi->pmem);
-	ioc->statfs_out.f_bfree		= ioc->statfs_out.f_blocks - num_files;
+	ioc->statfs_out.f_bfree		= ioc->statfs_out.f_blocks -
+			min_t(ulong, used_blocks, ioc->statfs_out.f_blocks);
 	ioc->statfs_out.f_bavail	= ioc->statfs_out.f_bfree;
 
-	ioc->statfs_out.f_files		= num_files;
-	ioc->statfs_out.f_ffree		= MAX_ENTS - num_files;
+	/* ino 0 is never handed out */
+	ioc->statfs_out.f_files		= fsbi->max_ino ? fsbi->max_ino - 1 : 0;
+	ioc->statfs_out.f_ffree		= ioc->statfs_out.f_files -
+			min_t(ulong, used_inodes, ioc->statfs_out.f_files);
 
 // 	ioc->statfs_out.f_fsid.val[0]	= 0x17;
 // 	ioc->statfs_out.f_fsid.val[1]	= 0x17;
 
-	ioc->statfs_out.f_namelen	= MAX_NAME;
+	ioc->statfs_out.f_namelen	= ZUFS_NAME_LEN;
 
 	ioc->statfs_out.f_frsize	= 0; // ???
 	ioc->statfs_out.f_flags		= 0; // ????
@@ -219,145 +1033,207 @@ static int foofs_statfs(struct zus_sb_info *sbi, struct zufs_ioc_statfs *ioc)
 	return 0;
 }
 
+/* Inline slots of a new symlink, with its '\0'. One shorter than
+ * i_symlink is the Kernel's.
+ */
+static ulong _symlink_slots(struct zus_inode *zi)
+{
+	if (!zi_islnk(zi) || zi->i_size < sizeof(zi->i_symlink) ||
+	    FOOFS_INLINE_SLOTS * ZUFS_INODE_SIZE <= zi->i_size)
+		return 0;
+	return zi->i_size / ZUFS_INODE_SIZE + 1;
+}
+
+/* The link is in @app_ptr, into the inline slots or else one block */
+static int _new_symlink(struct foofs_tx *tx, struct zus_inode *zi,
+			const char *app_ptr)
+{
+	struct foofs_sb_info *fsbi = tx->fsbi;
+	ulong len = zi->i_size;
+	char *sym;
+
+	if (unlikely(PAGE_SIZE <= len))
+		return -ENAMETOOLONG;
+
+	if (foofs_inline_slots(zi)) {
+		/* Staged with the inode */
+		sym = foofs_inline(zi);
+	} else {
+		zi->i_on_disk.a[0] = foofs_blk_alloc(fsbi);
+		if (unlikely(!zi->i_on_disk.a[0]))
+			return -ENOSPC;
+		if (unlikely(!foofs_tx_fresh(tx, zi->i_on_disk.a[0]))) {
+			foofs_blk_free(fsbi, zi->i_on_disk.a[0]);
+			return -ENOMEM;
+		}
+		zi->i_blocks = 1;
+		sym = pmem_baddr(&fsbi->sbi.pmem, zi->i_on_disk.a[0]);
+	}
+
+	memcpy(sym, app_ptr, len);
+	sym[len] = 0;
+	return 0;
+}
+
+/* The inode (with the target of a symlink) is one tx. A crash leaves it
+ * all zeros or whole, the latter is an orphan till add_dentry's commit.
+ */
 static int foofs_new_inode(struct zus_sb_info *sbi, struct zus_inode_info *zii,
 			   void *app_ptr, struct zufs_ioc_new_inode *ioc_new)
 {
-	struct zus_inode *zi = find_free_ino(sbi);
-	ulong ino;
+	struct foofs_sb_info *fsbi = FSBI(sbi);
+	ulong slots = _symlink_slots(&ioc_new->zi);
+	ulong ino = slots ? _ino_alloc_inline(fsbi, slots) : 0;
+	struct zus_inode *zi;
+	struct foofs_tx *tx;
+	ulong i;
+	int err;
 
-	if (unlikely(!zi))
+	/* No room for the slots at hand, go without */
+	if (!ino) {
+		slots = 0;
+		ino = _ino_alloc(fsbi);
+	}
+	if (unlikely(!ino))
 		return -ENOSPC;
 
-	zii->zi = zi;
+	tx = foofs_tx_begin(fsbi);
+	if (unlikely(!tx)) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	zi = foofs_tx_stage(tx, find_zi(sbi, ino), (1 + slots) * sizeof(*zi));
+	if (unlikely(!zi)) {
+		err = -ENOMEM;
+		goto abort;
+	}
 
-	ino = zi->i_ino;
 	*zi = ioc_new->zi;
 	zi->i_ino = ino;
 
-	if (zi_isdir(zi)) {
-		void *dir = _foo_dir(ioc_new->dir_ii);
+	zi->i_blocks = 0;
+	memset(&zi->i_on_disk, 0, sizeof(zi->i_on_disk));
+	zi->i_on_disk.a[1] = slots;
 
-		memset(dir, 0, PAGE_SIZE);
+	if (zi_isdir(zi)) {
+		/* Directory blocks are allocated on first add_dentry */
 		zi->i_size = PAGE_SIZE;
-		zi->i_blocks = 1;
 
 		zus_std_new_dir(ioc_new->dir_ii->zi, zi);
-	}/* else zi_issym(zi) {
-		TODO: long symlink in app_ptr
-	}*/
+	} else if (zi_islnk(zi) && sizeof(zi->i_symlink) <= zi->i_size) {
+		err = _new_symlink(tx, zi, app_ptr);
+		if (unlikely(err))
+			goto abort;
+	}
+
+	err = foofs_tx_commit(tx);
+	if (unlikely(err))
+		goto fail;
+
+	zi = find_zi(sbi, ino);
+	zii->zi = zi;
+	_usage_add(fsbi, 1 + slots, 0);
 
 	DBG("[%lld] size=0x%llx, blocks=0x%llx ct=0x%llx mt=0x%llx link=0x%x mode=0x%x\n",
 	    zi->i_ino, zi->i_size, zi->i_blocks, zi->i_ctime, zi->i_mtime,
 	    zi->i_nlink, zi->i_mode);
 
 	return 0;
+
+abort:
+	foofs_tx_abort(tx);
+fail:
+	/* Nothing reached pmem */
+	for (i = 0; i <= slots; ++i)
+		_ino_free(fsbi, ino + i);
+	return err;
 }
 
-static int foofs_iget(struct zus_sb_info *sbi, struct zus_inode_info *zii,
-		      ulong ino)
-{
-	zii->op = &foofs_zii_operations;
-	zii->zi = find_zi(sbi, ino);
+/* The blocks of a freed file, put by a reclaim worker */
+struct _file_reclaim {
+	struct zus_reclaim_work zrw;	/* must be first */
+	struct foofs_sb_info *fsbi;
+	struct zus_inode zi;		/* A DRAM copy, the inode is gone */
+};
 
-	if (!zii->zi)
-		return -ENOENT;
+static void _file_reclaim_work(struct zus_reclaim_work *zrw)
+{
+	struct _file_reclaim *fr = (void *)zrw;
 
-	return 0;
+	foofs_file_free(fr->fsbi, &fr->zi);
+	free(fr);
 }
 
-static ulong foofs_lookup(struct zus_inode_info *dir_ii, struct zufs_str *str)
+/* Hand the blocks of a big file to a reclaim worker. False if they should
+ * be freed inline.
+ */
+static bool _file_reclaim(struct foofs_sb_info *fsbi, struct zus_inode *zi)
 {
-	struct __foo_dir_ent *de;
+	struct _file_reclaim *fr;
 
-	DBG("[%.*s]\n", str->len, str->name);
-	if (0 == strncmp(".", str->name, str->len))
-		return dir_ii->zi->i_ino;
-	else if (0 == strncmp("..", str->name, str->len))
-		return dir_ii->zi->i_dir.parent;
+	if (zi->i_blocks < FOOFS_RECLAIM_BLOCKS)
+		return false;
 
-	de = _find_de(dir_ii, str);
-	if (unlikely(!de))
-		return 0; /* NOT FOUND */
+	fr = malloc(sizeof(*fr));
+	if (unlikely(!fr))
+		return false;
 
-	return de->ino;
+	fr->zrw.fn = _file_reclaim_work;
+	fr->fsbi = fsbi;
+	fr->zi = *zi;
+	if (unlikely(!zus_reclaim_queue(&fr->zrw))) {
+		free(fr);
+		return false;
+	}
+	return true;
 }
 
-static int foofs_add_dentry(struct zus_inode_info *dir_ii,
-			    struct zus_inode_info *zii, struct zufs_str *str)
+static int foofs_free_inode(struct zus_inode_info *zii)
 {
-	uint nl = min_t(uint, MAX_NAME-1, str->len);
-	struct __foo_dir_ent *de;
-
-	de = _find_empty_de(dir_ii);
-	if (unlikely(!de)) {
-		DBG("[%ld] [%.*s] ino=%ld\n",
-		    zi_ino(dir_ii->zi), str->len, str->name, de->ino);
-		return -ENOSPC;
+	struct foofs_sb_info *fsbi = FSBI(zii->sbi);
+	ulong ino = zi_ino(zii->zi);
+	struct zus_inode zi = *zii->zi;
+	ulong slots = zi_isdir(&zi) ? 0 : foofs_inline_slots(&zi);
+
+	DBG("[%ld] mode=0x%x\n", ino, zi.i_mode);
+
+	/* The inline data goes first, the slots are never left owned by
+	 * no one while not zeros
+	 */
+	if (slots) {
+		memset(foofs_inline(zii->zi), 0, slots * ZUFS_INODE_SIZE);
+		pmem_persist(foofs_inline(zii->zi), slots * ZUFS_INODE_SIZE);
 	}
 
-	memcpy(de->name, str->name, nl);
-	de->name[nl]=0; /* C string for prints */
-	de->ino = zii->zi->i_ino;
-	zus_std_add_dentry(dir_ii->zi, zii->zi);
-
-	DBG("[%ld] [%.*s] ino=%ld\n",
-	    zi_ino(dir_ii->zi), str->len, str->name, de->ino);
+	/* The inode is gone before its blocks are, a crash in between only
+	 * leaks them till the next mount. So the number can be reused while
+	 * a reclaim worker still puts the blocks.
+	 */
+	memset(zii->zi, 0, sizeof(*zii->zi));
+	pmem_persist(zii->zi, sizeof(*zii->zi));
+
+	if (zi_isdir(&zi))
+		foofs_dir_free(fsbi, &zi);
+	else if (zi_isreg(&zi) && !_file_reclaim(fsbi, &zi))
+		foofs_file_free(fsbi, &zi);
+	else if (zi_islnk(&zi) && zi.i_on_disk.a[0])
+		foofs_blk_free(fsbi, zi.i_on_disk.a[0]);
+
+	foofs_inline_free(fsbi, ino, slots);
+	_usage_add(fsbi, -1, 0);
+	_ino_free(fsbi, ino);
 	return 0;
 }
 
-static int foofs_remove_dentry(struct zus_inode_info *dir_ii,
-			       struct zufs_str *str)
+static int foofs_iget(struct zus_sb_info *sbi, struct zus_inode_info *zii,
+		      ulong ino)
 {
-	struct __foo_dir_ent *de;
-
-	DBG("[%ld] [%.*s]\n", zi_ino(dir_ii->zi), str->len, str->name);
+	zii->op = &foofs_zii_operations;
+	zii->zi = find_zi(sbi, ino);
 
-	de = _find_de(dir_ii, str);
-	if (unlikely(!de))
+	if (!zii->zi)
 		return -ENOENT;
 
-	zus_std_remove_dentry(dir_ii->zi, find_zi(dir_ii->sbi, de->ino));
-	de->ino = 0;
-	de->name[0] = 0;
-
-	return 0;
-}
-
-static int foofs_readdir(void *app_ptr, struct zufs_ioc_readdir *zir)
-{
-	struct zufs_readdir_iter rdi;
-	struct foofs_dir *dir;
-	uint start = zir->pos / sizeof(struct __foo_dir_ent);
-	uint i;
-
-	zufs_readdir_iter_init(&rdi, zir, app_ptr);
-
-	DBG("[0x%ld] pos 0x%lx\n", zi_ino(zir->dir_ii->zi), zir->pos);
-
-	if (zir->pos == 0) {
-		zufs_zde_emit(&rdi, zir->dir_ii->zi->i_ino, DT_DIR, 0, ".", 1);
-		zir->pos = 1;
-	}
-	if (zir->pos == 1) {
-		zufs_zde_emit(&rdi, zir->dir_ii->zi->i_ino, DT_DIR, 1, "..", 2);
-		zir->pos = 2;
-	}
-
-	dir = _foo_dir(zir->dir_ii);
-	for (i = start; i < MAX_ENTS; ++i) {
-		struct __foo_dir_ent *de = &dir->ents[i];
-		bool ok;
-
-		zir->pos = i * sizeof(*de);
-		if (!de->ino)
-			continue;
-
-		ok = zufs_zde_emit(&rdi, de->ino, 1, zir->pos,
-				   de->name, strlen(de->name));
-		if (unlikely(!ok))
-			break;
-	}
-
 	return 0;
 }
 
@@ -366,56 +1242,22 @@ static void foofs_evict(struct zus_inode_info *zii)
 {
 }
 
-static int foofs_read(void *ptr, struct zufs_ioc_IO *op)
+/* A short link is in i_symlink, a longer one inline or in its block */
+static int foofs_get_symlink(struct zus_inode_info *zii, void **symlink)
 {
-	struct zus_inode_info *zii = op->zus_ii;
-	ulong *app_ptr = ptr;
-	ulong *app_end = app_ptr + op->hdr.len / sizeof(ulong);
-	ulong start = op->filepos / sizeof(ulong);
-
-// 	INFO("READ start=0x%lx len=0x%lx offset=0x%x\n",
-// 	     start, op->hdr.len / sizeof(ulong), op->hdr.offset);
-
-	if (zii->zi->i_on_disk.a[0]) {
-		*app_ptr = 0xB00DBAAD;
-		return 0;
-	}
-
-	while(app_ptr < app_end)
-		*app_ptr++ = start++;
-
-	return 0;
-}
-
-static int foofs_write(void *ptr, struct zufs_ioc_IO *op)
-{
-	struct zus_inode_info *zii = op->zus_ii;
-	ulong *app_ptr = ptr;
-	ulong *app_end = app_ptr + op->hdr.len / sizeof(ulong);
-	ulong start = op->filepos / sizeof(ulong);
-
-	zii->zi->i_on_disk.a[0] = 0;
-// 	INFO("WRITE start=0x%lx len=0x%lx offset=0x%x\n",
-// 	     start, op->hdr.len / sizeof(ulong), op->hdr.offset);
-
-	for(;app_ptr < app_end; ++app_ptr, ++start) {
-		if (*app_ptr != start) {
-// 			if (g_verify)
-				ERROR("*app_ptr(0x%lx) != start(0x%lx) offset=0x%x len=0x%x\n",
-					*app_ptr, start, op->hdr.offset, op->hdr.len);
-// 			break;
-			zii->zi->i_on_disk.a[0] = 1; /*tell read to fail*/
-		}
-	}
-	return 0;
-}
-
-static int foofs_get_block(struct zus_inode_info *zii,
-			   struct zufs_ioc_get_block *get_block)
-{
-//	get_block->pmem_bn = _file_bn(zii) + get_block->index % _foo_file_max(zii->sbi);
-	/* foo-fs stands for foo-l */
-	get_block->pmem_bn = zii->zi->i_ino + 1;
+	struct zus_inode *zi = zii->zi;
+
+	if (unlikely(!zi_islnk(zi)))
+		return -EINVAL;
+
+	if (zi->i_size < sizeof(zi->i_symlink))
+		*symlink = zi->i_symlink;
+	else if (foofs_inline_slots(zi))
+		*symlink = foofs_inline(zi);
+	else if (zi->i_on_disk.a[0])
+		*symlink = pmem_baddr(&zii->sbi->pmem, zi->i_on_disk.a[0]);
+	else
+		return -EIO;
 	return 0;
 }
 
@@ -424,12 +1266,18 @@ static const struct zus_zii_operations foofs_zii_operations = {
 	.read	= foofs_read,
 	.write	= foofs_write,
 	.get_block = foofs_get_block,
+	.setattr = foofs_setattr,
+	.fallocate = foofs_fallocate,
+	.seek	= foofs_seek,
+	.sync	= foofs_sync,
+	.get_symlink = foofs_get_symlink,
 };
 
 static const struct zus_sbi_operations foofs_sbi_operations = {
 	.zii_alloc	= foofs_zii_alloc,
 	.zii_free	= foofs_zii_free,
 	.new_inode	= foofs_new_inode,
+	.free_inode	= foofs_free_inode,
 	.iget		= foofs_iget,
 
 	.lookup		= foofs_lookup,
@@ -438,6 +1286,7 @@ static const struct zus_sbi_operations foofs_sbi_operations = {
 	.readdir 	= foofs_readdir,
 
 	.statfs		= foofs_statfs,
+	.clone		= foofs_clone,
 };
 
 static const struct zus_zfi_operations foofs_zfi_operations = {
@@ -469,5 +1318,12 @@ static struct zus_fs_info foo_zfi = {
 
 int foofs_register_fs(int fd)
 {
+	int err;
+
+	err = zus_pool_init(&g_sbi_pool, "foofs_sbi",
+			    sizeof(struct foofs_sb_info));
+	if (unlikely(err))
+		return err;
+
 	return zus_register_one(fd, &foo_zfi);
 }
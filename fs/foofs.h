@@ -0,0 +1,272 @@
+/*
+ * foofs.h - Private definitions shared by the foofs source files
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+#ifndef __FOOFS_H__
+#define __FOOFS_H__
+
+#include <pthread.h>
+
+#include "zus.h"
+
+/* On pmem foofs is:
+ *	block 0			- m1fs device table
+ *	blocks 1 ..		- The inode table (ino 0 is not used)
+ *	.. meta_blocks		- FOOFS_JOURNALS metadata journals
+ *	the rest		- Data blocks (directories, files, extent nodes)
+ */
+#define FOOFS_ROOT_NO 1
+#define FOOFS_INODES_RATIO 20
+#define FOOFS_INO_PER_BLOCK (PAGE_SIZE / ZUFS_INODE_SIZE)
+
+/* A small file or a long symlink keeps its data inline, in up to
+ * FOOFS_INLINE_SLOTS inode-table slots right after its inode (in the same
+ * block). The number of slots is in i_on_disk.a[1]. A file with slots has
+ * no extent tree. A slot not owned by an inode is all zeros, so the mount
+ * scan never takes inline data for an inode.
+ *
+ * A symlink gets its slots with the inode. A file claims them when it is
+ * written, the slots after a new inode are most often still free (or
+ * reserved by the zu_thread that allocated it).
+ *
+ * The slots come out of the inode table (FOOFS_INODES_RATIO), and are
+ * counted as used inodes by statfs. A file of up to 896 bytes takes up to
+ * 8 inodes, so a tree of only such files runs out of inodes (ENOSPC, and
+ * so says df -i) up to 8 times sooner. That is the price of not spending
+ * a whole data block on each of them.
+ */
+#define FOOFS_INLINE_SLOTS	7
+
+static inline ulong foofs_inline_slots(struct zus_inode *zi)
+{
+	return zi->i_on_disk.a[1];
+}
+
+static inline void *foofs_inline(struct zus_inode *zi)
+{
+	return zi + 1;
+}
+
+static inline ulong foofs_inline_max(struct zus_inode *zi)
+{
+	return foofs_inline_slots(zi) * ZUFS_INODE_SIZE;
+}
+
+#define FOOFS_BITS_PER_LONG	(sizeof(ulong) * 8)
+
+/* Data blocks are split in allocation groups. Each zu_thread allocates
+ * extents from its home group (on its NUMA node) and only moves on when it
+ * is full.
+ */
+#define FOOFS_AG_BLOCKS		(1UL << 15)	/* 128M */
+#define FOOFS_HUGE_BLOCKS	(2UL * 1024 * 1024 / PAGE_SIZE)
+/* Files of at least this many blocks are freed by a reclaim worker */
+#define FOOFS_RECLAIM_BLOCKS	FOOFS_HUGE_BLOCKS
+
+/* A DRAM bitmap rebuilt at mount. A set bit is used (or reserved) */
+struct foofs_bitmap {
+	ulong *map;
+	ulong words;
+};
+
+/* One bitmap word reserved by a zu_thread */
+struct foofs_resv {
+	ulong word;	/* Index in the bitmap of the reserved word */
+	ulong bits;	/* Members of @word reserved to this thread */
+	ulong hint;	/* Next word to try */
+};
+
+/* Per zu_thread (through zus_getztno()) allocation caches. Each thread
+ * reserves a whole bitmap word at a time and hands members from there, so
+ * the shared bitmap is only touched once every BITS_PER_LONG allocations.
+ */
+struct foofs_pcpu {
+	pthread_spinlock_t lock;
+	struct foofs_resv ino;
+	struct foofs_resv blk;
+	ulong ag;	/* Home allocation group */
+	ulong ag_hint;	/* Next bitmap word to try for extents */
+	bool placed;	/* hints point at the owner's NUMA node */
+
+	/* This thread's shard of the usage counters. An inode may be freed
+	 * by another thread, so a single shard can go negative, only the
+	 * sum of all shards is meaningful.
+	 */
+	long used_inodes;
+	long used_blocks;
+} __attribute__((aligned(64)));
+
+/* A run of data blocks mapped by more than one file (by clone). @refs is
+ * the number of owners after the first. A block not in any run has one
+ * owner.
+ */
+struct foofs_xref {
+	ulong bn;
+	ulong len;
+	ulong refs;
+};
+
+/* Sorted, non overlapping runs. Like the bitmaps it is rebuilt at mount,
+ * from the blocks the mount scan finds mapped twice.
+ */
+struct foofs_refs {
+	pthread_mutex_t lock;
+	struct foofs_xref *ents;
+	ulong nr;
+	ulong size;
+	int err;	/* Of the mount scan */
+};
+
+/* ~~~~ metadata journal (foofs-journal.c) ~~~~ */
+
+#define FOOFS_JOURNALS		64
+#define FOOFS_JOURNAL_BLOCKS	16	/* Each, holds one record */
+#define FOOFS_TX_ARENA		(128 * 1024)	/* DRAM staging per journal */
+#define FOOFS_TX_REGIONS	64
+#define FOOFS_TX_BLOCKS		64	/* Fresh and freed blocks per tx */
+
+/* A staged pmem object. @orig is the pmem content when staged */
+struct foofs_tx_region {
+	void *pmem;
+	void *orig;
+	void *work;
+	uint len;
+};
+
+struct foofs_tx {
+	struct zus_gcommit_req zgr;	/* Must be first */
+	struct foofs_sb_info *fsbi;
+	struct foofs_journal *j;
+	ulong nwords;		/* Of its record, in j->wbuf */
+	uint nregions;
+	uint nfresh;
+	uint nfreed;
+	size_t arena_used;
+	struct foofs_tx_region regions[FOOFS_TX_REGIONS];
+	ulong fresh[FOOFS_TX_BLOCKS];	/* Allocated, written in place */
+	ulong freed[FOOFS_TX_BLOCKS];	/* Released after the commit */
+};
+
+/* A zu_thread uses journal ztno % FOOFS_JOURNALS, one tx at a time */
+struct foofs_journal {
+	pthread_mutex_t lock;
+	ulong bn;		/* Of its first pmem block */
+	char *arena;		/* Allocated on first use */
+	void *wbuf;
+	struct foofs_tx tx;
+} __attribute__((aligned(64)));
+
+struct foofs_sb_info {
+	struct zus_sb_info sbi;	/* Must be first */
+
+	ulong max_ino;
+	ulong meta_blocks;	/* dev-table + inode-table + journals */
+	struct foofs_bitmap inos;
+	struct foofs_bitmap blocks;
+	struct foofs_pcpu *pcpu;
+	uint num_pcpu;
+	ulong num_ags;
+	struct foofs_refs refs;
+
+	struct foofs_journal *journals;
+	ulong jseq;		/* Of the last committed record */
+	struct zus_gcommit tx_gc;	/* Of foofs_tx_commit() */
+	struct zus_gcommit sync_gc;	/* Of foofs_sync() */
+
+	struct zus_pool zii_pool;
+};
+
+static inline struct foofs_sb_info *FSBI(struct zus_sb_info *sbi)
+{
+	return (struct foofs_sb_info *)sbi;
+}
+
+struct foofs_inode_info {
+	struct zus_inode_info zii;	/* Must be first */
+
+	/* Protects a file's extent tree. Page faults on the same file come
+	 * in parallel
+	 */
+	pthread_rwlock_t lock;
+	/* A block was mapped for write to an mmap, fsync must flush */
+	bool wmapped;
+	/* Growths of i_size made (under @lock) and made durable by
+	 * foofs_sync(). Equal when there is nothing to flush
+	 */
+	ulong mgen;
+	ulong sgen;
+};
+
+static inline struct foofs_inode_info *FII(struct zus_inode_info *zii)
+{
+	return (struct foofs_inode_info *)zii;
+}
+
+static inline struct zus_inode *find_zi(struct zus_sb_info *sbi, ulong ino)
+{
+	struct zus_inode *zi_array = pmem_baddr(&sbi->pmem, 1);
+
+	return &zi_array[ino];
+}
+
+/* foofs.c */
+bool foofs_inline_claim(struct foofs_sb_info *fsbi, ulong ino, ulong have,
+			ulong want);
+void foofs_inline_free(struct foofs_sb_info *fsbi, ulong ino, ulong slots);
+ulong foofs_blk_alloc(struct foofs_sb_info *fsbi);
+void foofs_blk_free(struct foofs_sb_info *fsbi, ulong bn);
+void foofs_blk_mark_used(struct foofs_sb_info *fsbi, ulong bn);
+ulong foofs_ext_alloc(struct foofs_sb_info *fsbi, ulong goal, ulong want,
+		      bool huge, ulong *len);
+void foofs_ext_free(struct foofs_sb_info *fsbi, ulong bn, ulong len);
+int foofs_ext_get(struct foofs_sb_info *fsbi, ulong bn, ulong len);
+void foofs_ext_put(struct foofs_sb_info *fsbi, ulong bn, ulong len);
+bool foofs_ext_shared(struct foofs_sb_info *fsbi, ulong bn, ulong len,
+		      ulong *run);
+ulong foofs_ext_mark_used(struct foofs_sb_info *fsbi, ulong bn, ulong len);
+
+/* foofs-dir.c */
+ulong foofs_lookup(struct zus_inode_info *dir_ii, struct zufs_str *str);
+int foofs_add_dentry(struct zus_inode_info *dir_ii,
+		     struct zus_inode_info *zii, struct zufs_str *str);
+int foofs_remove_dentry(struct zus_inode_info *dir_ii, struct zufs_str *str);
+int foofs_readdir(void *app_ptr, struct zufs_ioc_readdir *zir);
+void foofs_dir_free(struct foofs_sb_info *fsbi, struct zus_inode *dir_zi);
+ulong foofs_dir_mark_blocks(struct foofs_sb_info *fsbi,
+			    struct zus_inode *dir_zi);
+
+/* foofs-journal.c */
+struct foofs_tx *foofs_tx_begin(struct foofs_sb_info *fsbi);
+void *foofs_tx_stage(struct foofs_tx *tx, void *p, size_t len);
+void *foofs_tx_rd(struct foofs_tx *tx, void *p);
+bool foofs_tx_fresh(struct foofs_tx *tx, ulong bn);
+bool foofs_tx_free(struct foofs_tx *tx, ulong bn);
+int foofs_tx_commit(struct foofs_tx *tx);
+void foofs_tx_abort(struct foofs_tx *tx);
+int foofs_journal_init(struct foofs_sb_info *fsbi, ulong first_bn);
+void foofs_journal_fini(struct foofs_sb_info *fsbi);
+int foofs_journal_recover(struct foofs_sb_info *fsbi);
+
+/* foofs-file.c */
+int foofs_read(void *app_ptr, struct zufs_ioc_IO *io);
+int foofs_write(void *app_ptr, struct zufs_ioc_IO *io);
+int foofs_get_block(struct zus_inode_info *zii,
+		    struct zufs_ioc_get_block *get_block);
+int foofs_setattr(struct zus_inode_info *zii, uint enable_bits,
+		  ulong truncate_size);
+int foofs_fallocate(struct zus_inode_info *zii,
+		    struct zufs_ioc_range *ioc_range);
+int foofs_seek(struct zus_inode_info *zii, struct zufs_ioc_seek *ioc_seek);
+int foofs_sync(struct zus_inode_info *zii, struct zufs_ioc_range *ioc_range);
+int foofs_sync_commit(struct zus_gcommit *zgc, struct zus_gcommit_req *reqs);
+int foofs_clone(struct zufs_ioc_clone *ioc_clone);
+void foofs_file_free(struct foofs_sb_info *fsbi, struct zus_inode *zi);
+ulong foofs_file_mark_blocks(struct foofs_sb_info *fsbi, struct zus_inode *zi);
+
+#endif /* define __FOOFS_H__ */
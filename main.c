@@ -11,10 +11,12 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <strings.h>
 
 #include "zus.h"
 #include "zusd.h"
@@ -42,14 +44,101 @@ static void usage(void)
 	"	And sets the nice value to NICE_VAL. Default NICE_VAL is 0\n"
 	"	Only one of --policyRR --policyFIFO or --nice should be\n"
 	"	specified, last one catches\n"
+	"--cpus=LIST\n"
+	"	Run threads only on the CPUs in LIST, like 0-3,8,10-11\n"
+	"	Default is all CPUs. The operations of the other CPUs are\n"
+	"	served by one thread each that runs on the CPUs in LIST\n"
+	"--threads=MIN[:MAX]\n"
+	"	MIN threads per CPU always run, more are added up to MAX\n"
+	"	when all of a CPU's threads are busy. Added threads stay\n"
+	"	till exit. Default is 1:1\n"
+	"--trace=[ENTRIES]\n"
+	"	Record every operation in a per thread ring of the last\n"
+	"	ENTRIES operations. Default is 4096\n"
+	"--pmem-huge=[SIZE]\n"
+	"	Map pmem at a SIZE aligned address so the Kernel can use\n"
+	"	huge page entries for it. SIZE is 2M (the default) or 1G\n"
+	"--pmem-prefault\n"
+	"	Fault in all of the pmem at mount, from all threads' CPUs\n"
+	"	in parallel\n"
+	"--reclaim=[DEPTH]\n"
+	"	Up to DEPTH frees of big files per NUMA node are queued\n"
+	"	to a background thread, so the operation returns at once.\n"
+	"	Default is 256. 0 frees inline\n"
+	"--perf\n"
+	"	Count cycles, instructions, cache, branch and remote NUMA\n"
+	"	misses of each operation with the CPU's counters. Needs a\n"
+	"	Kernel with CONFIG_PERF_EVENTS. Operations that ran while\n"
+	"	the counters were multiplexed out are not counted\n"
 	"\n"
 	"FILE_PATH is the path to a mounted ZUS directory\n"
 	"\n"
+	"Send SIGUSR1 to print per operation latency statistics, and the\n"
+	"--perf counts\n"
+	"Send SIGUSR2 to dump the --trace rings to /tmp/zus-trace.PID,\n"
+	"decode them with zustrace\n"
+	"\n"
 	};
 
 	printf(msg);
 }
 
+/* "0-3,8,10-11" => @set */
+static int _parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	char *end;
+
+	CPU_ZERO(set);
+	while (*list) {
+		long first = strtol(list, &end, 10), last;
+
+		if (end == list || first < 0)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			++end;
+		else if (*end)
+			return -EINVAL;
+		list = end;
+	}
+
+	return 0;
+}
+
+/* "MIN[:MAX]" */
+static void _parse_threads(const char *arg, struct thread_param *tp)
+{
+	char *end;
+
+	tp->min_threads = strtoul(arg, &end, 10) ?: 1;
+	tp->max_threads = (*end == ':') ? strtoul(end + 1, NULL, 10) :
+					  tp->min_threads;
+	if (tp->max_threads < tp->min_threads)
+		tp->max_threads = tp->min_threads;
+}
+
+/* "2M" or "1G" => log2 of the size, 0 if neither */
+static uint _parse_huge(const char *arg)
+{
+	if (!arg || !strcasecmp(arg, "2M"))
+		return 21;
+	if (!strcasecmp(arg, "1G"))
+		return 30;
+	return 0;
+}
+
 static void sig_handler(int signo)
 {
 	printf("received sig(%d)\n", signo);
@@ -57,6 +146,54 @@ static void sig_handler(int signo)
 	exit(signo);
 }
 
+/* SIGUSR1 and SIGUSR2 are blocked in all the threads, they inherit it from
+ * main. Only this thread takes them, by sigwait, so the printing and the
+ * trace dump (malloc, stdio and pool locks) never run on top of a thread
+ * that holds them.
+ */
+static void *_sig_thread(void *callback_info)
+{
+	sigset_t *set = callback_info;
+	int signo;
+
+	while (!sigwait(set, &signo)) {
+		switch (signo) {
+		case SIGUSR1:
+			zus_stats_print();
+			break;
+		case SIGUSR2:
+			zus_trace_dump();
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Before any other thread is started */
+static int _sig_thread_start(void)
+{
+	static sigset_t set;
+	pthread_t thread;
+	int err;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (unlikely(err))
+		return err;
+
+	err = pthread_create(&thread, NULL, &_sig_thread, &set);
+	if (unlikely(err))
+		return err;
+
+	pthread_detach(thread);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct option opt[] = {
@@ -65,12 +202,22 @@ int main(int argc, char *argv[])
 		{.name = "nice", .has_arg = 2, .flag = NULL, .val = 'n'} ,
 		{.name = "verbose", .has_arg = 0, .flag = NULL, .val = 'd'} ,
 		{.name = "verify", .has_arg = 0, .flag = NULL, .val = 'v'} ,
+		{.name = "cpus", .has_arg = 1, .flag = NULL, .val = 'c'} ,
+		{.name = "threads", .has_arg = 1, .flag = NULL, .val = 't'} ,
+		{.name = "trace", .has_arg = 2, .flag = NULL, .val = 'T'} ,
+		{.name = "pmem-huge", .has_arg = 2, .flag = NULL, .val = 'H'} ,
+		{.name = "pmem-prefault", .has_arg = 0, .flag = NULL, .val = 'P'} ,
+		{.name = "reclaim", .has_arg = 2, .flag = NULL, .val = 'R'} ,
+		{.name = "perf", .has_arg = 0, .flag = NULL, .val = 'E'} ,
 		{.name = 0, .has_arg = 0, .flag = 0, .val = 0} ,
 	};
 	char op;
 	struct thread_param tp = {
 		.policy = SCHED_FIFO,
 		.rr_priority = 20,
+		.min_threads = 1,
+		.max_threads = 1,
+		.reclaim_max = ZUS_RECLAIM_MAX,
 	};
 	int err;
 
@@ -91,6 +238,34 @@ int main(int argc, char *argv[])
 			if (optarg)
 				tp.rr_priority = atoi(optarg);
 			break;
+		case 'c':
+			if (_parse_cpu_list(optarg, &tp.cpus)) {
+				ERROR("Bad --cpus=%s\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			_parse_threads(optarg, &tp);
+			break;
+		case 'T':
+			tp.trace_ents = optarg ? atoi(optarg) : ZUS_TRACE_ENTS;
+			break;
+		case 'H':
+			tp.pmem_huge_shift = _parse_huge(optarg);
+			if (!tp.pmem_huge_shift) {
+				ERROR("Bad --pmem-huge=%s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'P':
+			tp.pmem_prefault = true;
+			break;
+		case 'R':
+			tp.reclaim_max = optarg ? atoi(optarg) : ZUS_RECLAIM_MAX;
+			break;
+		case 'E':
+			tp.perf = true;
+			break;
 		case 'd':
 			g_DBG = true;
 			break;
@@ -111,6 +286,8 @@ int main(int argc, char *argv[])
 
 	if (signal(SIGINT, sig_handler) == SIG_ERR)
 		ERROR("signal SIGINT not installed\n");
+	if (_sig_thread_start())
+		ERROR("signals SIGUSR1/2 not installed\n");
 
 	tp.path = argv[0];
 	err = zus_mount_thread_start(&tp);
@@ -0,0 +1,60 @@
+/*
+ * nv.h - Persistent copy to pmem
+ *
+ * An FS that writes to pmem through plain stores only has its data in the CPU
+ * caches. These copy with non-temporal stores (which bypass the cache and do
+ * not pollute the LLC) and flush the few partial cache-lines at the edges.
+ * The best instructions of the running CPU (AVX-512/AVX2/SSE2 stores,
+ * CLWB/CLFLUSHOPT/CLFLUSH flushes) are picked once by zus_nv_init().
+ *
+ * The _nt/flush functions do not fence. Many copies of one operation are
+ * ordered with a single pmem_fence() at the end, before the data is reported
+ * to be durable.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+#ifndef __NV_H__
+#define __NV_H__
+
+#include <stddef.h>
+
+/* Select the copy and flush kernels for this CPU. Until called the SSE2 and
+ * CLFLUSH ones are used, which are correct on any x86_64.
+ */
+void zus_nv_init(void);
+
+/* Copy/set @len bytes at pmem @dst. No fence */
+void pmem_memcpy_nt(void *dst, const void *src, size_t len);
+void pmem_memset_nt(void *dst, int c, size_t len);
+
+/* Write back the cache-lines covering [@addr, @addr + @len). No fence */
+void pmem_flush(const void *addr, size_t len);
+
+/* Orders all the above before any store that follows */
+static inline void pmem_fence(void)
+{
+#if defined(__x86_64__)
+	__asm__ __volatile__("sfence" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
+}
+
+static inline void pmem_memcpy_persist(void *dst, const void *src, size_t len)
+{
+	pmem_memcpy_nt(dst, src, len);
+	pmem_fence();
+}
+
+static inline void pmem_persist(const void *addr, size_t len)
+{
+	pmem_flush(addr, len);
+	pmem_fence();
+}
+
+#endif /* define __NV_H__ */
@@ -41,11 +41,13 @@ static int wtz_arm(struct wait_til_zero *wtz, int c)
 	return prev;
 }
 
-/* Release one at a time sorry ;-) */
+/* Release one at a time sorry ;-)
+ * The waiter sees all the stores of the releasers before their release.
+ */
 static int wtz_release(struct wait_til_zero *wtz)
 {
 	int prev = __atomic_fetch_sub(&wtz->acnt, 1,
-						__ATOMIC_RELAXED);
+						__ATOMIC_ACQ_REL);
 	if (prev == 1)
 		sem_post(&wtz->sem);
 
@@ -0,0 +1,530 @@
+/*
+ * zus-bench.c - in-process micro-benchmark of zus_do_command
+ *
+ * usage: zus-bench [-f fsname] [-b blocks] [-n ops] [-t max_threads]
+ *
+ * Mounts the FS over DRAM (zus_mount_dram) and drives zus_do_command with
+ * synthetic zufs_ioc_* headers, no ZUF and no Kernel. Each op is run from
+ * 1, 2, 4 ... max_threads threads, each pinned to its own CPU and working
+ * in its own directory. Prints the ns per op of a thread at each thread
+ * count, and the scaling of the total ops/sec over the single thread run.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "zusd.h"
+#include "nv.h"
+#include "b-minmax.h"
+
+bool g_DBG = false;
+bool g_verify = false;
+
+#define BENCH_FILES	1000	/* Looked up, per thread */
+#define BENCH_DATA	256	/* Blocks of the data file, per thread */
+#define BENCH_BUFF	PAGE_SIZE
+#define BENCH_SMALL	256	/* Bytes of the small file, per thread */
+#define BENCH_MAX_T	64
+
+struct _bthread {
+	struct zus_inode_info *dir;
+	struct zus_inode_info *data;
+	struct zus_inode_info *small;
+	struct zus_inode_info **ziis;	/* Of the NEW_INODE row */
+	char *buff;
+	ulong seed;
+	uint no;
+	int err;
+};
+
+struct _bench {
+	struct zus_inode_info *root;
+	struct _bthread *bts;
+	ulong n;
+	uint ncpus;
+	pthread_barrier_t start;
+	const struct _brow *row;
+};
+
+struct _brow {
+	const char *name;
+	void (*run)(struct _bthread *bt, ulong n);
+};
+
+static ulong _rand(struct _bthread *bt)
+{
+	bt->seed ^= bt->seed << 13;
+	bt->seed ^= bt->seed >> 7;
+	bt->seed ^= bt->seed << 17;
+	return bt->seed;
+}
+
+static void _set_str(struct zufs_str *str, const char *fmt, ulong i)
+{
+	char name[ZUFS_NAME_LEN + 1];
+
+	str->len = snprintf(name, sizeof(name), fmt, i);
+	memcpy(str->name, name, str->len);
+}
+
+static void _do(struct _bthread *bt, void *app_ptr, struct zufs_ioc_hdr *hdr,
+		uint op)
+{
+	int err;
+
+	hdr->operation = op;
+	hdr->err = 0;
+	err = zus_do_command(app_ptr, hdr);
+	if (unlikely(err && !bt->err)) {
+		ERROR("[%u] %s => %d\n", bt->no, zus_op_name(op), err);
+		bt->err = err;
+	}
+}
+
+static struct zus_inode_info *_create(struct _bthread *bt,
+				      struct zus_inode_info *dir,
+				      const char *fmt, ulong i, int mode)
+{
+	struct zufs_ioc_new_inode ioc_new = {};
+
+	ioc_new.zi.i_mode = mode;
+	ioc_new.dir_ii = dir;
+	_set_str(&ioc_new.str, fmt, i);
+	_do(bt, NULL, &ioc_new.hdr, ZUS_OP_NEW_INODE);
+	return ioc_new.zus_ii;
+}
+
+/* ~~~~ the rows, each runs @n ops of one kind ~~~~ */
+
+static void _b_statfs(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_statfs ioc_statfs = {};
+	ulong i;
+
+	ioc_statfs.zus_sbi = bt->dir->sbi;
+	for (i = 0; i < n; ++i)
+		_do(bt, NULL, &ioc_statfs.hdr, ZUS_OP_STATFS);
+}
+
+/* A hot lookup and the Kernel's evict of the extra reference */
+static void _b_lookup(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_lookup lookup = {};
+	struct zufs_ioc_evict_inode ziei = {};
+	ulong i;
+
+	lookup.dir_ii = bt->dir;
+	for (i = 0; i < n; ++i) {
+		_set_str(&lookup.str, "f%lu", _rand(bt) % BENCH_FILES);
+		_do(bt, NULL, &lookup.hdr, ZUS_OP_LOOKUP);
+
+		ziei.zus_ii = lookup.zus_ii;
+		if (likely(ziei.zus_ii))
+			_do(bt, NULL, &ziei.hdr, ZUS_OP_EVICT_INODE);
+	}
+}
+
+static void _b_new_inode(struct _bthread *bt, ulong n)
+{
+	ulong i;
+
+	for (i = 0; i < n; ++i)
+		bt->ziis[i] = _create(bt, bt->dir, "n%lu", i, S_IFREG | 0644);
+}
+
+static void _b_remove_dentry(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_dentry zid = {};
+	ulong i;
+
+	zid.zus_dir_ii = bt->dir;
+	for (i = 0; i < n; ++i) {
+		zid.zus_ii = bt->ziis[i];
+		_set_str(&zid.str, "n%lu", i);
+		_do(bt, NULL, &zid.hdr, ZUS_OP_REMOVE_DENTRY);
+	}
+}
+
+static void _b_free_inode(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_evict_inode ziei = {};
+	ulong i;
+
+	for (i = 0; i < n; ++i) {
+		ziei.zus_ii = bt->ziis[i];
+		if (likely(ziei.zus_ii))
+			_do(bt, NULL, &ziei.hdr, ZUS_OP_FREE_INODE);
+		bt->ziis[i] = NULL;
+	}
+}
+
+static void _b_io(struct _bthread *bt, ulong n, uint op)
+{
+	struct zufs_ioc_IO io = {};
+	ulong i;
+
+	io.zus_ii = bt->data;
+	for (i = 0; i < n; ++i) {
+		io.hdr.len = BENCH_BUFF;
+		io.filepos = (_rand(bt) % BENCH_DATA) * BENCH_BUFF;
+		_do(bt, bt->buff, &io.hdr, op);
+	}
+}
+
+static void _b_write(struct _bthread *bt, ulong n)
+{
+	_b_io(bt, n, ZUS_OP_WRITE);
+}
+
+static void _b_read(struct _bthread *bt, ulong n)
+{
+	_b_io(bt, n, ZUS_OP_READ);
+}
+
+static void _b_small_io(struct _bthread *bt, ulong n, uint op)
+{
+	struct zufs_ioc_IO io = {};
+	ulong i;
+
+	io.zus_ii = bt->small;
+	for (i = 0; i < n; ++i) {
+		io.hdr.len = BENCH_SMALL;
+		io.filepos = 0;
+		_do(bt, bt->buff, &io.hdr, op);
+	}
+}
+
+static void _b_write_small(struct _bthread *bt, ulong n)
+{
+	_b_small_io(bt, n, ZUS_OP_WRITE);
+}
+
+static void _b_read_small(struct _bthread *bt, ulong n)
+{
+	_b_small_io(bt, n, ZUS_OP_READ);
+}
+
+static void _b_get_block(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_get_block get_block = {};
+	ulong i;
+
+	get_block.zus_ii = bt->data;
+	for (i = 0; i < n; ++i) {
+		get_block.index = _rand(bt) % BENCH_DATA;
+		get_block.rw = 0;
+		_do(bt, NULL, &get_block.hdr, ZUS_OP_GET_BLOCK);
+	}
+}
+
+static void _b_setattr(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_attr ioc_attr = {};
+	ulong i;
+
+	ioc_attr.zus_ii = bt->data;
+	for (i = 0; i < n; ++i)
+		_do(bt, NULL, &ioc_attr.hdr, ZUS_OP_SETATTR);
+}
+
+/* One buffer full from the start of the directory */
+static void _b_readdir(struct _bthread *bt, ulong n)
+{
+	struct zufs_ioc_readdir zir = {};
+	ulong i;
+
+	zir.dir_ii = bt->dir;
+	for (i = 0; i < n; ++i) {
+		zir.hdr.len = BENCH_BUFF;
+		zir.pos = 0;
+		_do(bt, bt->buff, &zir.hdr, ZUS_OP_READDIR);
+	}
+}
+
+/* In this order, REMOVE_DENTRY and FREE_INODE work on the NEW_INODE files */
+static const struct _brow g_rows[] = {
+	{ "STATFS",		_b_statfs },
+	{ "LOOKUP+EVICT",	_b_lookup },
+	{ "NEW_INODE",		_b_new_inode },
+	{ "REMOVE_DENTRY",	_b_remove_dentry },
+	{ "FREE_INODE",		_b_free_inode },
+	{ "WRITE 4K",		_b_write },
+	{ "READ 4K",		_b_read },
+	{ "WRITE 256 SMALL",	_b_write_small },
+	{ "READ 256 SMALL",	_b_read_small },
+	{ "GET_BLOCK",		_b_get_block },
+	{ "SETATTR",		_b_setattr },
+	{ "READDIR 4K",		_b_readdir },
+};
+
+#define BENCH_ROWS	(sizeof(g_rows) / sizeof(g_rows[0]))
+
+/* ~~~~ threads ~~~~ */
+
+static ulong _now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+struct _bthread_arg {
+	struct _bench *b;
+	struct _bthread *bt;
+	ulong start, end;
+};
+
+/* Timed by each thread, the main thread may not run in between */
+static void *_row_thread(void *arg)
+{
+	struct _bthread_arg *ba = arg;
+
+	/* A slot of its own, else all share slot 0's journal and counters */
+	zus_set_ztno(ba->bt->no);
+	pthread_barrier_wait(&ba->b->start);
+	ba->start = _now_ns();
+	ba->b->row->run(ba->bt, ba->b->n);
+	ba->end = _now_ns();
+	return NULL;
+}
+
+/* Wall time of @row from @nthreads threads in parallel */
+static ulong _run_row(struct _bench *b, const struct _brow *row,
+		      uint nthreads)
+{
+	struct _bthread_arg *bas = calloc(nthreads, sizeof(*bas));
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	ulong start = ~0UL, end = 0;
+	uint i;
+
+	if (unlikely(!bas || !threads)) {
+		ERROR("no memory for %u threads\n", nthreads);
+		goto out;
+	}
+
+	b->row = row;
+	pthread_barrier_init(&b->start, NULL, nthreads);
+
+	for (i = 0; i < nthreads; ++i) {
+		pthread_attr_t attr;
+		cpu_set_t affinity;
+		int err;
+
+		bas[i].b = b;
+		bas[i].bt = &b->bts[i];
+
+		CPU_ZERO(&affinity);
+		CPU_SET(i % b->ncpus, &affinity);
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(affinity), &affinity);
+		err = pthread_create(&threads[i], &attr, _row_thread, &bas[i]);
+		pthread_attr_destroy(&attr);
+		if (unlikely(err)) {
+			ERROR("pthread_create => %d: %s\n", err, strerror(err));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+		start = min_t(ulong, start, bas[i].start);
+		end = max_t(ulong, end, bas[i].end);
+	}
+	pthread_barrier_destroy(&b->start);
+out:
+	free(threads);
+	free(bas);
+	return end > start ? end - start : 0;
+}
+
+/* The working set of each thread: a dir of BENCH_FILES, a data file and a
+ * small file
+ */
+static int _setup(struct _bench *b, uint max_threads)
+{
+	uint t;
+	ulong i;
+
+	b->bts = calloc(max_threads, sizeof(*b->bts));
+	if (unlikely(!b->bts))
+		return -ENOMEM;
+
+	for (t = 0; t < max_threads; ++t) {
+		struct _bthread *bt = &b->bts[t];
+		struct zufs_ioc_IO io = {};
+
+		bt->no = t;
+		bt->seed = 0x2545f4914f6cdd1dUL * (t + 1);
+		bt->ziis = calloc(b->n, sizeof(*bt->ziis));
+		bt->buff = aligned_alloc(PAGE_SIZE, BENCH_BUFF);
+		if (unlikely(!bt->ziis || !bt->buff))
+			return -ENOMEM;
+		memset(bt->buff, 0xa5, BENCH_BUFF);
+
+		bt->dir = _create(bt, b->root, "t%lu", t, S_IFDIR | 0755);
+		if (unlikely(!bt->dir))
+			return bt->err ?: -EIO;
+		for (i = 0; i < BENCH_FILES; ++i)
+			_create(bt, bt->dir, "f%lu", i, S_IFREG | 0644);
+
+		bt->data = _create(bt, bt->dir, "data", 0, S_IFREG | 0644);
+		if (unlikely(!bt->data))
+			return bt->err ?: -EIO;
+		io.zus_ii = bt->data;
+		for (i = 0; i < BENCH_DATA; ++i) {
+			io.hdr.len = BENCH_BUFF;
+			io.filepos = i * BENCH_BUFF;
+			_do(bt, bt->buff, &io.hdr, ZUS_OP_WRITE);
+		}
+
+		bt->small = _create(bt, bt->dir, "small", 0, S_IFREG | 0644);
+		if (unlikely(!bt->small))
+			return bt->err ?: -EIO;
+		io.zus_ii = bt->small;
+		io.hdr.len = BENCH_SMALL;
+		io.filepos = 0;
+		_do(bt, bt->buff, &io.hdr, ZUS_OP_WRITE);
+		if (unlikely(bt->err))
+			return bt->err;
+	}
+
+	return 0;
+}
+
+static void _teardown(struct _bench *b, uint max_threads)
+{
+	uint t;
+
+	for (t = 0; b->bts && t < max_threads; ++t) {
+		free(b->bts[t].ziis);
+		free(b->bts[t].buff);
+	}
+	free(b->bts);
+}
+
+static void usage(void)
+{
+	printf("usage: zus-bench [-f fsname] [-b blocks] [-n ops] "
+	       "[-t max_threads]\n");
+	printf("	-f fsname	registered FS to mount (foof)\n");
+	printf("	-b blocks	DRAM pmem size in 4K blocks (262144)\n");
+	printf("	-n ops		ops per thread per row (10000)\n");
+	printf("	-t max_threads	threads go 1, 2, 4 ... (online CPUs)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct zufs_ioc_mount zim = {};
+	const char *fsname = "foof";
+	ulong blocks = 1UL << 18;
+	uint tcounts[8], ntcounts = 0;
+	uint max_threads, t, r;
+	struct _bench b = {};
+	double ns[BENCH_ROWS][8];
+	long ncpus;
+	int opt, err;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	b.ncpus = ncpus > 0 ? ncpus : 1;
+	max_threads = b.ncpus;
+	b.n = 10000;
+
+	while ((opt = getopt(argc, argv, "f:b:n:t:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			fsname = optarg;
+			break;
+		case 'b':
+			blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.n = strtoul(optarg, NULL, 0) ?: 1;
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0) ?: 1;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (max_threads > BENCH_MAX_T)
+		max_threads = BENCH_MAX_T;
+
+	for (t = 1; t < max_threads && ntcounts < 7; t *= 2)
+		tcounts[ntcounts++] = t;
+	tcounts[ntcounts++] = max_threads;
+
+	zus_nv_init();
+	err = zus_register_all(-1);
+	zim.zus_zfi = zus_find_fs(fsname);
+	if (unlikely(err || !zim.zus_zfi)) {
+		ERROR("no FS %s => %d\n", fsname, err);
+		return 1;
+	}
+
+	err = zus_mount_dram(&zim, blocks);
+	if (unlikely(err)) {
+		ERROR("zus_mount_dram(%lu) => %d\n", blocks, err);
+		return 1;
+	}
+	b.root = zim.zus_ii;
+
+	err = _setup(&b, max_threads);
+	if (unlikely(err)) {
+		ERROR("setup => %d\n", err);
+		goto out;
+	}
+
+	printf("# zus-bench %s blocks=%lu ops=%lu cpus=%u\n", fsname, blocks,
+	       b.n, b.ncpus);
+	printf("# %-16s", "op  ns/op@threads");
+	for (t = 0; t < ntcounts; ++t)
+		printf(" %8u", tcounts[t]);
+	printf("   scaling");
+	for (t = 1; t < ntcounts; ++t)
+		printf(" %6u", tcounts[t]);
+	printf("\n");
+
+	/* Rows in order for each thread count, NEW_INODE .. FREE_INODE go
+	 * together
+	 */
+	for (t = 0; t < ntcounts; ++t)
+		for (r = 0; r < BENCH_ROWS; ++r) {
+			ulong wall = _run_row(&b, &g_rows[r], tcounts[t]);
+
+			ns[r][t] = (double)wall / b.n;
+		}
+
+	for (r = 0; r < BENCH_ROWS; ++r) {
+		printf("%-18s", g_rows[r].name);
+		for (t = 0; t < ntcounts; ++t)
+			printf(" %8.0f", ns[r][t]);
+		printf("          ");
+		for (t = 1; t < ntcounts; ++t)
+			printf(" %5.2fx", ns[r][0] * tcounts[t] / ns[r][t]);
+		printf("\n");
+	}
+
+	for (t = 0; t < max_threads; ++t)
+		if (b.bts[t].err)
+			err = b.bts[t].err;
+out:
+	zus_umount(-1, &zim);
+	_teardown(&b, max_threads);
+	return err ? 1 : 0;
+}
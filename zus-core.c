@@ -11,15 +11,22 @@
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <asm-generic/mman.h>
+#include <linux/perf_event.h>
 
 #include "zus.h"
 #include "zusd.h"
 #include "zuf_call.h"
 #include "wtz.h"
+#include "nv.h"
+#include "b-minmax.h"
 
 const char* g_zus_root_path;
 
@@ -46,30 +53,158 @@ void zuf_root_close(int *fd)
 	}
 }
 
+/* ~~~~ zu_threads pool ~~~~ */
+
+/* Each allowed CPU has between tp->min_threads and tp->max_threads zu_threads
+ * pinned to it. The manager thread adds one when all the threads of a CPU
+ * are busy inside an operation. The Kernel has no way to release one
+ * waiting thread, so an added thread stays till zus stops.
+ *
+ * The Kernel queues an operation to the threads of the CPU that issued it,
+ * so a CPU left out of tp->cpus still gets one thread of its own. It
+ * registers for that CPU but runs on the allowed CPUs.
+ */
+
+/* Own cache line, @busy is written on every operation by the CPU's threads.
+ * Allocated on the CPU's node, followed by the slots of its threads.
+ */
+struct _zu_cpu {
+	struct fba mem;		/* Of the _zu_cpu and its @zts */
+	struct _zu_thread *zts;	/* @max slots, g_zts[first_no + k] */
+	int cpu;
+	uint first_no;
+	uint min, max;		/* max is lowered if the Kernel refuses more */
+	bool routed;		/* Not in tp->cpus, runs on the allowed ones */
+	int nthreads;		/* Started. Written only by the manager */
+	int busy;		/* Threads inside an operation */
+	bool want_grow;
+} __attribute__((aligned(ZUS_CACHELINE_SIZE)));
+
+/* Single writer (the owner zu_thread). An entry is published by advancing
+ * @head, a reader copies the ring and then drops what @head overran.
+ */
+struct zus_trace_ring {
+	ulong head;		/* Entries ever written */
+	ulong mask;
+	struct zus_trace_ent ents[];
+};
+
+/* zu_thread.ctl bits, set at stop */
+#define ZT_CTL_STOP	0x1
+
+/* The --perf counters of one zu_thread */
+struct _zu_perf {
+	bool on;			/* The group is open */
+	int fd[ZUS_PERF_MAX];		/* -1 if the CPU has no such event */
+	struct perf_event_mmap_page *pc[ZUS_PERF_MAX]; /* For rdpmc */
+};
+
+/* One reading of a _zu_perf. @stopped (time enabled - time running) only
+ * grows while the group is multiplexed off the PMU.
+ */
+struct _zu_perf_vals {
+	ulong stopped;
+	ulong v[ZUS_PERF_MAX];
+};
+
+/* Cache line aligned, so a thread's slot never shares a line with its
+ * neighbour's. The slot (after its _zu_cpu) and its stats, wait and trace
+ * buffers, which an operation writes, are all on the thread's node.
+ */
 struct _zu_thread {
+	/* Set before the thread starts or once at its init */
 	pthread_t thread;
 	int no;
 	int err;
 	int fd;
+	int numa;
+	struct _zu_cpu *zc;
+	struct wait_til_zero *wtz; /* Released when init is done */
+	bool running;		/* Init was successful */
+	bool exited;
 	void *api_mem;
-	volatile bool stop;
-};
+	struct fba wait_op;	/* zufs_ioc_wait_operation on the thread's node */
+	/* Kept for the slot's next threads, they run on the same CPU */
+	struct fba stats_mem;	/* struct zus_stats */
+	struct zus_stats *stats; /* NULL till the first init */
+	struct zus_trace_ring *trace;
+	struct _zu_perf perf;	/* Open by the running thread */
+
+	/* Written by others, read by the thread */
+	uint ctl  __attribute__((aligned(ZUS_CACHELINE_SIZE)));
+} __attribute__((aligned(ZUS_CACHELINE_SIZE)));
+
+static inline void _zt_signal(struct _zu_thread *zt, uint bit)
+{
+	__atomic_fetch_or(&zt->ctl, bit, __ATOMIC_RELEASE);
+}
+
+static inline bool _zt_ctl(struct _zu_thread *zt, uint bit)
+{
+	return __atomic_load_n(&zt->ctl, __ATOMIC_ACQUIRE) & bit;
+}
 
 /* TODO: Put all these g_xx(s) on a zus object and point to it from
  * _zu_thread. Then be Boaz Happy
  */
-static struct _zu_thread *g_zts = NULL;
-static int g_num_gts = 0;
+static struct _zu_thread **g_zts = NULL; /* NULL for an unused slot */
+static uint g_max_zts = 0;	/* g_zts slots */
+static struct _zu_cpu **g_zcs = NULL;
+static uint g_num_zcs = 0;
+static uint g_num_cpus = 0;	/* The pinned g_zcs, routed ones follow */
+static struct thread_param *g_tp;
 static struct wait_til_zero g_wtz;
-static pthread_key_t g_zts_id_key;
-static struct fba g_wait_structs;
+/* The stats and trace readers (the sigwait thread) against the free of
+ * g_zts at the last stop
+ */
+static pthread_mutex_t g_zts_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The calling zu_thread, or the slot zus_set_ztno() gave a tool's thread */
+static __thread struct _zu_thread *tls_zt;
+static __thread int tls_ztno = -1;
+
+static struct _zu_manager {
+	pthread_t thread;
+	sem_t sem;		/* Kicked for grow and exit */
+	volatile bool stop;
+} g_mgr;
 
 int zus_getztno(void)
 {
-	struct _zu_thread *zt;
+	struct _zu_thread *zt = tls_zt;
+
+	return likely(zt && !zt->err) ? zt->no : tls_ztno;
+}
+
+void zus_set_ztno(int no)
+{
+	tls_ztno = (no >= 0 && (uint)no < zus_max_ztno()) ? no : -1;
+}
+
+uint zus_max_ztno(void)
+{
+	long ncpu;
 
-	zt = (struct _zu_thread *)pthread_getspecific(g_zts_id_key);
-	return likely(zt && !zt->err) ? zt->no : -1;
+	if (g_max_zts)
+		return g_max_zts;
+
+	ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	return ncpu > 0 ? ncpu : 1;
+}
+
+static int _cur_numa(void)
+{
+	uint cpu, node;
+
+	if (unlikely(syscall(SYS_getcpu, &cpu, &node, NULL)))
+		return 0;
+	return node;
+}
+
+int zus_getnuma(void)
+{
+	struct _zu_thread *zt = tls_zt;
+
+	return likely(zt && !zt->err) ? zt->numa : _cur_numa();
 }
 
 typedef unsigned int uint;
@@ -88,12 +223,329 @@ static int _zu_mmap(struct _zu_thread *zt)
 	return 0;
 }
 
+/* ~~~~ per operation statistics ~~~~ */
+
+static inline ulong _now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+/* Single writer (the owner zu_thread). The relaxed stores are plain movs
+ * they are only here so a concurrent snapshot never sees torn values.
+ */
+#define _stats_add(p, v) \
+	__atomic_store_n((p), *(p) + (v), __ATOMIC_RELAXED)
+
+static inline void _stats_record(struct zus_stats *zs, uint operation,
+				 ulong ns, int err)
+{
+	struct zus_op_stats *zos;
+
+	if (unlikely(ZUS_STATS_MAX_OP <= operation))
+		return;
+
+	zos = &zs->ops[operation];
+	_stats_add(&zos->count, 1);
+	_stats_add(&zos->total_ns, ns);
+	_stats_add(&zos->hist[zus_stats_bucket(ns)], 1);
+	if (unlikely(err))
+		_stats_add(&zos->errors, 1);
+	if (unlikely(zos->max_ns < ns))
+		__atomic_store_n(&zos->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+/* ~~~~ hardware performance counters ~~~~ */
+
+static const struct {
+	const char *name;
+	__u32 type;
+	__u64 config;
+} g_perf_events[ZUS_PERF_MAX] = {
+	[ZUS_PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE,
+			      PERF_COUNT_HW_CPU_CYCLES },
+	[ZUS_PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_INSTRUCTIONS },
+	[ZUS_PERF_LLC_MISSES] = { "llc-misses", PERF_TYPE_HARDWARE,
+				  PERF_COUNT_HW_CACHE_MISSES },
+	[ZUS_PERF_BRANCH_MISSES] = { "branch-misses", PERF_TYPE_HARDWARE,
+				     PERF_COUNT_HW_BRANCH_MISSES },
+	[ZUS_PERF_NODE_MISSES] = { "node-misses", PERF_TYPE_HW_CACHE,
+				   PERF_COUNT_HW_CACHE_NODE |
+				   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+static void _perf_close(struct _zu_thread *zt)
+{
+	struct _zu_perf *zp = &zt->perf;
+	uint i;
+
+	if (!zp->on)
+		return;
+
+	/* Members first, the leader is ZUS_PERF_CYCLES */
+	for (i = ZUS_PERF_MAX; i-- > 0;) {
+		if (zp->pc[i])
+			munmap(zp->pc[i], PAGE_SIZE);
+		if (zp->fd[i] >= 0)
+			close(zp->fd[i]);
+		zp->pc[i] = NULL;
+		zp->fd[i] = -1;
+	}
+	zp->on = false;
+}
+
+/* Counters of the calling thread, in one group led by cycles so they are
+ * all on the PMU, or all off it, together. User mode only, so it works at
+ * the default perf_event_paranoid, the FS code runs there anyway. Each is
+ * also mapped so _perf_snap() can use rdpmc and no system call.
+ */
+static void _perf_open(struct _zu_thread *zt)
+{
+	static bool warned;
+	struct _zu_perf *zp = &zt->perf;
+	int leader;
+	uint i;
+
+	zp->on = false;
+	for (i = 0; i < ZUS_PERF_MAX; ++i) {
+		zp->fd[i] = -1;
+		zp->pc[i] = NULL;
+	}
+
+	for (i = 0; i < ZUS_PERF_MAX; ++i) {
+		struct perf_event_attr attr = {
+			.type = g_perf_events[i].type,
+			.size = sizeof(attr),
+			.config = g_perf_events[i].config,
+			.read_format = PERF_FORMAT_GROUP |
+				       PERF_FORMAT_TOTAL_TIME_ENABLED |
+				       PERF_FORMAT_TOTAL_TIME_RUNNING,
+			/* The group starts when all of it is open */
+			.disabled = i == ZUS_PERF_CYCLES,
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+		};
+		void *pc;
+
+		leader = i == ZUS_PERF_CYCLES ? -1 : zp->fd[ZUS_PERF_CYCLES];
+		zp->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, leader,
+				    0);
+		if (zp->fd[i] < 0) {
+			DBG("[%d] no %s counter => %d\n", zt->no,
+			    g_perf_events[i].name, -errno);
+			if (i == ZUS_PERF_CYCLES)
+				break;
+			continue;
+		}
+
+		pc = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, zp->fd[i], 0);
+		if (pc != MAP_FAILED)
+			zp->pc[i] = pc;
+	}
+
+	if (zp->fd[ZUS_PERF_CYCLES] >= 0) {
+		zp->on = true;
+		if (ioctl(zp->fd[ZUS_PERF_CYCLES], PERF_EVENT_IOC_ENABLE,
+			  PERF_IOC_FLAG_GROUP))
+			_perf_close(zt);
+	}
+
+	if (!zp->on && !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+		ERROR("[%d] no perf counters => %d\n", zt->no, -errno);
+}
+
+#if defined(__x86_64__)
+static inline ulong _rdpmc(uint counter)
+{
+	uint lo, hi;
+
+	__asm__ __volatile__("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+	return lo | ((ulong)hi << 32);
+}
+
+/* False when the counter is not on the PMU right now. @stopped if not
+ * NULL is the time the event was enabled but not counting.
+ */
+static bool _perf_rdpmc(struct perf_event_mmap_page *pc, ulong *count,
+			ulong *stopped)
+{
+	uint seq, idx;
+	ulong pmc;
+
+	do {
+		seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+		idx = pc->index;
+		*count = pc->offset;
+		if (idx) {
+			pmc = _rdpmc(idx - 1) << (64 - pc->pmc_width);
+			*count += (long)pmc >> (64 - pc->pmc_width);
+		}
+		if (stopped)
+			*stopped = pc->time_enabled - pc->time_running;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq);
+
+	return idx != 0;
+}
+
+/* The whole group by rdpmc. False if any counter is not on the PMU */
+static bool _perf_snap_rdpmc(struct _zu_perf *zp, struct _zu_perf_vals *pv)
+{
+	uint i;
+
+	for (i = 0; i < ZUS_PERF_MAX; ++i) {
+		struct perf_event_mmap_page *pc = zp->pc[i];
+
+		pv->v[i] = 0;
+		if (zp->fd[i] < 0)
+			continue;
+		if (!pc || !pc->cap_user_rdpmc ||
+		    !_perf_rdpmc(pc, &pv->v[i],
+				 i == ZUS_PERF_CYCLES ? &pv->stopped : NULL))
+			return false;
+	}
+	return true;
+}
+#endif /* __x86_64__ */
+
+static void _perf_snap(struct _zu_perf *zp, struct _zu_perf_vals *pv)
+{
+	struct {
+		__u64 nr;
+		__u64 time_enabled;
+		__u64 time_running;
+		__u64 values[ZUS_PERF_MAX];
+	} rf;
+	ssize_t len;
+	uint i, j;
+
+#if defined(__x86_64__)
+	if (_perf_snap_rdpmc(zp, pv))
+		return;
+#endif
+	memset(pv, 0, sizeof(*pv));
+	len = read(zp->fd[ZUS_PERF_CYCLES], &rf, sizeof(rf));
+	if (unlikely(len < (ssize_t)offsetof(typeof(rf), values))) {
+		/* Never equal to a good reading, the sample is dropped */
+		pv->stopped = ~0UL;
+		return;
+	}
+
+	/* In the order they joined the group */
+	pv->stopped = rf.time_enabled - rf.time_running;
+	for (i = j = 0; i < ZUS_PERF_MAX && j < rf.nr; ++i)
+		if (zp->fd[i] >= 0)
+			pv->v[i] = rf.values[j++];
+}
+
+/* Add what was counted since @before to @operation's totals. When the
+ * group was multiplexed off the PMU for part of the operation the counts
+ * are short, and the operation is not counted at all.
+ */
+static void _perf_record(struct zus_stats *zs, uint operation,
+			 struct _zu_perf *zp, struct _zu_perf_vals *before)
+{
+	struct zus_op_stats *zos;
+	struct _zu_perf_vals after;
+	uint i;
+
+	if (unlikely(ZUS_STATS_MAX_OP <= operation))
+		return;
+
+	_perf_snap(zp, &after);
+	if (unlikely(after.stopped != before->stopped))
+		return;
+
+	zos = &zs->ops[operation];
+	_stats_add(&zos->perf_count, 1);
+	for (i = 0; i < ZUS_PERF_MAX; ++i)
+		_stats_add(&zos->perf[i], after.v[i] - before->v[i]);
+}
+
+/* ~~~~ binary operation trace ~~~~ */
+
+__thread struct zus_trace_ent *zus_trace_cur;
+
+/* @ents is rounded up to a power of 2 */
+static struct zus_trace_ring *_trace_ring_alloc(ulong ents)
+{
+	struct zus_trace_ring *ztr;
+	size_t size;
+
+	if (ents & (ents - 1))
+		ents = 1UL << (64 - __builtin_clzl(ents));
+	size = sizeof(*ztr) + ents * sizeof(ztr->ents[0]);
+
+	/* Touched first by its thread, so it is on the thread's node */
+	ztr = aligned_alloc(ZUS_CACHELINE_SIZE, ALIGN(size, ZUS_CACHELINE_SIZE));
+	if (unlikely(!ztr))
+		return NULL;
+	memset(ztr, 0, size);
+	ztr->mask = ents - 1;
+	return ztr;
+}
+
+/* When all the threads of a CPU are inside an operation, new operations on
+ * it must queue in the Kernel. Ask the manager for another thread.
+ */
+static void _busy_begin(struct _zu_thread *zt)
+{
+	struct _zu_cpu *zc = zt->zc;
+	int busy = __atomic_add_fetch(&zc->busy, 1, __ATOMIC_RELAXED);
+	int nthreads = __atomic_load_n(&zc->nthreads, __ATOMIC_RELAXED);
+
+	if (unlikely(busy >= nthreads && (uint)nthreads < zc->max &&
+		     !__atomic_load_n(&zc->want_grow, __ATOMIC_RELAXED))) {
+		__atomic_store_n(&zc->want_grow, true, __ATOMIC_RELAXED);
+		sem_post(&g_mgr.sem);
+	}
+}
+
 static
 int _do_op(struct _zu_thread *zt, struct zufs_ioc_wait_operation *op)
 {
 	void *app_ptr = zt->api_mem + op->hdr.offset;
+	struct zus_trace_ring *ztr = zt->trace;
+	struct zus_trace_ent *zte = NULL;
+	struct _zu_perf_vals perf;
+	ulong start = _now_ns();
+	ulong end;
+	int err;
 
-	return zus_do_command(app_ptr, &op->hdr);
+	if (zt->perf.on)
+		_perf_snap(&zt->perf, &perf);
+
+	if (ztr) {
+		zte = &ztr->ents[ztr->head & ztr->mask];
+		zte->ino = zte->off = zte->len = 0;
+		zus_trace_cur = zte;
+	}
+
+	_busy_begin(zt);
+	err = zus_do_command(app_ptr, &op->hdr);
+	end = _now_ns();
+	__atomic_sub_fetch(&zt->zc->busy, 1, __ATOMIC_RELAXED);
+
+	if (likely(zt->stats)) {
+		_stats_record(zt->stats, op->hdr.operation, end - start, err);
+		if (zt->perf.on)
+			_perf_record(zt->stats, op->hdr.operation, &zt->perf,
+				     &perf);
+	}
+
+	if (zte) {
+		zte->start_ns = start;
+		zte->dur_ns = min_t(ulong, end - start, ~0U);
+		zte->op = op->hdr.operation;
+		zte->err = (err > 0) ? -err : err;
+		zus_trace_cur = NULL;
+		__atomic_store_n(&ztr->head, ztr->head + 1, __ATOMIC_RELEASE);
+	}
+	return err;
 }
 
 /*
@@ -105,32 +557,72 @@ static __s32 _errno_UtoK(__s32 err)
 	return (err < 0) ? err : -err;
 }
 
+static int _zt_init(struct _zu_thread *zt)
+{
+	int nice = g_tp->rr_priority;
+
+	if (g_tp->policy == SCHED_OTHER && nice &&
+	    setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice))
+		ERROR("[%d] setpriority(%d) => %d\n", zt->no, nice, errno);
+
+	return zuf_zt_init(zt->fd, zt->zc->cpu);
+}
+
+static void _zt_init_done(struct _zu_thread *zt)
+{
+	if (zt->wtz)
+		wtz_release(zt->wtz);
+}
+
 static void *zu_thread(void *callback_info)
 {
 	struct _zu_thread *zt = callback_info;
-	struct zufs_ioc_wait_operation *op =
-				g_wait_structs.ptr + zt->no * sizeof(*op);
+	struct zufs_ioc_wait_operation *op;
+
+	/* We are already pinned to our CPU */
+	zt->numa = _cur_numa();
+	if (!zt->stats) {
+		if (unlikely(fba_alloc_node(&zt->stats_mem, sizeof(*zt->stats),
+					    zt->numa)))
+			ERROR("[%d] no memory for stats\n", zt->no);
+		else
+			__atomic_store_n(&zt->stats, zt->stats_mem.ptr,
+					 __ATOMIC_RELEASE);
+	}
+	if (g_tp->trace_ents && !zt->trace) {
+		zt->trace = _trace_ring_alloc(g_tp->trace_ents);
+		if (unlikely(!zt->trace))
+			ERROR("[%d] no memory for a trace ring\n", zt->no);
+	}
+	zt->err = fba_alloc_node(&zt->wait_op, sizeof(*op), zt->numa);
+	if (zt->err)
+		goto init_fail;
+	op = zt->wait_op.ptr;
 
 	zt->err = zuf_root_open_tmp(&zt->fd);
 	if (zt->err)
-		return NULL;
+		goto fail_free;
 
-	zt->err = zuf_zt_init(zt->fd, zt->no);
+	zt->err = _zt_init(zt);
 	if (zt->err)
-		return NULL; /* leak the file it is fine */
+		goto fail_close;
 
 	zt->err = _zu_mmap(zt);
 	if (zt->err)
-		return NULL; /* leak the file it is fine */
+		goto fail_close;
+
+	INFO("[%d] thread Init cpu=%d fd=%d api_mem=%p numa=%d\n",
+	     zt->no, zt->zc->cpu, zt->fd, zt->api_mem, zt->numa);
 
-	INFO("[%d] thread Init fd=%d api_mem=%p\n",
-	     zt->no, zt->fd, zt->api_mem);
+	if (g_tp->perf)
+		_perf_open(zt);
 
-	wtz_release(&g_wtz);
+	zt->running = true;
+	_zt_init_done(zt);
 
-	pthread_setspecific(g_zts_id_key, zt);
+	tls_zt = zt;
 
-	while(!zt->stop) {
+	while(!_zt_ctl(zt, ZT_CTL_STOP)) {
 		zt->err = zuf_wait_opt(zt->fd, op);
 
 		if (zt->err) {
@@ -140,12 +632,26 @@ static void *zu_thread(void *callback_info)
 		op->hdr.err = _errno_UtoK(_do_op(zt, op));
 	}
 
-	pthread_setspecific(g_zts_id_key, NULL);
+	tls_zt = NULL;
 
+	_perf_close(zt);
 	zuf_root_close(&zt->fd);
+	fba_free(&zt->wait_op);
 
 	INFO("[%d] thread Exit\n", zt->no);
+	__atomic_store_n(&zt->exited, true, __ATOMIC_RELEASE);
+	sem_post(&g_mgr.sem);
 	return zt;
+
+fail_close:
+	zuf_root_close(&zt->fd);
+fail_free:
+	fba_free(&zt->wait_op);
+init_fail:
+	_zt_init_done(zt);
+	__atomic_store_n(&zt->exited, true, __ATOMIC_RELEASE);
+	sem_post(&g_mgr.sem);
+	return NULL;
 }
 
 static
@@ -186,7 +692,7 @@ int _start_one_zu_thread(struct _zu_thread *zt, struct thread_param *tp,
 			      err, strerror(err));
 			goto error;
 		}
-	} /* else set nice */
+	} /* else the thread sets its nice */
 
 	err = pthread_attr_setaffinity_np(&attr,sizeof(*affinity), affinity);
 	if (unlikely(err)) {
@@ -195,6 +701,9 @@ int _start_one_zu_thread(struct _zu_thread *zt, struct thread_param *tp,
 	}
 
 	zt->no = no;
+	zt->err = 0;
+	zt->running = zt->exited = false;
+	zt->ctl = 0;
 	err = pthread_create(&zt->thread, &attr, &zu_thread, zt);
 	pthread_attr_destroy(&attr);
 
@@ -228,79 +737,1142 @@ static void _dbg_print_affinity(int cpu, cpu_set_t *affinity)
 	DBGCONT("(%zd)\n", b);
 }
 
+static int _start_zt_on(struct _zu_cpu *zc, uint k,
+			struct wait_til_zero *wtz)
+{
+	struct _zu_thread *zt = &zc->zts[k];
+	cpu_set_t affinity;
+	int err;
+
+	if (zc->routed) {
+		affinity = g_tp->cpus;
+	} else {
+		CPU_ZERO(&affinity);
+		CPU_SET(zc->cpu, &affinity);
+	}
+	_dbg_print_affinity(zc->cpu, &affinity);
+
+	zt->zc = zc;
+	zt->wtz = wtz;
+	err = _start_one_zu_thread(zt, g_tp, zc->first_no + k, &affinity);
+	if (unlikely(err))
+		return err;
+
+	__atomic_add_fetch(&zc->nthreads, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Join exited threads. Returns true if one never came up, then the Kernel
+ * does not take more threads on this CPU.
+ */
+static bool _zc_reap(struct _zu_cpu *zc)
+{
+	bool refused = false;
+	uint k;
+
+	for (k = 0; k < zc->max; ++k) {
+		struct _zu_thread *zt = &zc->zts[k];
+		void *tret;
+
+		if (!zt->thread ||
+		    !__atomic_load_n(&zt->exited, __ATOMIC_ACQUIRE))
+			continue;
+
+		pthread_join(zt->thread, &tret);
+		zt->thread = 0;
+		__atomic_sub_fetch(&zc->nthreads, 1, __ATOMIC_RELAXED);
+		if (!zt->running)
+			refused = true;
+	}
+
+	return refused;
+}
+
+static void _zc_grow(struct _zu_cpu *zc)
+{
+	uint k;
+
+	for (k = 0; k < zc->max; ++k) {
+		if (zc->zts[k].thread)
+			continue;
+
+		if (_start_zt_on(zc, k, NULL))
+			zc->max = zc->nthreads;
+		else
+			DBG("cpu[%d] grow => %d threads\n", zc->cpu,
+			    zc->nthreads);
+		return;
+	}
+}
+
+/* After startup only the manager starts and joins zu_threads */
+static void *_zu_manager_thread(void *callback_info)
+{
+	while (!g_mgr.stop) {
+		struct timespec ts;
+		uint i;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		sem_timedwait(&g_mgr.sem, &ts);
+		if (g_mgr.stop)
+			break;
+
+		for (i = 0; i < g_num_zcs; ++i) {
+			struct _zu_cpu *zc = g_zcs[i];
+
+			if (_zc_reap(zc)) {
+				INFO("cpu[%d] Kernel refused a thread, max=%d\n",
+				     zc->cpu, zc->nthreads);
+				zc->max = max_t(uint, zc->nthreads, 1);
+			}
+
+			if (__atomic_load_n(&zc->want_grow, __ATOMIC_RELAXED)) {
+				_zc_grow(zc);
+				__atomic_store_n(&zc->want_grow, false,
+						 __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* ~~~~ deferred reclaim ~~~~ */
+
+/* One worker per NUMA node of the zu_threads, on that node's CPUs. The op
+ * threads hand it frees that take long (the blocks of a big file) and
+ * return to the Kernel right away. At most tp->reclaim_max works are
+ * queued per node, past that the caller does the work itself.
+ */
+struct _zu_reclaim {
+	pthread_t thread;
+	int node;
+	cpu_set_t cpus;
+	pthread_mutex_t lock;
+	pthread_cond_t kick;	/* Work was queued or stop */
+	pthread_cond_t idle;	/* @queued dropped to 0 */
+	struct zus_reclaim_work *head, **tail;
+	uint queued;		/* Not done yet, including the running one */
+	bool stop;
+};
+
+static struct _zu_reclaim *g_zrs;
+static uint g_num_zrs;
+
+static void *_reclaim_thread(void *callback_info)
+{
+	struct _zu_reclaim *zr = callback_info;
+
+	pthread_mutex_lock(&zr->lock);
+	for (;;) {
+		struct zus_reclaim_work *zrw;
+
+		while (!zr->head && !zr->stop)
+			pthread_cond_wait(&zr->kick, &zr->lock);
+		/* Stop only once the queue is empty */
+		zrw = zr->head;
+		if (!zrw)
+			break;
+		zr->head = zrw->next;
+		if (!zr->head)
+			zr->tail = &zr->head;
+		pthread_mutex_unlock(&zr->lock);
+
+		zrw->fn(zrw);
+
+		pthread_mutex_lock(&zr->lock);
+		if (!--zr->queued)
+			pthread_cond_broadcast(&zr->idle);
+	}
+	pthread_mutex_unlock(&zr->lock);
+
+	return NULL;
+}
+
+static struct _zu_reclaim *_reclaim_of(int node)
+{
+	uint i;
+
+	for (i = 0; i < g_num_zrs; ++i)
+		if (g_zrs[i].node == node)
+			return &g_zrs[i];
+
+	return g_num_zrs ? &g_zrs[0] : NULL;
+}
+
+bool zus_reclaim_queue(struct zus_reclaim_work *zrw)
+{
+	struct _zu_reclaim *zr = _reclaim_of(zus_getnuma());
+	bool queued;
+
+	if (!zr)
+		return false;
+
+	pthread_mutex_lock(&zr->lock);
+	queued = !zr->stop && zr->queued < g_tp->reclaim_max;
+	if (queued) {
+		zrw->next = NULL;
+		*zr->tail = zrw;
+		zr->tail = &zrw->next;
+		if (!zr->queued++)
+			pthread_cond_signal(&zr->kick);
+	}
+	pthread_mutex_unlock(&zr->lock);
+
+	return queued;
+}
+
+bool zus_reclaim_drain(void)
+{
+	bool waited = false;
+	uint i;
+
+	for (i = 0; i < g_num_zrs; ++i) {
+		struct _zu_reclaim *zr = &g_zrs[i];
+
+		pthread_mutex_lock(&zr->lock);
+		while (zr->queued) {
+			waited = true;
+			pthread_cond_wait(&zr->idle, &zr->lock);
+		}
+		pthread_mutex_unlock(&zr->lock);
+	}
+
+	return waited;
+}
+
+/* After the zu_threads are up, their ->numa tells the nodes of the CPUs */
+static void _reclaim_start(void)
+{
+	uint i, n;
+
+	if (!g_tp->reclaim_max)
+		return;
+
+	g_zrs = calloc(g_num_cpus, sizeof(*g_zrs));
+	if (unlikely(!g_zrs)) {
+		ERROR("no memory for reclaim workers, frees run inline\n");
+		return;
+	}
+
+	for (n = i = 0; i < g_num_cpus; ++i) {
+		int node = g_zcs[i]->zts[0].numa;
+		struct _zu_reclaim *zr;
+		uint z;
+
+		for (z = 0; z < n && g_zrs[z].node != node; ++z)
+			;
+		zr = &g_zrs[z];
+		if (z == n) {
+			zr->node = node;
+			CPU_ZERO(&zr->cpus);
+			++n;
+		}
+		CPU_SET(g_zcs[i]->cpu, &zr->cpus);
+	}
+
+	for (i = 0; i < n; ++i) {
+		struct _zu_reclaim *zr = &g_zrs[g_num_zrs];
+		pthread_attr_t attr;
+		int err;
+
+		if (i != g_num_zrs)
+			*zr = g_zrs[i];
+		pthread_mutex_init(&zr->lock, NULL);
+		pthread_cond_init(&zr->kick, NULL);
+		pthread_cond_init(&zr->idle, NULL);
+		zr->head = NULL;
+		zr->tail = &zr->head;
+
+		/* SCHED_OTHER, the zu_threads on these CPUs come first */
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(zr->cpus), &zr->cpus);
+		err = pthread_create(&zr->thread, &attr, &_reclaim_thread, zr);
+		pthread_attr_destroy(&attr);
+		if (unlikely(err)) {
+			ERROR("node[%d] reclaim pthread_create => %d: %s\n",
+			      zr->node, err, strerror(err));
+			pthread_cond_destroy(&zr->idle);
+			pthread_cond_destroy(&zr->kick);
+			pthread_mutex_destroy(&zr->lock);
+			continue;
+		}
+		++g_num_zrs;
+		INFO("node[%d] reclaim worker up\n", zr->node);
+	}
+}
+
+static void _reclaim_stop(void)
+{
+	uint i;
+
+	for (i = 0; i < g_num_zrs; ++i) {
+		struct _zu_reclaim *zr = &g_zrs[i];
+
+		pthread_mutex_lock(&zr->lock);
+		zr->stop = true;
+		pthread_cond_signal(&zr->kick);
+		pthread_mutex_unlock(&zr->lock);
+		pthread_join(zr->thread, NULL);
+	}
+
+	for (i = 0; i < g_num_zrs; ++i) {
+		struct _zu_reclaim *zr = &g_zrs[i];
+
+		pthread_cond_destroy(&zr->idle);
+		pthread_cond_destroy(&zr->kick);
+		pthread_mutex_destroy(&zr->lock);
+	}
+	g_num_zrs = 0;
+	free(g_zrs);
+	g_zrs = NULL;
+}
+
+/* ~~~~ group commit ~~~~ */
+
+/* A caller that finds no commit running is the leader: it takes all the
+ * queued requests, its own included, and runs @commit once for all of
+ * them. The ones that come meanwhile queue up and wait, on its end one of
+ * them leads the next commit with all that came. So the more callers the
+ * bigger the groups, and a lone caller never waits for a timer.
+ */
+/* Of all the zus_gcommit's, their leaders add at once */
+static ulong g_gcommit_reqs;
+static ulong g_gcommit_runs;
+
+void zus_gcommit_init(struct zus_gcommit *zgc,
+		      int (*commit)(struct zus_gcommit *zgc,
+				    struct zus_gcommit_req *reqs))
+{
+	memset(zgc, 0, sizeof(*zgc));
+	pthread_mutex_init(&zgc->lock, NULL);
+	pthread_cond_init(&zgc->done, NULL);
+	zgc->commit = commit;
+}
+
+void zus_gcommit_fini(struct zus_gcommit *zgc)
+{
+	pthread_cond_destroy(&zgc->done);
+	pthread_mutex_destroy(&zgc->lock);
+}
+
+int zus_gcommit(struct zus_gcommit *zgc, struct zus_gcommit_req *zgr)
+{
+	zgr->done = false;
+	zgr->err = 0;
+
+	pthread_mutex_lock(&zgc->lock);
+	zgr->next = zgc->head;
+	zgc->head = zgr;
+
+	while (!zgr->done) {
+		struct zus_gcommit_req *reqs, *next;
+		int err;
+
+		if (zgc->busy) {
+			pthread_cond_wait(&zgc->done, &zgc->lock);
+			continue;
+		}
+
+		reqs = zgc->head;
+		zgc->head = NULL;
+		zgc->busy = true;
+		pthread_mutex_unlock(&zgc->lock);
+
+		err = zgc->commit(zgc, reqs);
+		__atomic_fetch_add(&g_gcommit_runs, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&zgc->lock);
+		/* A waiter may return (and its @zgr go) once done is set */
+		for (; reqs; reqs = next) {
+			next = reqs->next;
+			reqs->err = err;
+			reqs->done = true;
+			__atomic_fetch_add(&g_gcommit_reqs, 1,
+					   __ATOMIC_RELAXED);
+		}
+		zgc->busy = false;
+		pthread_cond_broadcast(&zgc->done);
+	}
+	pthread_mutex_unlock(&zgc->lock);
+
+	return zgr->err;
+}
+
+/* ~~~~ mount time helpers ~~~~ */
+
+const struct thread_param *zus_thread_param(void)
+{
+	return g_tp;
+}
+
+struct _cpu_work {
+	void (*fn)(void *arg, uint i, uint n);
+	void *arg;
+	uint i, n;
+	bool inline_run;	/* Could not start a thread for it */
+	struct wait_til_zero *wtz;
+};
+
+static void *_cpu_work_thread(void *callback_info)
+{
+	struct _cpu_work *cw = callback_info;
+
+	cw->fn(cw->arg, cw->i, cw->n);
+	wtz_release(cw->wtz);
+	return NULL;
+}
+
+/* Run @fn on each zu_thread CPU in parallel, @i of @n, and wait for all.
+ * The zu_threads themselves are parked in the Kernel, so these are short
+ * lived threads pinned to the same CPUs. Runs it once inline when there
+ * are no zu_threads.
+ */
+static void _run_on_cpus(void (*fn)(void *arg, uint i, uint n), void *arg)
+{
+	uint n = g_num_cpus, i;
+	struct _cpu_work *cws = n ? calloc(n, sizeof(*cws)) : NULL;
+	struct wait_til_zero wtz;
+
+	if (!cws) {
+		fn(arg, 0, 1);
+		return;
+	}
+
+	wtz_init(&wtz);
+	wtz_arm(&wtz, n);
+	for (i = 0; i < n; ++i) {
+		struct _cpu_work *cw = &cws[i];
+		pthread_attr_t attr;
+		cpu_set_t affinity;
+		pthread_t thread;
+		int err;
+
+		cw->fn = fn;
+		cw->arg = arg;
+		cw->i = i;
+		cw->n = n;
+		cw->wtz = &wtz;
+
+		CPU_ZERO(&affinity);
+		CPU_SET(g_zcs[i]->cpu, &affinity);
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(affinity), &affinity);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = pthread_create(&thread, &attr, &_cpu_work_thread, cw);
+		pthread_attr_destroy(&attr);
+		if (unlikely(err)) {
+			DBG("cpu[%d] pthread_create => %d\n", g_zcs[i]->cpu,
+			    err);
+			cw->inline_run = true;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (cws[i].inline_run) {
+			fn(arg, i, n);
+			wtz_release(&wtz);
+		}
+	}
+
+	wtz_wait(&wtz);
+	sem_destroy(&wtz.sem);
+	free(cws);
+}
+
+/* Units of a parallel_for are a power of two blocks, aligned, between
+ * these. So a unit never crosses a NUMA chunk.
+ */
+#define ZUS_PFOR_MIN_SHIFT	8	/* 1M */
+#define ZUS_PFOR_UNITS_PER_CPU	16
+
+struct _pfor {
+	struct zus_pmem *pmem;
+	void (*fn)(void *arg, ulong bn, ulong end);
+	void *arg;
+	ulong first, last;
+	ulong base;	/* first >> shift */
+	ulong nunits;
+	uint shift;
+	__u8 *taken;
+};
+
+static void _pfor_unit(struct _pfor *pf, ulong u)
+{
+	ulong bn = (pf->base + u) << pf->shift;
+	ulong end = bn + (1UL << pf->shift);
+
+	pf->fn(pf->arg, max_t(ulong, bn, pf->first),
+	       min_t(ulong, end, pf->last));
+}
+
+static void _pfor_run(void *arg, uint i, uint n)
+{
+	struct _pfor *pf = arg;
+	ulong start = i * pf->nunits / n;
+	int node = zus_getnuma();
+	ulong k;
+
+	/* First the units on our own node, then help with what is left */
+	for (k = 0; k < pf->nunits; ++k) {
+		ulong u = (start + k) % pf->nunits;
+		ulong bn = max_t(ulong, (pf->base + u) << pf->shift, pf->first);
+
+		if ((int)pmem_numa_id(pf->pmem, bn) == node &&
+		    !__atomic_exchange_n(&pf->taken[u], 1, __ATOMIC_RELAXED))
+			_pfor_unit(pf, u);
+	}
+
+	for (k = 0; k < pf->nunits; ++k) {
+		ulong u = (start + k) % pf->nunits;
+
+		if (!__atomic_exchange_n(&pf->taken[u], 1, __ATOMIC_RELAXED))
+			_pfor_unit(pf, u);
+	}
+}
+
+void zus_pmem_parallel_for(struct zus_pmem *pmem, ulong first, ulong last,
+			   void (*fn)(void *arg, ulong bn, ulong end),
+			   void *arg)
+{
+	ulong want = (last - first) /
+			(max_t(uint, g_num_cpus, 1) * ZUS_PFOR_UNITS_PER_CPU);
+	struct _pfor pf = {
+		.pmem = pmem, .fn = fn, .arg = arg,
+		.first = first, .last = last,
+		.shift = ZUS_PFOR_MIN_SHIFT,
+	};
+
+	if (unlikely(last <= first))
+		return;
+
+	while (pf.shift < ZUS_NUMA_CHUNK_SHIFT && (1UL << pf.shift) < want)
+		++pf.shift;
+	pf.base = first >> pf.shift;
+	pf.nunits = ((last - 1) >> pf.shift) - pf.base + 1;
+
+	pf.taken = g_num_cpus > 1 ? calloc(pf.nunits, 1) : NULL;
+	if (!pf.taken) {
+		fn(arg, first, last);
+		return;
+	}
+
+	_run_on_cpus(_pfor_run, &pf);
+	free(pf.taken);
+}
+
+static bool _cpu_allowed(struct thread_param *tp, int cpu)
+{
+	return !CPU_COUNT(&tp->cpus) || CPU_ISSET(cpu, &tp->cpus);
+}
+
+static void _tp_threads(struct thread_param *tp, uint *min, uint *max)
+{
+	*min = max_t(uint, tp->min_threads, 1);
+	*max = max_t(uint, tp->max_threads, *min);
+}
+
+/* Upper bound of the zu_thread slots, known before the kernel's num_cpu.
+ * A routed CPU has one thread.
+ */
+static uint _max_zts(struct thread_param *tp)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	uint cpu, n = 0, routed = 0, min, max;
+
+	_tp_threads(tp, &min, &max);
+	for (cpu = 0; cpu < (ncpu > 0 ? (ulong)ncpu : 1UL); ++cpu) {
+		if (_cpu_allowed(tp, cpu))
+			++n;
+		else
+			++routed;
+	}
+
+	return max_t(uint, n, 1) * max + routed;
+}
+
+/* The node of @cpu, from sysfs. -1 if not known */
+static int _cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *de;
+	int node = -1;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (unlikely(!dir))
+		return -1;
+	while ((de = readdir(dir)))
+		if (sscanf(de->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+/* A _zu_cpu and the slots of its @nslots threads, which go in g_zts from
+ * @first_no, on @cpu's node. The threads of a routed CPU run anywhere, it
+ * stays on the caller's node.
+ */
+static struct _zu_cpu *_zc_alloc(int cpu, bool routed, uint first_no,
+				 uint nslots)
+{
+	struct _zu_cpu *zc;
+	struct fba mem;
+	uint k;
+
+	if (unlikely(fba_alloc_node(&mem, sizeof(*zc) +
+					  nslots * sizeof(*zc->zts),
+				    routed ? -1 : _cpu_node(cpu))))
+		return NULL;
+
+	zc = mem.ptr;
+	zc->mem = mem;
+	zc->zts = (void *)(zc + 1);
+	zc->cpu = cpu;
+	zc->routed = routed;
+	zc->first_no = first_no;
+	zc->max = nslots;
+	for (k = 0; k < nslots; ++k)
+		g_zts[first_no + k] = &zc->zts[k];
+	return zc;
+}
+
+static void zus_stop_all_threads(void);
+
 static int zus_start_all_threads(struct thread_param *tp, uint num_cpus)
 {
-	uint i, err;
+	uint min, max, i, k, max_zts = g_max_zts, no = 0, nstart = 0;
+	uint started = 0;
+	int cpu, err;
 
 	wtz_init(&g_wtz);
 
+	g_tp = tp;
 	g_zus_root_path = tp->path;
-	g_zts = calloc(num_cpus, sizeof(*g_zts));
+	_tp_threads(tp, &min, &max);
+
+	g_zts = calloc(max_zts, sizeof(*g_zts));
 	if (!g_zts)
 		return ENOMEM;
-	g_num_gts = num_cpus;
-	pthread_key_create(&g_zts_id_key, NULL);
+	g_zcs = calloc(num_cpus, sizeof(*g_zcs));
+	if (!g_zcs) {
+		err = ENOMEM;
+		goto fail;
+	}
+	for (cpu = 0; (uint)cpu < num_cpus; ++cpu) {
+		struct _zu_cpu *zc;
 
-	err = fba_alloc(&g_wait_structs,
-			num_cpus * sizeof(struct zufs_ioc_wait_operation));
-	if (unlikely(err)) {
-		ERROR("fba_alloc => %d\n", err);
-		return err;
+		if (!_cpu_allowed(tp, cpu) || max_zts < no + max)
+			continue;
+
+		zc = _zc_alloc(cpu, false, no, max);
+		if (unlikely(!zc)) {
+			err = ENOMEM;
+			goto fail;
+		}
+		zc->min = min;
+		no += max;
+		g_zcs[g_num_zcs++] = zc;
+	}
+	if (unlikely(!g_num_zcs)) {
+		ERROR("No allowed CPU out of %u\n", num_cpus);
+		err = EINVAL;
+		goto fail;
 	}
+	g_num_cpus = g_num_zcs;
+
+	/* Routed CPUs go last, g_zcs[0 .. g_num_cpus) stay the pinned ones */
+	for (cpu = 0; (uint)cpu < num_cpus && CPU_COUNT(&tp->cpus); ++cpu) {
+		struct _zu_cpu *zc;
+
+		if (_cpu_allowed(tp, cpu))
+			continue;
+		if (unlikely(max_zts < no + 1)) {
+			ERROR("cpu[%d] not in --cpus and no slot for it\n", cpu);
+			err = EINVAL;
+			goto fail;
+		}
 
-	wtz_arm(&g_wtz, num_cpus);
+		zc = _zc_alloc(cpu, true, no, 1);
+		if (unlikely(!zc)) {
+			err = ENOMEM;
+			goto fail;
+		}
+		zc->min = 1;
+		no += 1;
+		g_zcs[g_num_zcs++] = zc;
+	}
 
-	for (i = 0; i < num_cpus; ++i) {
-		cpu_set_t affinity;
+	sem_init(&g_mgr.sem, 0, 0);
 
-		CPU_ZERO(&affinity);
-		CPU_SET(i, &affinity);
-		_dbg_print_affinity(i, &affinity);
+	for (i = 0; i < g_num_zcs; ++i)
+		nstart += g_zcs[i]->min;
+	wtz_arm(&g_wtz, nstart);
 
-		err = _start_one_zu_thread(&g_zts[i], tp, i, &affinity);
-		if (err)
-			return err;
+	for (i = 0; i < g_num_zcs; ++i) {
+		for (k = 0; k < g_zcs[i]->min; ++k) {
+			err = _start_zt_on(g_zcs[i], k, &g_wtz);
+			if (err)
+				goto fail;
+			++started;
+		}
 	}
 
 	wtz_wait(&g_wtz);
+	_reclaim_start();
+
+	err = pthread_create(&g_mgr.thread, NULL, &_zu_manager_thread, NULL);
+	if (unlikely(err)) {
+		ERROR("pthread_create => %d: %s\n", err, strerror(err));
+		g_mgr.thread = 0;
+	}
 	return 0;
+
+fail:
+	/* The ones that did start come up (or fail) before they are stopped,
+	 * so the next mount starts from scratch
+	 */
+	if (nstart) {
+		for (; started < nstart; ++started)
+			wtz_release(&g_wtz);
+		wtz_wait(&g_wtz);
+	}
+	zus_stop_all_threads();
+	return err;
 }
 
 static void zus_stop_all_threads(void)
 {
 	void *tret;
-	int i;
+	uint i;
 
 	if (!g_zts)
 		return;
 
-	for (i = 0; i < g_num_gts; ++i)
-		g_zts[i].stop = true;
+	if (g_mgr.thread) {
+		g_mgr.stop = true;
+		sem_post(&g_mgr.sem);
+		pthread_join(g_mgr.thread, &tret);
+		g_mgr.thread = 0;
+	}
 
-	zuf_break_all(g_zts[0].fd);
+	for (i = 0; i < g_max_zts; ++i)
+		if (g_zts[i])
+			_zt_signal(g_zts[i], ZT_CTL_STOP);
 
-	for (i = 0; i < g_num_gts; ++i) {
-		struct _zu_thread *zt = &g_zts[i];
+	for (i = 0; i < g_max_zts; ++i) {
+		struct _zu_thread *zt = g_zts[i];
 
-		if (zt->thread) {
+		if (zt && zt->thread && zt->running &&
+		    !__atomic_load_n(&zt->exited, __ATOMIC_ACQUIRE)) {
+			zuf_break_all(zt->fd);
+			break;
+		}
+	}
+
+	for (i = 0; i < g_max_zts; ++i) {
+		struct _zu_thread *zt = g_zts[i];
+
+		if (zt && zt->thread) {
 			pthread_join(zt->thread, &tret);
 			zt->thread = 0;
 		}
 	}
 
-	fba_free(&g_wait_structs);
+	/* Only now no zu_thread can queue to, or look up, a worker */
+	_reclaim_stop();
+
+	pthread_mutex_lock(&g_zts_lock);
+	for (i = 0; i < g_max_zts; ++i) {
+		struct _zu_thread *zt = g_zts[i];
+
+		if (!zt)
+			continue;
+		free(zt->trace);
+		if (zt->stats_mem.ptr)
+			fba_free(&zt->stats_mem);
+	}
+	for (i = 0; i < g_num_zcs; ++i) {
+		struct fba mem = g_zcs[i]->mem;
+
+		fba_free(&mem);
+	}
 	free (g_zts);
 	g_zts = NULL;
+	free(g_zcs);
+	g_zcs = NULL;
+	g_num_zcs = g_num_cpus = 0;
+	pthread_mutex_unlock(&g_zts_lock);
+}
+
+void zus_stats_snapshot(struct zus_stats *zs)
+{
+	uint i;
+	int o, b;
+
+	memset(zs, 0, sizeof(*zs));
+	pthread_mutex_lock(&g_zts_lock);
+	for (i = 0; g_zts && i < g_max_zts; ++i) {
+		struct zus_stats *zts;
+
+		if (!g_zts[i])
+			continue;
+		zts = __atomic_load_n(&g_zts[i]->stats, __ATOMIC_ACQUIRE);
+		if (!zts)
+			continue;
+		for (o = 0; o < ZUS_STATS_MAX_OP; ++o) {
+			struct zus_op_stats *from = &zts->ops[o];
+			struct zus_op_stats *to = &zs->ops[o];
+			ulong count, max_ns;
+
+			count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+			if (!count)
+				continue;
+
+			to->count += count;
+			to->errors += __atomic_load_n(&from->errors,
+						      __ATOMIC_RELAXED);
+			to->total_ns += __atomic_load_n(&from->total_ns,
+							__ATOMIC_RELAXED);
+			max_ns = __atomic_load_n(&from->max_ns,
+						 __ATOMIC_RELAXED);
+			if (to->max_ns < max_ns)
+				to->max_ns = max_ns;
+			for (b = 0; b < ZUS_STATS_BUCKETS; ++b)
+				to->hist[b] += __atomic_load_n(&from->hist[b],
+							    __ATOMIC_RELAXED);
+			to->perf_count += __atomic_load_n(&from->perf_count,
+							  __ATOMIC_RELAXED);
+			for (b = 0; b < ZUS_PERF_MAX; ++b)
+				to->perf[b] += __atomic_load_n(&from->perf[b],
+							    __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&g_zts_lock);
+}
+
+/* n / d with two decimals, as "%lu.%02lu" */
+#define _PER(n, d)	((n) / (d)), ((n) * 100 / (d) % 100)
+
+/* The --perf counts, per operation */
+static void _perf_print(struct zus_stats *zs)
+{
+	bool any = false;
+	int o;
+
+	for (o = 0; o < ZUS_STATS_MAX_OP && !any; ++o)
+		any = zs->ops[o].perf_count != 0;
+	if (!any)
+		return;
+
+	/* Averages of the ops that ran with the group on the PMU */
+	INFO("%-20s %12s %10s %10s %6s %9s %9s %9s (per op)\n", "op",
+	     "counted", "cycles", "instrs", "IPC", "llc-miss", "br-miss",
+	     "node-miss");
+	for (o = 0; o < ZUS_STATS_MAX_OP; ++o) {
+		struct zus_op_stats *zos = &zs->ops[o];
+		ulong *perf = zos->perf;
+		ulong cycles = perf[ZUS_PERF_CYCLES] ?: 1;
+		ulong n = zos->perf_count;
+
+		if (!n)
+			continue;
+
+		INFO("%-20s %12lu %10lu %10lu %3lu.%02lu %5lu.%02lu "
+		     "%5lu.%02lu %5lu.%02lu\n", zus_op_name(o), n,
+		     perf[ZUS_PERF_CYCLES] / n,
+		     perf[ZUS_PERF_INSTRUCTIONS] / n,
+		     _PER(perf[ZUS_PERF_INSTRUCTIONS], cycles),
+		     _PER(perf[ZUS_PERF_LLC_MISSES], n),
+		     _PER(perf[ZUS_PERF_BRANCH_MISSES], n),
+		     _PER(perf[ZUS_PERF_NODE_MISSES], n));
+	}
+}
+
+void zus_stats_print(void)
+{
+	struct zus_stats *zs = malloc(sizeof(*zs));
+	int o;
+
+	if (!zs)
+		return;
+
+	zus_stats_snapshot(zs);
+	INFO("%-20s %12s %8s %8s %8s %8s %8s %10s (ns)\n", "op", "count",
+	     "errors", "avg", "p50", "p99", "p999", "max");
+	for (o = 0; o < ZUS_STATS_MAX_OP; ++o) {
+		struct zus_op_stats *zos = &zs->ops[o];
+
+		if (!zos->count)
+			continue;
+
+		INFO("%-20s %12lu %8lu %8lu %8lu %8lu %8lu %10lu\n",
+		     zus_op_name(o), zos->count, zos->errors,
+		     zos->total_ns / zos->count,
+		     zus_stats_percentile(zos, 500),
+		     zus_stats_percentile(zos, 990),
+		     zus_stats_percentile(zos, 999), zos->max_ns);
+	}
+
+	_perf_print(zs);
+	free(zs);
+
+	if (__atomic_load_n(&g_gcommit_runs, __ATOMIC_RELAXED))
+		INFO("group commit: %lu requests in %lu commits\n",
+		     __atomic_load_n(&g_gcommit_reqs, __ATOMIC_RELAXED),
+		     __atomic_load_n(&g_gcommit_runs, __ATOMIC_RELAXED));
+	zus_pool_print_all();
+}
+
+/* Copy @ztr to @ents, oldest first. Returns how many are valid, the ones
+ * the writer overran while we copied are dropped into @lost.
+ */
+static ulong _trace_ring_copy(struct zus_trace_ring *ztr,
+			      struct zus_trace_ent *ents, ulong *lost)
+{
+	ulong size = ztr->mask + 1;
+	ulong head = __atomic_load_n(&ztr->head, __ATOMIC_ACQUIRE);
+	ulong first = (head > size) ? head - size : 0;
+	ulong i, valid;
+
+	for (i = first; i < head; ++i)
+		ents[i - first] = ztr->ents[i & ztr->mask];
+
+	/* The slot at the current head may be half written too */
+	valid = __atomic_load_n(&ztr->head, __ATOMIC_ACQUIRE) + 1;
+	valid = (valid > size) ? valid - size : 0;
+	if (valid <= first) {
+		*lost = first;
+		return head - first;
+	}
+
+	*lost = min_t(ulong, valid, head);
+	if (valid < head)
+		memmove(ents, ents + (valid - first),
+			(head - valid) * sizeof(*ents));
+	return (valid < head) ? head - valid : 0;
+}
+
+/* Writes all the rings to ZUS_TRACE_FILE. The threads keep running, only
+ * their stop waits
+ */
+void zus_trace_dump(void)
+{
+	struct zus_trace_file_hdr *fhdr = NULL;
+	struct zus_trace_ent *ents = NULL;
+	char path[64];
+	FILE *f = NULL;
+	uint i, nrings = 0;
+
+	if (!g_tp || !g_tp->trace_ents)
+		return;
+
+	pthread_mutex_lock(&g_zts_lock);
+	if (!g_zts)
+		goto out;
+
+	snprintf(path, sizeof(path), ZUS_TRACE_FILE, getpid());
+	f = fopen(path, "w");
+	fhdr = calloc(1, sizeof(*fhdr));
+	if (unlikely(!f || !fhdr)) {
+		ERROR("%s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	for (i = 0; i < g_max_zts; ++i)
+		if (g_zts[i] && g_zts[i]->trace)
+			++nrings;
+
+	fhdr->magic = ZUS_TRACE_MAGIC;
+	fhdr->version = ZUS_TRACE_VERSION;
+	fhdr->ent_size = sizeof(*ents);
+	fhdr->nrings = nrings;
+	fhdr->nops = ZUS_STATS_MAX_OP;
+	for (i = 0; i < ZUS_STATS_MAX_OP; ++i)
+		snprintf(fhdr->op_names[i], ZUS_TRACE_NAME_LEN, "%s",
+			 zus_op_name(i));
+	fwrite(fhdr, sizeof(*fhdr), 1, f);
+
+	for (i = 0; i < g_max_zts; ++i) {
+		struct zus_trace_ring *ztr = g_zts[i] ? g_zts[i]->trace : NULL;
+		struct zus_trace_ring_hdr rhdr = {};
+		ulong lost;
+
+		if (!ztr)
+			continue;
+
+		free(ents);
+		ents = malloc((ztr->mask + 1) * sizeof(*ents));
+		if (unlikely(!ents))
+			break;
+
+		rhdr.ztno = i;
+		rhdr.cpu = g_zts[i]->zc ? g_zts[i]->zc->cpu : -1;
+		rhdr.count = _trace_ring_copy(ztr, ents, &lost);
+		rhdr.lost = lost;
+		fwrite(&rhdr, sizeof(rhdr), 1, f);
+		fwrite(ents, sizeof(*ents), rhdr.count, f);
+	}
+
+	INFO("trace of %u threads in %s\n", nrings, path);
+out:
+	pthread_mutex_unlock(&g_zts_lock);
+	free(ents);
+	free(fhdr);
+	if (f)
+		fclose(f);
 }
 
 /* ~~~~ mount ~~~~~ */
-struct _zu_mount_thread {
+
+/* The Kernel has a single mount channel. A ZU_IOC_MOUNT returns the answer
+ * to the previous request and waits for the next one, so one thread
+ * receives them all and an sbi_init runs before its answer. A umount is
+ * answered once its sbi left the registry, its teardown (the FS's
+ * sbi_fini, the unmap of its pmem) is handed to a pool of
+ * ZUS_MOUNT_WORKERS, so the next mounts do not wait for it. A mount of a
+ * pmem that is still being torn down waits for that one.
+ */
+#define ZUS_MOUNT_WORKERS	4
+
+struct _zu_teardown {
+	struct _zu_teardown *next;
+	struct zus_sb_info *sbi;
+	uint pmem_kern_id;
+	bool started;
+};
+
+struct _zu_mount {
 	struct thread_param tp;
 	pthread_t thread;
 	int err;
 	int fd;
 	volatile bool stop;
-} g_mount;
+
+	pthread_t workers[ZUS_MOUNT_WORKERS];
+	pthread_mutex_t lock;
+	pthread_cond_t kick;	/* A teardown was queued, or stop */
+	pthread_cond_t done;	/* A teardown finished */
+	struct _zu_teardown *tds;	/* Queued and running, oldest last */
+	bool workers_stop;
+} g_mount = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.kick = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *_mount_worker(void *callback_info)
+{
+	pthread_mutex_lock(&g_mount.lock);
+	for (;;) {
+		struct _zu_teardown *td, **pp;
+
+		for (td = g_mount.tds; td && td->started; td = td->next)
+			;
+		/* Stop only once the queue is empty */
+		if (!td) {
+			if (g_mount.workers_stop)
+				break;
+			pthread_cond_wait(&g_mount.kick, &g_mount.lock);
+			continue;
+		}
+		td->started = true;
+		pthread_mutex_unlock(&g_mount.lock);
+
+		zus_sbi_teardown(td->sbi);
+
+		pthread_mutex_lock(&g_mount.lock);
+		for (pp = &g_mount.tds; *pp != td; pp = &(*pp)->next)
+			;
+		*pp = td->next;
+		free(td);
+		pthread_cond_broadcast(&g_mount.done);
+	}
+	pthread_mutex_unlock(&g_mount.lock);
+
+	return NULL;
+}
+
+/* Queue @sbi's teardown. With no worker to take it, it runs right here */
+static void _mount_teardown(struct zus_sb_info *sbi)
+{
+	struct _zu_teardown *td = malloc(sizeof(*td));
+
+	pthread_mutex_lock(&g_mount.lock);
+	if (unlikely(!td || g_mount.workers_stop || !g_mount.workers[0])) {
+		pthread_mutex_unlock(&g_mount.lock);
+		free(td);
+		zus_sbi_teardown(sbi);
+		return;
+	}
+
+	td->sbi = sbi;
+	td->pmem_kern_id = sbi->pmem.pmem_info.pmem_kern_id;
+	td->started = false;
+	td->next = g_mount.tds;
+	g_mount.tds = td;
+	pthread_cond_signal(&g_mount.kick);
+	pthread_mutex_unlock(&g_mount.lock);
+}
+
+/* Wait for the teardowns of @pmem_kern_id, before it is grabbed again */
+static void _mount_teardown_wait(uint pmem_kern_id)
+{
+	struct _zu_teardown *td;
+
+	pthread_mutex_lock(&g_mount.lock);
+	do {
+		for (td = g_mount.tds; td; td = td->next)
+			if (td->pmem_kern_id == pmem_kern_id)
+				break;
+		if (td)
+			pthread_cond_wait(&g_mount.done, &g_mount.lock);
+	} while (td);
+	pthread_mutex_unlock(&g_mount.lock);
+}
+
+static void _mount_workers_start(void)
+{
+	uint i;
+
+	for (i = 0; i < ZUS_MOUNT_WORKERS; ++i) {
+		int err = pthread_create(&g_mount.workers[i], NULL,
+					 &_mount_worker, NULL);
+
+		if (unlikely(err)) {
+			ERROR("mount worker pthread_create => %d: %s\n",
+			      err, strerror(err));
+			g_mount.workers[i] = 0;
+			break;
+		}
+	}
+}
+
+/* The queued teardowns are done first */
+static void _mount_workers_stop(void)
+{
+	uint i;
+
+	pthread_mutex_lock(&g_mount.lock);
+	g_mount.workers_stop = true;
+	pthread_cond_broadcast(&g_mount.kick);
+	pthread_mutex_unlock(&g_mount.lock);
+
+	for (i = 0; i < ZUS_MOUNT_WORKERS && g_mount.workers[i]; ++i) {
+		pthread_join(g_mount.workers[i], NULL);
+		g_mount.workers[i] = 0;
+	}
+}
+
+static void _umount(struct zufs_ioc_mount *zim)
+{
+	struct zus_sb_info *sbi = zus_umount_detach(zim);
+
+	if (sbi)
+		_mount_teardown(sbi);
+}
 
 static void *zus_mount_thread(void *callback_info)
 {
@@ -315,6 +1887,8 @@ static void *zus_mount_thread(void *callback_info)
 	zim.hdr.err = zus_register_all(g_mount.fd);
 	if (zim.hdr.err) {
 		ERROR("zus_register_all => %d\n", zim.hdr.err);
+		g_mount.err = zim.hdr.err;
+		zuf_root_close(&g_mount.fd);
 		return NULL;
 	}
 
@@ -328,8 +1902,9 @@ static void *zus_mount_thread(void *callback_info)
 			zus_start_all_threads(&g_mount.tp, zim.num_cpu);
 
 		if (zim.is_umounting) {
-			zus_umount(g_mount.fd, &zim);
+			_umount(&zim);
 		} else {
+			_mount_teardown_wait(zim.pmem_kern_id);
 			zus_mount(g_mount.fd, &zim);
 		}
 	}
@@ -346,6 +1921,8 @@ int zus_mount_thread_start(struct thread_param *tp)
 	int err;
 
 	g_mount.tp = *tp;
+	g_max_zts = _max_zts(tp);
+	zus_nv_init();
 
 	err = pthread_attr_init(&attr);
 	if (unlikely(err)) {
@@ -354,6 +1931,7 @@ int zus_mount_thread_start(struct thread_param *tp)
 	}
 
 	g_zus_root_path = tp->path;
+	_mount_workers_start();
 	err = pthread_create(&g_mount.thread, &attr, &zus_mount_thread,
 			     &g_mount);
 	pthread_attr_destroy(&attr);
@@ -375,16 +1953,26 @@ void zus_mount_thread_stop(void)
 {
 	void *tret;
 
+	/* Teardowns still use the reclaim workers of the zu_threads */
+	_mount_workers_stop();
 	zus_stop_all_threads();
 
 	g_mount.stop = true;
-	pthread_join(g_mount.thread, &tret);
-	g_mount.thread = 0;
+	if (g_mount.thread) {
+		pthread_join(g_mount.thread, &tret);
+		g_mount.thread = 0;
+	}
+
+	/* The Kernel is gone, whatever is still mounted is torn down here */
+	zus_umount_all();
 }
 
 void zus_join(void)
 {
 	void *tret;
 
-	pthread_join(g_mount.thread, &tret);
+	if (g_mount.thread) {
+		pthread_join(g_mount.thread, &tret);
+		g_mount.thread = 0;
+	}
 }
@@ -0,0 +1,534 @@
+/*
+ * zus-meta.c - zusmeta, multi-threaded metadata benchmark of a mounted FS
+ *
+ * usage: zusmeta [-n files] [-f fanout] [-t threads] [-s] [-c] DIR
+ *
+ * Each thread creates @files files spread over @fanout directories of its
+ * own (or, with -s, of directories shared by all threads), then looks them
+ * up, lists, renames across directories and removes them. Every phase
+ * starts from a barrier of all threads. Prints per phase the ops/sec of all
+ * threads together and the latency percentiles of a single op.
+ *
+ * The Kernel's dcache answers the lookups of a just-created name without
+ * calling zus. -c drops the dentry and inode caches before the phases that
+ * should reach the FS (needs root).
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "zusd.h"
+
+bool g_DBG = false;
+
+#define META_PATH	512
+#define META_DENTS	(32 * 1024)	/* getdents64 buffer, as glibc's */
+
+struct _mthread;
+
+struct _mphase {
+	const char *name;
+	void (*run)(struct _mthread *mt);
+	bool drop_caches;
+};
+
+struct _meta {
+	const char *top;	/* DIR/zusmeta.PID */
+	uint files;
+	uint fanout;
+	uint nthreads;
+	bool shared;
+	bool drop_caches;
+	pthread_barrier_t barrier;
+};
+
+struct _mthread {
+	struct _meta *m;
+	pthread_t thread;
+	uint no;
+	uint *order;		/* Shuffled 0..files-1 for the lookups */
+	void *dents;
+	struct zus_op_stats *zos;	/* Of the running phase */
+	const char *phase;
+	int err;
+	struct zus_op_stats *stats;	/* One per phase */
+	ulong *start, *end;
+};
+
+static ulong _now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+/* @ret < 0 is a failed op, @errno is its error */
+static void _record(struct _mthread *mt, ulong start, long ret)
+{
+	struct zus_op_stats *zos = mt->zos;
+	ulong ns = _now_ns() - start;
+
+	++zos->count;
+	zos->total_ns += ns;
+	++zos->hist[zus_stats_bucket(ns)];
+	if (zos->max_ns < ns)
+		zos->max_ns = ns;
+
+	if (unlikely(ret < 0)) {
+		if (!zos->errors++)
+			ERROR("[%u] %s => %s\n", mt->no, mt->phase,
+			      strerror(errno));
+		mt->err = -errno;
+	}
+}
+
+/* ~~~~ the tree ~~~~ */
+
+/* Not shared each thread has its own @fanout dirs under t<no>. Shared
+ * thread @no owns the dirs @d % nthreads == @no for mkdir, readdir and
+ * rmdir
+ */
+static bool _owns_dir(struct _mthread *mt, uint d)
+{
+	return !mt->m->shared || d % mt->m->nthreads == mt->no;
+}
+
+static void _dir_path(struct _mthread *mt, uint d, char *path)
+{
+	if (mt->m->shared)
+		snprintf(path, META_PATH, "%s/d%u", mt->m->top, d);
+	else
+		snprintf(path, META_PATH, "%s/t%u/d%u", mt->m->top, mt->no, d);
+}
+
+/* File @i of the thread lives in directory @i % fanout, after a rename in
+ * the next one
+ */
+static void _file_path(struct _mthread *mt, uint i, bool renamed, char *path)
+{
+	uint d = (i + renamed) % mt->m->fanout;
+	char c = renamed ? 'r' : 'f';
+
+	if (mt->m->shared)
+		snprintf(path, META_PATH, "%s/d%u/t%u.%c%u", mt->m->top, d,
+			 mt->no, c, i);
+	else
+		snprintf(path, META_PATH, "%s/t%u/d%u/t%u.%c%u", mt->m->top,
+			 mt->no, d, mt->no, c, i);
+}
+
+/* Names in @d not counting "." and ".." */
+static ulong _dir_expected(struct _meta *m, uint d)
+{
+	ulong n = m->files / m->fanout + (d < m->files % m->fanout);
+
+	return m->shared ? n * m->nthreads : n;
+}
+
+/* ~~~~ the phases ~~~~ */
+
+static void _m_mkdir(struct _mthread *mt)
+{
+	char path[META_PATH];
+	ulong start;
+	uint d;
+
+	if (!mt->m->shared) {
+		snprintf(path, META_PATH, "%s/t%u", mt->m->top, mt->no);
+		start = _now_ns();
+		_record(mt, start, mkdir(path, 0755));
+	}
+
+	for (d = 0; d < mt->m->fanout; ++d) {
+		if (!_owns_dir(mt, d))
+			continue;
+		_dir_path(mt, d, path);
+		start = _now_ns();
+		_record(mt, start, mkdir(path, 0755));
+	}
+}
+
+static void _m_create(struct _mthread *mt)
+{
+	char path[META_PATH];
+	ulong start;
+	uint i;
+	int fd;
+
+	for (i = 0; i < mt->m->files; ++i) {
+		_file_path(mt, i, false, path);
+		start = _now_ns();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (likely(fd >= 0))
+			close(fd);
+		_record(mt, start, fd);
+	}
+}
+
+static void _m_stat(struct _mthread *mt)
+{
+	char path[META_PATH];
+	struct stat st;
+	ulong start;
+	uint i;
+
+	for (i = 0; i < mt->m->files; ++i) {
+		_file_path(mt, mt->order[i], false, path);
+		start = _now_ns();
+		_record(mt, start, stat(path, &st));
+	}
+}
+
+/* An op is one getdents64 call, the list of each dir is then checked */
+static void _m_readdir(struct _mthread *mt)
+{
+	char path[META_PATH];
+	ulong start, names;
+	long len, pos;
+	uint d;
+	int fd;
+
+	for (d = 0; d < mt->m->fanout; ++d) {
+		if (!_owns_dir(mt, d))
+			continue;
+
+		_dir_path(mt, d, path);
+		fd = open(path, O_RDONLY | O_DIRECTORY);
+		if (unlikely(fd < 0)) {
+			_record(mt, _now_ns(), fd);
+			continue;
+		}
+
+		names = 0;
+		do {
+			start = _now_ns();
+			len = syscall(SYS_getdents64, fd, mt->dents,
+				      META_DENTS);
+			_record(mt, start, len);
+
+			for (pos = 0; pos < len;) {
+				struct dirent64 *de = mt->dents + pos;
+
+				if (strcmp(de->d_name, ".") &&
+				    strcmp(de->d_name, ".."))
+					++names;
+				pos += de->d_reclen;
+			}
+		} while (len > 0);
+		close(fd);
+
+		if (unlikely(names != _dir_expected(mt->m, d))) {
+			ERROR("[%u] %s: %lu names expected %lu\n", mt->no,
+			      path, names, _dir_expected(mt->m, d));
+			++mt->zos->errors;
+			mt->err = -EIO;
+		}
+	}
+}
+
+/* Always across two directories */
+static void _m_rename(struct _mthread *mt)
+{
+	char from[META_PATH], to[META_PATH];
+	ulong start;
+	uint i;
+
+	for (i = 0; i < mt->m->files; ++i) {
+		_file_path(mt, i, false, from);
+		_file_path(mt, i, true, to);
+		start = _now_ns();
+		_record(mt, start, rename(from, to));
+	}
+}
+
+static void _m_unlink(struct _mthread *mt)
+{
+	char path[META_PATH];
+	ulong start;
+	uint i;
+
+	for (i = 0; i < mt->m->files; ++i) {
+		_file_path(mt, mt->order[i], true, path);
+		start = _now_ns();
+		_record(mt, start, unlink(path));
+	}
+}
+
+static void _m_rmdir(struct _mthread *mt)
+{
+	char path[META_PATH];
+	ulong start;
+	uint d;
+
+	for (d = 0; d < mt->m->fanout; ++d) {
+		if (!_owns_dir(mt, d))
+			continue;
+		_dir_path(mt, d, path);
+		start = _now_ns();
+		_record(mt, start, rmdir(path));
+	}
+
+	if (!mt->m->shared) {
+		snprintf(path, META_PATH, "%s/t%u", mt->m->top, mt->no);
+		start = _now_ns();
+		_record(mt, start, rmdir(path));
+	}
+}
+
+static const struct _mphase g_phases[] = {
+	{ "MKDIR",	_m_mkdir,	false },
+	{ "CREATE",	_m_create,	false },
+	{ "STAT",	_m_stat,	true },
+	{ "READDIR",	_m_readdir,	true },
+	{ "RENAME",	_m_rename,	true },
+	{ "UNLINK",	_m_unlink,	true },
+	{ "RMDIR",	_m_rmdir,	false },
+};
+#define META_PHASES	(sizeof(g_phases) / sizeof(g_phases[0]))
+
+/* ~~~~ threads ~~~~ */
+
+static void _drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (unlikely(fd < 0 || write(fd, "2\n", 2) != 2))
+		ERROR("drop_caches => %s\n", strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+/* All threads run the phases in order, each phase starts from a barrier
+ * after which one of them may drop the caches.
+ */
+static void *_meta_thread(void *arg)
+{
+	struct _mthread *mt = arg;
+	uint p;
+
+	for (p = 0; p < META_PHASES; ++p) {
+		int serial = pthread_barrier_wait(&mt->m->barrier);
+
+		if (serial == PTHREAD_BARRIER_SERIAL_THREAD &&
+		    mt->m->drop_caches && g_phases[p].drop_caches)
+			_drop_caches();
+		pthread_barrier_wait(&mt->m->barrier);
+
+		mt->zos = &mt->stats[p];
+		mt->phase = g_phases[p].name;
+		mt->start[p] = _now_ns();
+		g_phases[p].run(mt);
+		mt->end[p] = _now_ns();
+	}
+	return NULL;
+}
+
+static ulong _rand(ulong *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static int _mthread_init(struct _meta *m, struct _mthread *mt, uint no)
+{
+	ulong seed = 0x2545f4914f6cdd1dUL * (no + 1);
+	uint i;
+
+	mt->m = m;
+	mt->no = no;
+	mt->order = malloc(m->files * sizeof(*mt->order));
+	mt->dents = malloc(META_DENTS);
+	mt->stats = calloc(META_PHASES, sizeof(*mt->stats));
+	mt->start = calloc(META_PHASES, sizeof(*mt->start));
+	mt->end = calloc(META_PHASES, sizeof(*mt->end));
+	if (unlikely(!mt->order || !mt->dents || !mt->stats || !mt->start ||
+		     !mt->end))
+		return -ENOMEM;
+
+	for (i = 0; i < m->files; ++i)
+		mt->order[i] = i;
+	for (i = m->files - 1; i > 0; --i) {
+		uint j = _rand(&seed) % (i + 1);
+		uint t = mt->order[i];
+
+		mt->order[i] = mt->order[j];
+		mt->order[j] = t;
+	}
+	return 0;
+}
+
+static void _mthread_fini(struct _mthread *mt)
+{
+	free(mt->order);
+	free(mt->dents);
+	free(mt->stats);
+	free(mt->start);
+	free(mt->end);
+}
+
+static void _print_phase(struct _meta *m, struct _mthread *mts, uint p)
+{
+	struct zus_op_stats *zos = calloc(1, sizeof(*zos));
+	ulong start = ~0UL, end = 0;
+	double secs;
+	uint t, b;
+
+	if (unlikely(!zos))
+		return;
+
+	for (t = 0; t < m->nthreads; ++t) {
+		struct zus_op_stats *from = &mts[t].stats[p];
+
+		zos->count += from->count;
+		zos->errors += from->errors;
+		zos->total_ns += from->total_ns;
+		if (zos->max_ns < from->max_ns)
+			zos->max_ns = from->max_ns;
+		for (b = 0; b < ZUS_STATS_BUCKETS; ++b)
+			zos->hist[b] += from->hist[b];
+
+		if (mts[t].start[p] < start)
+			start = mts[t].start[p];
+		if (end < mts[t].end[p])
+			end = mts[t].end[p];
+	}
+
+	secs = end > start ? (double)(end - start) / NSEC_PER_SEC : 0;
+	printf("%-10s %10lu %8lu %12.0f %8lu %8lu %8lu %8lu %10lu\n",
+	       g_phases[p].name, zos->count, zos->errors,
+	       secs > 0 ? zos->count / secs : 0,
+	       zos->count ? zos->total_ns / zos->count : 0,
+	       zus_stats_percentile(zos, 500),
+	       zus_stats_percentile(zos, 990),
+	       zus_stats_percentile(zos, 999), zos->max_ns);
+	free(zos);
+}
+
+static void usage(void)
+{
+	printf("usage: zusmeta [-n files] [-f fanout] [-t threads] [-s] [-c] "
+	       "DIR\n");
+	printf("	-n files	files per thread (10000)\n");
+	printf("	-f fanout	directories the files are spread on (16)\n");
+	printf("	-t threads	(online CPUs)\n");
+	printf("	-s		threads share the directories\n");
+	printf("	-c		drop dentry and inode caches between "
+	       "phases\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char top[META_PATH];
+	struct _mthread *mts = NULL;
+	struct _meta m = {};
+	uint started = 0, t, p;
+	long ncpus;
+	int opt, err = 0;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	m.nthreads = ncpus > 0 ? ncpus : 1;
+	m.files = 10000;
+	m.fanout = 16;
+
+	while ((opt = getopt(argc, argv, "n:f:t:sch")) != -1) {
+		switch (opt) {
+		case 'n':
+			m.files = strtoul(optarg, NULL, 0) ?: 1;
+			break;
+		case 'f':
+			m.fanout = strtoul(optarg, NULL, 0) ?: 1;
+			break;
+		case 't':
+			m.nthreads = strtoul(optarg, NULL, 0) ?: 1;
+			break;
+		case 's':
+			m.shared = true;
+			break;
+		case 'c':
+			m.drop_caches = true;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+		return 1;
+	}
+
+	/* Leave room for the names under it */
+	if (strlen(argv[optind]) > META_PATH / 2) {
+		ERROR("%s: path too long\n", argv[optind]);
+		return 1;
+	}
+	snprintf(top, sizeof(top), "%s/zusmeta.%d", argv[optind], getpid());
+	m.top = top;
+	if (mkdir(top, 0755)) {
+		ERROR("%s: %s\n", top, strerror(errno));
+		return 1;
+	}
+
+	mts = calloc(m.nthreads, sizeof(*mts));
+	if (unlikely(!mts)) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (t = 0; t < m.nthreads; ++t) {
+		err = _mthread_init(&m, &mts[t], t);
+		if (unlikely(err)) {
+			ERROR("no memory for %u threads\n", m.nthreads);
+			goto out;
+		}
+	}
+
+	pthread_barrier_init(&m.barrier, NULL, m.nthreads);
+	for (started = 0; started < m.nthreads; ++started)
+		if (pthread_create(&mts[started].thread, NULL, _meta_thread,
+				   &mts[started])) {
+			ERROR("pthread_create => %d\n", errno);
+			exit(1);
+		}
+	for (t = 0; t < started; ++t)
+		pthread_join(mts[t].thread, NULL);
+	pthread_barrier_destroy(&m.barrier);
+
+	printf("# zusmeta %s threads=%u files=%u fanout=%u%s%s\n", top,
+	       m.nthreads, m.files, m.fanout, m.shared ? " shared" : "",
+	       m.drop_caches ? " drop_caches" : "");
+	printf("# %-8s %10s %8s %12s %8s %8s %8s %8s %10s (ns)\n", "phase",
+	       "ops", "errors", "ops/s", "avg", "p50", "p99", "p999", "max");
+	for (p = 0; p < META_PHASES; ++p)
+		_print_phase(&m, mts, p);
+
+	for (t = 0; t < m.nthreads; ++t)
+		if (mts[t].err)
+			err = mts[t].err;
+out:
+	for (t = 0; mts && t < m.nthreads; ++t)
+		_mthread_fini(&mts[t]);
+	free(mts);
+	rmdir(top);
+	return err ? 1 : 0;
+}
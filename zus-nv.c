@@ -0,0 +1,285 @@
+/*
+ * zus-nv.c - Non-temporal and flushing copy kernels for pmem (see nv.h)
+ *
+ * All kernels work in whole cache-lines. The partial lines at the head and
+ * tail of a copy go through the cache and are flushed. Short copies are done
+ * the same way, they are faster cached than streamed.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "zus.h"
+#include "nv.h"
+
+#define NV_LINE		ZUS_CACHELINE_SIZE
+#define NV_NT_MIN	(4 * NV_LINE)
+
+/* @dst is NV_LINE aligned, @lines whole cache-lines */
+typedef void (*nv_mov_fn)(void *dst, const void *src, size_t lines);
+typedef void (*nv_set_fn)(void *dst, int c, size_t lines);
+/* @addr is NV_LINE aligned */
+typedef void (*nv_flush_fn)(char *addr, size_t lines);
+
+#if defined(__x86_64__)
+
+static void _mov_sse2(void *dst, const void *src, size_t lines)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for (; lines; --lines, d += 4, s += 4) {
+		__m128i x0 = _mm_loadu_si128(s);
+		__m128i x1 = _mm_loadu_si128(s + 1);
+		__m128i x2 = _mm_loadu_si128(s + 2);
+		__m128i x3 = _mm_loadu_si128(s + 3);
+
+		_mm_stream_si128(d, x0);
+		_mm_stream_si128(d + 1, x1);
+		_mm_stream_si128(d + 2, x2);
+		_mm_stream_si128(d + 3, x3);
+	}
+}
+
+static void _set_sse2(void *dst, int c, size_t lines)
+{
+	__m128i x = _mm_set1_epi8((char)c);
+	__m128i *d = dst;
+
+	for (; lines; --lines, d += 4) {
+		_mm_stream_si128(d, x);
+		_mm_stream_si128(d + 1, x);
+		_mm_stream_si128(d + 2, x);
+		_mm_stream_si128(d + 3, x);
+	}
+}
+
+__attribute__((target("avx2")))
+static void _mov_avx2(void *dst, const void *src, size_t lines)
+{
+	__m256i *d = dst;
+	const __m256i *s = src;
+
+	for (; lines; --lines, d += 2, s += 2) {
+		__m256i y0 = _mm256_loadu_si256(s);
+		__m256i y1 = _mm256_loadu_si256(s + 1);
+
+		_mm256_stream_si256(d, y0);
+		_mm256_stream_si256(d + 1, y1);
+	}
+	_mm256_zeroupper();
+}
+
+__attribute__((target("avx2")))
+static void _set_avx2(void *dst, int c, size_t lines)
+{
+	__m256i y = _mm256_set1_epi8((char)c);
+	__m256i *d = dst;
+
+	for (; lines; --lines, d += 2) {
+		_mm256_stream_si256(d, y);
+		_mm256_stream_si256(d + 1, y);
+	}
+	_mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+static void _mov_avx512(void *dst, const void *src, size_t lines)
+{
+	__m512i *d = dst;
+	const __m512i *s = src;
+
+	for (; lines; --lines, ++d, ++s)
+		_mm512_stream_si512(d, _mm512_loadu_si512(s));
+	_mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+static void _set_avx512(void *dst, int c, size_t lines)
+{
+	__m512i z = _mm512_set1_epi32((c & 0xff) * 0x01010101);
+	__m512i *d = dst;
+
+	for (; lines; --lines, ++d)
+		_mm512_stream_si512(d, z);
+	_mm256_zeroupper();
+}
+
+static void _flush_clflush(char *addr, size_t lines)
+{
+	for (; lines; --lines, addr += NV_LINE)
+		__asm__ __volatile__("clflush %0" : "+m" (*addr));
+}
+
+/* Encoded by hand for old assemblers, like the Kernel does */
+static void _flush_clflushopt(char *addr, size_t lines)
+{
+	for (; lines; --lines, addr += NV_LINE)
+		__asm__ __volatile__(".byte 0x66; clflush %0" : "+m" (*addr));
+}
+
+static void _flush_clwb(char *addr, size_t lines)
+{
+	for (; lines; --lines, addr += NV_LINE)
+		__asm__ __volatile__(".byte 0x66; xsaveopt %0" : "+m" (*addr));
+}
+
+#define NV_DEF_MOV	_mov_sse2
+#define NV_DEF_SET	_set_sse2
+#define NV_DEF_FLUSH	_flush_clflush
+
+#else /* !__x86_64__ */
+
+/* FIXME: No persistence on other arches, just keep things working */
+static void _mov_memcpy(void *dst, const void *src, size_t lines)
+{
+	memcpy(dst, src, lines * NV_LINE);
+}
+
+static void _set_memset(void *dst, int c, size_t lines)
+{
+	memset(dst, c, lines * NV_LINE);
+}
+
+static void _flush_none(char *addr, size_t lines)
+{
+}
+
+#define NV_DEF_MOV	_mov_memcpy
+#define NV_DEF_SET	_set_memset
+#define NV_DEF_FLUSH	_flush_none
+
+#endif /* __x86_64__ */
+
+static struct {
+	nv_mov_fn	mov;
+	nv_set_fn	set;
+	nv_flush_fn	flush;
+} g_nv = {
+	.mov = NV_DEF_MOV,
+	.set = NV_DEF_SET,
+	.flush = NV_DEF_FLUSH,
+};
+
+void zus_nv_init(void)
+{
+	const char *mov = "sse2", *flush = "clflush";
+#if defined(__x86_64__)
+	uint a, b = 0, c, d;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		g_nv.mov = _mov_avx512;
+		g_nv.set = _set_avx512;
+		mov = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		g_nv.mov = _mov_avx2;
+		g_nv.set = _set_avx2;
+		mov = "avx2";
+	}
+
+	__get_cpuid_count(7, 0, &a, &b, &c, &d);
+	if (b & bit_CLWB) {
+		g_nv.flush = _flush_clwb;
+		flush = "clwb";
+	} else if (b & bit_CLFLUSHOPT) {
+		g_nv.flush = _flush_clflushopt;
+		flush = "clflushopt";
+	}
+#else
+	mov = "memcpy";
+	flush = "none";
+#endif
+
+	INFO("pmem copy=%s flush=%s\n", mov, flush);
+}
+
+static inline char *_line_down(const void *addr)
+{
+	return (char *)((uintptr_t)addr & ~(uintptr_t)(NV_LINE - 1));
+}
+
+void pmem_flush(const void *addr, size_t len)
+{
+	char *start = _line_down(addr);
+	char *end;
+
+	if (unlikely(!len))
+		return;
+
+	end = _line_down((const char *)addr + len - 1) + NV_LINE;
+	g_nv.flush(start, (end - start) / NV_LINE);
+}
+
+void pmem_memcpy_nt(void *dst, const void *src, size_t len)
+{
+	size_t head, lines;
+
+	if (len < NV_NT_MIN) {
+		memcpy(dst, src, len);
+		pmem_flush(dst, len);
+		return;
+	}
+
+	head = -(uintptr_t)dst & (NV_LINE - 1);
+	if (head) {
+		memcpy(dst, src, head);
+		g_nv.flush(_line_down(dst), 1);
+		dst += head;
+		src += head;
+		len -= head;
+	}
+
+	lines = len / NV_LINE;
+	g_nv.mov(dst, src, lines);
+	dst += lines * NV_LINE;
+	src += lines * NV_LINE;
+	len -= lines * NV_LINE;
+
+	if (len) {
+		memcpy(dst, src, len);
+		g_nv.flush(dst, 1);
+	}
+}
+
+void pmem_memset_nt(void *dst, int c, size_t len)
+{
+	size_t head, lines;
+
+	if (len < NV_NT_MIN) {
+		memset(dst, c, len);
+		pmem_flush(dst, len);
+		return;
+	}
+
+	head = -(uintptr_t)dst & (NV_LINE - 1);
+	if (head) {
+		memset(dst, c, head);
+		g_nv.flush(_line_down(dst), 1);
+		dst += head;
+		len -= head;
+	}
+
+	lines = len / NV_LINE;
+	g_nv.set(dst, c, lines);
+	dst += lines * NV_LINE;
+	len -= lines * NV_LINE;
+
+	if (len) {
+		memset(dst, c, len);
+		g_nv.flush(dst, 1);
+	}
+}
@@ -0,0 +1,245 @@
+/*
+ * zus-pool.c - Object pools for FS objects like zus_inode_info & sbi
+ *
+ * A pool is a slab of cache-line aligned objects, with a per zu_thread
+ * magazine of free objects in front of it. The magazine is only touched by
+ * its own thread (zus_getztno()), so a hit costs no locks or atomics. Only
+ * when a magazine runs empty or full, half of it is moved from/to the pool's
+ * depot under the pool lock.
+ * Threads that are not zu_threads (the mount thread) go straight to the depot.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "zus.h"
+#include "b-minmax.h"
+
+#define ZUS_POOL_SLAB_SIZE	(64 * 1024)
+
+/* All pools, for zus_pool_print_all() */
+static struct zus_pool *g_pools;
+static pthread_mutex_t g_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Free objects and slabs are linked through their first word */
+struct _pool_link {
+	struct _pool_link *next;
+};
+
+int zus_pool_init(struct zus_pool *pool, const char *name, size_t obj_size)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	pool->obj_size = ALIGN(max_t(size_t, obj_size, sizeof(void *)),
+			       ZUS_CACHELINE_SIZE);
+	if (pool->obj_size > ZUS_POOL_SLAB_SIZE - ZUS_CACHELINE_SIZE) {
+		ERROR("%s: obj_size=%zu too big\n", name, obj_size);
+		return -EINVAL;
+	}
+
+	pool->nmags = zus_max_ztno();
+	pool->mags = aligned_alloc(ZUS_CACHELINE_SIZE,
+				   pool->nmags * sizeof(*pool->mags));
+	if (unlikely(!pool->mags))
+		return -ENOMEM;
+	memset(pool->mags, 0, pool->nmags * sizeof(*pool->mags));
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pthread_mutex_lock(&g_pools_lock);
+	pool->next = g_pools;
+	g_pools = pool;
+	pthread_mutex_unlock(&g_pools_lock);
+
+	return 0;
+}
+
+/* Frees all the objects of the pool, even those not returned */
+void zus_pool_fini(struct zus_pool *pool)
+{
+	struct zus_pool **pp;
+
+	if (!pool->mags)
+		return;
+
+	pthread_mutex_lock(&g_pools_lock);
+	for (pp = &g_pools; *pp; pp = &(*pp)->next) {
+		if (*pp == pool) {
+			*pp = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_pools_lock);
+
+	while (pool->slabs) {
+		struct _pool_link *slab = pool->slabs;
+
+		pool->slabs = slab->next;
+		free(slab);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->mags);
+	pool->mags = NULL;
+}
+
+/* Call with pool->lock held */
+static int _pool_grow(struct zus_pool *pool)
+{
+	struct _pool_link *slab;
+	void *obj, *end;
+
+	slab = aligned_alloc(ZUS_CACHELINE_SIZE, ZUS_POOL_SLAB_SIZE);
+	if (unlikely(!slab))
+		return -ENOMEM;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	++pool->nr_slabs;
+
+	/* First cache-line is the slab link */
+	obj = (void *)slab + ZUS_CACHELINE_SIZE;
+	end = (void *)slab + ZUS_POOL_SLAB_SIZE;
+	for (; obj + pool->obj_size <= end; obj += pool->obj_size) {
+		struct _pool_link *link = obj;
+
+		link->next = pool->free_list;
+		pool->free_list = link;
+	}
+
+	return 0;
+}
+
+/* Call with pool->lock held */
+static void *_depot_get(struct zus_pool *pool)
+{
+	struct _pool_link *link = pool->free_list;
+
+	if (!link) {
+		if (unlikely(_pool_grow(pool)))
+			return NULL;
+		link = pool->free_list;
+	}
+
+	pool->free_list = link->next;
+	return link;
+}
+
+/* Call with pool->lock held */
+static void _depot_put(struct zus_pool *pool, void *obj)
+{
+	struct _pool_link *link = obj;
+
+	link->next = pool->free_list;
+	pool->free_list = link;
+}
+
+static struct zus_pool_mag *_my_mag(struct zus_pool *pool)
+{
+	int ztno = zus_getztno();
+
+	if (unlikely(ztno < 0 || (uint)ztno >= pool->nmags))
+		return NULL;
+	return &pool->mags[ztno];
+}
+
+void *zus_pool_alloc(struct zus_pool *pool)
+{
+	struct zus_pool_mag *mag = _my_mag(pool);
+	void *obj;
+
+	if (likely(mag && mag->count)) {
+		++mag->hits;
+		return mag->objs[--mag->count];
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (!mag) {
+		++pool->misses;
+		obj = _depot_get(pool);
+		goto out;
+	}
+
+	++mag->misses;
+	/* Refill half a magazine while we have the lock */
+	while (mag->count < ZUS_POOL_MAG_SIZE / 2) {
+		obj = _depot_get(pool);
+		if (unlikely(!obj))
+			break;
+		mag->objs[mag->count++] = obj;
+	}
+	obj = mag->count ? mag->objs[--mag->count] : NULL;
+
+out:
+	pthread_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+void zus_pool_free(struct zus_pool *pool, void *obj)
+{
+	struct zus_pool_mag *mag = _my_mag(pool);
+
+	if (unlikely(!obj))
+		return;
+
+	if (likely(mag && mag->count < ZUS_POOL_MAG_SIZE)) {
+		mag->objs[mag->count++] = obj;
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (mag) {
+		/* Flush half the magazine */
+		while (mag->count > ZUS_POOL_MAG_SIZE / 2)
+			_depot_put(pool, mag->objs[--mag->count]);
+		mag->objs[mag->count++] = obj;
+	} else {
+		_depot_put(pool, obj);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Magazine counters are read racy, which is fine for statistics */
+void zus_pool_get_stats(struct zus_pool *pool, struct zus_pool_stats *zps)
+{
+	uint i;
+
+	pthread_mutex_lock(&pool->lock);
+	zps->obj_size = pool->obj_size;
+	zps->slabs = pool->nr_slabs;
+	zps->misses = pool->misses;
+	zps->hits = 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nmags; ++i) {
+		zps->hits += __atomic_load_n(&pool->mags[i].hits,
+					     __ATOMIC_RELAXED);
+		zps->misses += __atomic_load_n(&pool->mags[i].misses,
+					       __ATOMIC_RELAXED);
+	}
+}
+
+void zus_pool_print_all(void)
+{
+	struct zus_pool *pool;
+
+	pthread_mutex_lock(&g_pools_lock);
+	for (pool = g_pools; pool; pool = pool->next) {
+		struct zus_pool_stats zps;
+
+		zus_pool_get_stats(pool, &zps);
+		INFO("pool %-16s obj_size=%lu slabs=%lu hits=%lu misses=%lu\n",
+		     pool->name, zps.obj_size, zps.slabs, zps.hits,
+		     zps.misses);
+	}
+	pthread_mutex_unlock(&g_pools_lock);
+}
@@ -0,0 +1,133 @@
+/*
+ * zus-trace.c - zustrace, decoder of the zus --trace dump files
+ *
+ * usage: zustrace /tmp/zus-trace.PID
+ *
+ * Prints the operations of all threads merged in time order, time is in
+ * micro-seconds from the first operation in the file.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * ZUFS-License: BSD-3-Clause. See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Boaz Harrosh <boaz@plexistor.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "zusd.h"
+
+bool g_DBG = false;
+
+struct _tent {
+	struct zus_trace_ent zte;
+	uint ztno;
+};
+
+static int _tent_cmp(const void *a, const void *b)
+{
+	const struct _tent *ta = a, *tb = b;
+
+	if (ta->zte.start_ns != tb->zte.start_ns)
+		return ta->zte.start_ns < tb->zte.start_ns ? -1 : 1;
+	return (int)ta->ztno - (int)tb->ztno;
+}
+
+static const char *_op_name(struct zus_trace_file_hdr *fhdr, uint op)
+{
+	const char *name;
+
+	if (op >= fhdr->nops || op >= ZUS_STATS_MAX_OP)
+		return "UNKNOWN";
+
+	name = fhdr->op_names[op];
+	return strncmp(name, "ZUS_OP_", 7) ? name : name + 7;
+}
+
+int main(int argc, char *argv[])
+{
+	struct zus_trace_file_hdr *fhdr = NULL;
+	struct _tent *tents = NULL;
+	ulong n = 0, i;
+	FILE *f = NULL;
+	uint r;
+	int err = 1;
+
+	if (argc != 2) {
+		printf("usage: zustrace /tmp/zus-trace.PID\n");
+		return 1;
+	}
+
+	f = fopen(argv[1], "r");
+	fhdr = malloc(sizeof(*fhdr));
+	if (!f || !fhdr) {
+		ERROR("%s: %s\n", argv[1], strerror(errno));
+		goto out;
+	}
+
+	if (fread(fhdr, sizeof(*fhdr), 1, f) != 1 ||
+	    fhdr->magic != ZUS_TRACE_MAGIC ||
+	    fhdr->version != ZUS_TRACE_VERSION ||
+	    fhdr->ent_size != sizeof(struct zus_trace_ent)) {
+		ERROR("%s: not a zus trace file (version %d)\n", argv[1],
+		      ZUS_TRACE_VERSION);
+		goto out;
+	}
+
+	for (r = 0; r < fhdr->nrings; ++r) {
+		struct zus_trace_ring_hdr rhdr;
+		struct _tent *t;
+
+		if (fread(&rhdr, sizeof(rhdr), 1, f) != 1)
+			goto trunc;
+
+		printf("# thread %u cpu %d: %llu operations, %llu lost\n",
+		       rhdr.ztno, rhdr.cpu, (unsigned long long)rhdr.count,
+		       (unsigned long long)rhdr.lost);
+
+		t = realloc(tents, (n + rhdr.count) * sizeof(*tents));
+		if (!t) {
+			ERROR("no memory for %llu entries\n",
+			      (unsigned long long)(n + rhdr.count));
+			goto out;
+		}
+		tents = t;
+
+		for (i = 0; i < rhdr.count; ++i, ++n) {
+			if (fread(&tents[n].zte, sizeof(tents[n].zte), 1, f) != 1)
+				goto trunc;
+			tents[n].ztno = rhdr.ztno;
+		}
+	}
+
+	qsort(tents, n, sizeof(*tents), _tent_cmp);
+
+	printf("# %12s %4s %-16s %10s %5s %10s %18s %18s\n", "usec", "thr",
+	       "op", "dur_ns", "err", "ino", "off", "len");
+	for (i = 0; i < n; ++i) {
+		struct zus_trace_ent *zte = &tents[i].zte;
+
+		printf("%14.3f %4u %-16s %10u %5d %10llu 0x%016llx 0x%016llx\n",
+		       (zte->start_ns - tents[0].zte.start_ns) / 1000.0,
+		       tents[i].ztno, _op_name(fhdr, zte->op), zte->dur_ns,
+		       zte->err, (unsigned long long)zte->ino,
+		       (unsigned long long)zte->off,
+		       (unsigned long long)zte->len);
+	}
+
+	err = 0;
+	goto out;
+
+trunc:
+	ERROR("%s: truncated\n", argv[1]);
+out:
+	free(tents);
+	free(fhdr);
+	if (f)
+		fclose(f);
+	return err;
+}
@@ -12,32 +12,380 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "zus.h"
+#include "zusd.h"
 #include "zuf_call.h"
+#include "b-minmax.h"
 
 /* ~~~ mount stuff ~~~ */
 
-static int _pmem_mmap(struct zus_pmem *pmem)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23	/* Linux 5.14 */
+#endif
+
+#define ZUS_PAGES_ALIGN		(2UL << 20)	/* A huge page */
+
+/* Map the pmem file at a 2^@shift aligned address, so the Kernel can use
+ * PMD (2M) or PUD (1G) entries for it. A bigger anonymous range is reserved
+ * and the file is mapped over its aligned part.
+ */
+static void *_mmap_aligned(size_t size, int prot, int fd, uint shift)
 {
+	size_t align = 1UL << shift;
+	char *resv, *start;
+	int err;
+
+	resv = mmap(NULL, size + align, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (resv == MAP_FAILED)
+		return MAP_FAILED;
+
+	start = (char *)ALIGN((ulong)resv, align);
+	if (mmap(start, size, prot,
+		 MAP_SHARED | MAP_FIXED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0) ==
+	    MAP_FAILED) {
+		err = errno;
+		munmap(resv, size + align);
+		errno = err;
+		return MAP_FAILED;
+	}
+
+	if (start > resv)
+		munmap(resv, start - resv);
+	munmap(start + size, resv + align - start);
+	return start;
+}
+
+static int _pmem_mmap(struct zus_pmem *pmem, uint shift)
+{
+	size_t size = pmem_p2o(pmem_blocks(pmem));
 	int prot = PROT_WRITE | PROT_READ;
-	int flags = MAP_SHARED;
+	int flags = MAP_SHARED | (pmem->fd < 0 ? MAP_ANONYMOUS : 0);
+	void *addr;
+
+	if (!size)
+		return 0;
 
-	pmem->p_pmem_addr = mmap(NULL, pmem_p2o(pmem_blocks(pmem)), prot, flags,
-				 pmem->fd, 0);
-	if (!pmem->p_pmem_addr) {
+	if (shift > PAGE_SHIFT)
+		addr = _mmap_aligned(size, prot, pmem->fd, shift);
+	else
+		addr = mmap(NULL, size, prot, flags, pmem->fd, 0);
+	if (addr == MAP_FAILED) {
 		ERROR("mmap failed=> %d: %s\n", errno, strerror(errno));
 		return errno ?: ENOMEM;
 	}
 
+	pmem->p_pmem_addr = addr;
 	return 0;
 }
 
-static int _pmem_grab(struct zus_sb_info *sbi, uint pmem_kern_id)
+static void _pmem_munmap(struct zus_pmem *pmem)
+{
+	if (pmem->p_pmem_addr)
+		munmap(pmem->p_pmem_addr, pmem_p2o(pmem_blocks(pmem)));
+	pmem->p_pmem_addr = NULL;
+}
+
+static void _prefault_run(void *arg, ulong bn, ulong end)
+{
+	struct zus_pmem *pmem = arg;
+	char *p = pmem->p_pmem_addr + pmem_p2o(bn);
+	ulong len = pmem_p2o(end - bn);
+	ulong off;
+
+	if (!madvise(p, len, MADV_POPULATE_WRITE))
+		return;
+
+	/* Older Kernel, write-fault each page without changing it */
+	for (off = 0; off < len; off += PAGE_SIZE)
+		__atomic_fetch_or(p + off, 0, __ATOMIC_RELAXED);
+}
+
+/* Fault in all of the pmem from all zu_thread CPUs in parallel, instead of
+ * one fault at a time under the first operations after mount. Each CPU
+ * faults in its NUMA-local pmem, so the page tables are local too.
+ */
+static void _pmem_prefault(struct zus_pmem *pmem)
+{
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	zus_pmem_parallel_for(pmem, 0, pmem_blocks(pmem), _prefault_run, pmem);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	INFO("pmem prefault %luM in %ldms\n", pmem_p2o(pmem_blocks(pmem)) >> 20,
+	     (t1.tv_sec - t0.tv_sec) * 1000 +
+	     (t1.tv_nsec - t0.tv_nsec) / 1000000);
+}
+
+/* Report from smaps how the Kernel mapped the pmem. The page size of the
+ * mapping is fixed, the huge entries (PMD/PUD) show in the *PmdMapped
+ * counters once faulted in.
+ */
+static void _pmem_map_report(struct zus_pmem *pmem, uint shift)
+{
+	ulong start = (ulong)pmem->p_pmem_addr, vstart, vend;
+	ulong mmu_kb = 0, rss_kb = 0, huge_kb = 0, val;
+	bool ours = false;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (unlikely(!f))
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &vstart, &vend) == 2) {
+			if (ours)
+				break;
+			ours = (vstart == start);
+			continue;
+		}
+		if (!ours)
+			continue;
+
+		if (sscanf(line, "MMUPageSize: %lu kB", &val) == 1)
+			mmu_kb = val;
+		else if (sscanf(line, "Rss: %lu kB", &val) == 1)
+			rss_kb = val;
+		else if (sscanf(line, "FilePmdMapped: %lu kB", &val) == 1 ||
+			 sscanf(line, "ShmemPmdMapped: %lu kB", &val) == 1 ||
+			 sscanf(line, "AnonHugePages: %lu kB", &val) == 1 ||
+			 sscanf(line, "Private_Hugetlb: %lu kB", &val) == 1 ||
+			 sscanf(line, "Shared_Hugetlb: %lu kB", &val) == 1)
+			huge_kb += val;
+	}
+	fclose(f);
+
+	INFO("pmem mapped at %p align=%luK page=%luK rss=%luK huge=%luK\n",
+	     pmem->p_pmem_addr, shift > PAGE_SHIFT ? (1UL << shift) >> 10 :
+						     PAGE_SIZE >> 10,
+	     mmu_kb, rss_kb, huge_kb);
+}
+
+/* Ask the Kernel on which node each pmem chunk lives. We use the raw
+ * move_pages(2) in query mode (no libnuma). A chunk's first page must be
+ * faulted in for it to be reported, so we touch it.
+ * On any failure numa_map stays NULL and every block is on node 0.
+ */
+static void _pmem_numa_map(struct zus_pmem *pmem)
+{
+	ulong nchunks = (pmem_blocks(pmem) >> ZUS_NUMA_CHUNK_SHIFT) + 1;
+	void **pages = malloc(nchunks * sizeof(*pages));
+	int *status = malloc(nchunks * sizeof(*status));
+	uint max_node = 0;
+	ulong c;
+	long err;
+
+	if (unlikely(!pages || !status))
+		goto out;
+
+	for (c = 0; c < nchunks; ++c) {
+		ulong bn = min_t(ulong, c << ZUS_NUMA_CHUNK_SHIFT,
+				 pmem_blocks(pmem) - 1);
+
+		pages[c] = pmem->p_pmem_addr + pmem_p2o(bn);
+		(void)*(volatile char *)pages[c];
+	}
+
+	err = syscall(SYS_move_pages, 0, nchunks, pages, NULL, status, 0);
+	if (unlikely(err)) {
+		DBG("move_pages => %d: %s\n", errno, strerror(errno));
+		goto out;
+	}
+
+	pmem->numa_map = malloc(nchunks);
+	if (unlikely(!pmem->numa_map))
+		goto out;
+
+	for (c = 0; c < nchunks; ++c) {
+		pmem->numa_map[c] = status[c] < 0 ? 0 : status[c];
+		max_node = max_t(uint, max_node, pmem->numa_map[c]);
+	}
+	DBG("pmem numa_map chunks=%lu max_node=%u\n", nchunks, max_node);
+
+out:
+	free(status);
+	free(pages);
+}
+
+static void _pages_set_numa(struct zus_pmem *pmem, ulong chunk)
+{
+	ulong first = chunk << ZUS_NUMA_CHUNK_SHIFT;
+	ulong last = min_t(ulong, first + (1UL << ZUS_NUMA_CHUNK_SHIFT),
+			   pmem_blocks(pmem));
+	ulong bn;
+
+	for (bn = first; bn < last; ++bn) {
+		struct zus_pmem_page *page =
+			pmem->pages.ptr + bn * pmem->user_page_size;
+
+		page->flags = (page->flags & ~ZUS_PAGE_NUMA_MASK) |
+			      pmem_numa_id(pmem, bn);
+	}
+}
+
+static bool _pages_ready(struct zus_pmem_pages *pp, ulong chunk)
+{
+	return __atomic_load_n(&pp->ready[chunk / (sizeof(ulong) * 8)],
+			       __ATOMIC_ACQUIRE) &
+	       (1UL << (chunk % (sizeof(ulong) * 8)));
+}
+
+/* The chunks not yet materialized get it when they are */
+void pmem_set_numa_id_in_pages(struct zus_pmem *pmem)
+{
+	struct zus_pmem_pages *pp = &pmem->pages;
+	ulong chunk;
+
+	if (!pmem->user_page_size)
+		return;
+
+	pthread_mutex_lock(&pp->lock);
+	for (chunk = 0; chunk <= pmem_blocks(pmem) >> ZUS_NUMA_CHUNK_SHIFT;
+	     ++chunk)
+		if (_pages_ready(pp, chunk))
+			_pages_set_numa(pmem, chunk);
+	pthread_mutex_unlock(&pp->lock);
+}
+
+/* The anonymous memory is zero when first touched, only the numa_id is
+ * set here.
+ */
+void zus_pmem_pages_populate(struct zus_pmem *pmem, ulong chunk)
+{
+	struct zus_pmem_pages *pp = &pmem->pages;
+
+	pthread_mutex_lock(&pp->lock);
+	if (!_pages_ready(pp, chunk)) {
+		_pages_set_numa(pmem, chunk);
+		__atomic_fetch_or(&pp->ready[chunk / (sizeof(ulong) * 8)],
+				  1UL << (chunk % (sizeof(ulong) * 8)),
+				  __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pp->lock);
+}
+
+/* Free bytes in the default hugetlb pool, 0 if none */
+static ulong _hugetlb_free(void)
+{
+	ulong nfree = 0, kb = 0, val;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (unlikely(!f))
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "HugePages_Free: %lu", &val) == 1)
+			nfree = val;
+		else if (sscanf(line, "Hugepagesize: %lu kB", &val) == 1)
+			kb = val;
+	}
+	fclose(f);
+
+	return nfree * kb * 1024;
+}
+
+/* Reserve the address range of all the pages. Backed by hugetlb when the
+ * system has a big enough pool of huge pages, else by anonymous memory
+ * (THP where possible). Nothing is faulted in here, and neither mapping
+ * holds a reservation, so only the chunks in use take memory. A hugetlb
+ * pool that others drained meanwhile fails the first touch with SIGBUS.
+ */
+static int _pmem_pages_alloc(struct zus_pmem *pmem)
+{
+	struct zus_pmem_pages *pp = &pmem->pages;
+	ulong nchunks = (pmem_blocks(pmem) >> ZUS_NUMA_CHUNK_SHIFT) + 1;
+	int prot = PROT_WRITE | PROT_READ;
+
+	pp->size = ALIGN(pmem_blocks(pmem) * pmem->user_page_size,
+			 ZUS_PAGES_ALIGN);
+	pp->ready = calloc(ALIGN(nchunks, sizeof(ulong) * 8) / 8, 1);
+	if (unlikely(!pp->ready))
+		return ENOMEM;
+
+	pp->ptr = MAP_FAILED;
+	if (_hugetlb_free() >= pp->size)
+		pp->ptr = mmap(NULL, pp->size, prot,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			       MAP_NORESERVE, -1, 0);
+	pp->hugetlb = (pp->ptr != MAP_FAILED);
+	if (!pp->hugetlb) {
+		pp->ptr = mmap(NULL, pp->size, prot,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			       -1, 0);
+		if (pp->ptr == MAP_FAILED) {
+			ERROR("mmap pages size=%zu => %d: %s\n", pp->size,
+			      errno, strerror(errno));
+			pp->ptr = NULL;
+			free(pp->ready);
+			pp->ready = NULL;
+			return errno ?: ENOMEM;
+		}
+		madvise(pp->ptr, pp->size, MADV_HUGEPAGE);
+	}
+
+	pthread_mutex_init(&pp->lock, NULL);
+	DBG("pmem pages %zuK at %p hugetlb=%d\n", pp->size >> 10, pp->ptr,
+	    pp->hugetlb);
+	return 0;
+}
+
+static void _pmem_pages_free(struct zus_pmem *pmem)
+{
+	struct zus_pmem_pages *pp = &pmem->pages;
+
+	if (!pp->ptr)
+		return;
+
+	munmap(pp->ptr, pp->size);
+	pthread_mutex_destroy(&pp->lock);
+	free(pp->ready);
+	memset(pp, 0, sizeof(*pp));
+}
+
+ulong pmem_numa_hint(struct zus_pmem *pmem, int node, ulong first,
+		     ulong last, uint slot, uint nslots)
+{
+	ulong c, c_first, c_last, count = 0, pos;
+
+	if (unlikely(last <= first || !nslots))
+		return first;
+
+	c_first = first >> ZUS_NUMA_CHUNK_SHIFT;
+	c_last = (last - 1) >> ZUS_NUMA_CHUNK_SHIFT;
+	if (pmem->numa_map && node >= 0)
+		for (c = c_first; c <= c_last; ++c)
+			count += (pmem->numa_map[c] == node);
+
+	if (!count)
+		return first + (last - first) / nslots * (slot % nslots);
+
+	/* The slot's position within all the blocks on @node */
+	pos = (count << ZUS_NUMA_CHUNK_SHIFT) / nslots * (slot % nslots);
+	for (c = c_first; c <= c_last; ++c) {
+		if (pmem->numa_map[c] != node)
+			continue;
+		if (pos < (1UL << ZUS_NUMA_CHUNK_SHIFT))
+			break;
+		pos -= 1UL << ZUS_NUMA_CHUNK_SHIFT;
+	}
+
+	pos = max_t(ulong, pos + (c << ZUS_NUMA_CHUNK_SHIFT), first);
+	return min_t(ulong, pos, last - 1);
+}
+
+static int _pmem_grab_kern(struct zus_pmem *pmem, uint pmem_kern_id)
 {
-	struct zus_pmem *pmem = &sbi->pmem;
 	int err;
 
 	err = zuf_root_open_tmp(&pmem->fd);
@@ -51,42 +399,376 @@ static int _pmem_grab(struct zus_sb_info *sbi, uint pmem_kern_id)
 	if (!pmem_blocks(pmem))
 		INFO("pmem with zero blocks pmem_kern_id=%u\n", pmem_kern_id);
 
-	err = ftruncate(pmem->fd, pmem_p2o(pmem_blocks(pmem)));
-	if (unlikely(err))
-		return err;
+	return ftruncate(pmem->fd, pmem_p2o(pmem_blocks(pmem)));
+}
 
-	err = _pmem_mmap(pmem);
+/* The pmem of @pmem_kern_id from the Kernel, or with @dram_blocks that many
+ * blocks of anonymous memory and no Kernel at all.
+ */
+static int _pmem_grab(struct zus_sb_info *sbi, uint pmem_kern_id,
+		      ulong dram_blocks)
+{
+	const struct thread_param *tp = zus_thread_param();
+	struct zus_pmem *pmem = &sbi->pmem;
+	int err;
+
+	if (dram_blocks) {
+		pmem->fd = -1;
+		pmem->pmem_info.pmem_kern_id = pmem_kern_id;
+		pmem->pmem_info.pmem_total_blocks = dram_blocks;
+	} else {
+		err = _pmem_grab_kern(pmem, pmem_kern_id);
+		if (unlikely(err))
+			return err;
+	}
+
+	err = _pmem_mmap(pmem, tp ? tp->pmem_huge_shift : 0);
 	if (unlikely(err))
 		return err;
 
+	if (pmem_blocks(pmem)) {
+		_pmem_numa_map(pmem);
+		if (tp && tp->pmem_prefault)
+			_pmem_prefault(pmem);
+		if (tp && (tp->pmem_huge_shift || tp->pmem_prefault))
+			_pmem_map_report(pmem, tp->pmem_huge_shift);
+	}
+
 	pmem->user_page_size = sbi->zfi->user_page_size;
 	if (!pmem->user_page_size)
 		return 0; /* User does not want pages */
 
-	err = fba_alloc(&pmem->pages, pmem_blocks(pmem) * pmem->user_page_size);
-
-	return err;
+	return _pmem_pages_alloc(pmem);
 }
 
 static void _pmem_ungrab(struct zus_sb_info *sbi)
 {
 	/* Kernel makes free easy (close couple files) */
-	fba_free(&sbi->pmem.pages);
+	_pmem_pages_free(&sbi->pmem);
+	free(sbi->pmem.numa_map);
+	sbi->pmem.numa_map = NULL;
 
+	_pmem_munmap(&sbi->pmem);
 	zuf_root_close(&sbi->pmem.fd);
-	sbi->pmem.p_pmem_addr = NULL;
+}
+
+/* ~~~ zii cache ~~~ */
+
+/* All the live zii's of an sbi by ino, with a reference for each zus_iget.
+ * A hot lookup gets the cached zii with no FS iget, and racing lookups of
+ * the same ino end up with the same zii. Sharded by ino, each shard a
+ * spinlock and a chained hash table that doubles as it fills.
+ */
+#define ZUS_ZIIC_SHARDS		64
+#define ZUS_ZIIC_BUCKETS	64	/* Initial, per shard */
+
+struct zus_ziic_shard {
+	pthread_spinlock_t lock;
+	struct zus_inode_info **buckets;
+	ulong nbuckets;		/* Power of 2 */
+	ulong count;
+} __attribute__((aligned(ZUS_CACHELINE_SIZE)));
+
+struct zus_ziic {
+	struct zus_ziic_shard shards[ZUS_ZIIC_SHARDS];
+};
+
+static inline ulong _ziic_hash(ulong ino)
+{
+	return ino * 0x9e3779b97f4a7c15UL;
+}
+
+static struct zus_ziic_shard *_ziic_shard(struct zus_ziic *ziic, ulong ino)
+{
+	return &ziic->shards[(_ziic_hash(ino) >> 58) % ZUS_ZIIC_SHARDS];
+}
+
+static struct zus_inode_info **_ziic_bucket(struct zus_ziic_shard *zs,
+					    ulong ino)
+{
+	return &zs->buckets[_ziic_hash(ino) & (zs->nbuckets - 1)];
+}
+
+/* At umount. Whatever the Kernel did not evict is dropped here */
+static void _ziic_fini(struct zus_sb_info *sbi)
+{
+	struct zus_ziic *ziic = sbi->ziic;
+	uint i;
+
+	if (!ziic)
+		return;
+
+	for (i = 0; i < ZUS_ZIIC_SHARDS; ++i) {
+		struct zus_ziic_shard *zs = &ziic->shards[i];
+		ulong b;
+
+		for (b = 0; zs->buckets && b < zs->nbuckets; ++b) {
+			struct zus_inode_info *zii = zs->buckets[b];
+
+			while (zii) {
+				struct zus_inode_info *next = zii->ziic_next;
+
+				if (zii->op->evict)
+					zii->op->evict(zii);
+				sbi->op->zii_free(zii);
+				zii = next;
+			}
+		}
+		free(zs->buckets);
+		pthread_spin_destroy(&zs->lock);
+	}
+
+	free(ziic);
+	sbi->ziic = NULL;
+}
+
+static int _ziic_init(struct zus_sb_info *sbi)
+{
+	struct zus_ziic *ziic = aligned_alloc(ZUS_CACHELINE_SIZE,
+					      sizeof(*ziic));
+	uint i;
+
+	if (unlikely(!ziic))
+		return -ENOMEM;
+
+	memset(ziic, 0, sizeof(*ziic));
+	for (i = 0; i < ZUS_ZIIC_SHARDS; ++i) {
+		struct zus_ziic_shard *zs = &ziic->shards[i];
+
+		pthread_spin_init(&zs->lock, PTHREAD_PROCESS_PRIVATE);
+		zs->nbuckets = ZUS_ZIIC_BUCKETS;
+		zs->count = 0;
+		zs->buckets = calloc(zs->nbuckets, sizeof(*zs->buckets));
+		if (unlikely(!zs->buckets)) {
+			sbi->ziic = ziic;
+			_ziic_fini(sbi);
+			return -ENOMEM;
+		}
+	}
+
+	sbi->ziic = ziic;
+	return 0;
+}
+
+/* Call with zs->lock held */
+static struct zus_inode_info *_ziic_find(struct zus_ziic_shard *zs,
+					 ulong ino)
+{
+	struct zus_inode_info *zii = *_ziic_bucket(zs, ino);
+
+	while (zii && zii->ziic_ino != ino)
+		zii = zii->ziic_next;
+	return zii;
+}
+
+/* Call with zs->lock held */
+static void _ziic_unlink(struct zus_ziic_shard *zs, struct zus_inode_info *zii)
+{
+	struct zus_inode_info **pp = _ziic_bucket(zs, zii->ziic_ino);
+
+	while (*pp != zii)
+		pp = &(*pp)->ziic_next;
+	*pp = zii->ziic_next;
+	zii->ziic_next = NULL;
+	zii->ziic_ino = 0;
+	--zs->count;
+}
+
+/* Double the buckets of a shard that got full. Allocates outside the lock,
+ * another thread may have grown it meanwhile.
+ */
+static void _ziic_grow(struct zus_ziic_shard *zs, ulong nbuckets)
+{
+	struct zus_inode_info **buckets = calloc(nbuckets * 2,
+						 sizeof(*buckets));
+	struct zus_inode_info **old;
+	ulong b;
+
+	if (unlikely(!buckets))
+		return; /* Longer chains, still correct */
+
+	pthread_spin_lock(&zs->lock);
+	if (zs->nbuckets != nbuckets) {
+		pthread_spin_unlock(&zs->lock);
+		free(buckets);
+		return;
+	}
+
+	old = zs->buckets;
+	zs->buckets = buckets;
+	zs->nbuckets = nbuckets * 2;
+	for (b = 0; b < nbuckets; ++b) {
+		struct zus_inode_info *zii = old[b];
+
+		while (zii) {
+			struct zus_inode_info *next = zii->ziic_next;
+			struct zus_inode_info **bucket =
+					_ziic_bucket(zs, zii->ziic_ino);
+
+			zii->ziic_next = *bucket;
+			*bucket = zii;
+			zii = next;
+		}
+	}
+	pthread_spin_unlock(&zs->lock);
+	free(old);
+}
+
+/* Adds @zii with one reference. If @ino is already cached returns that one
+ * with a new reference instead, and @zii is not added.
+ */
+static struct zus_inode_info *_ziic_insert(struct zus_ziic *ziic,
+					   struct zus_inode_info *zii,
+					   ulong ino)
+{
+	struct zus_ziic_shard *zs = _ziic_shard(ziic, ino);
+	struct zus_inode_info *found, **bucket;
+	ulong grow = 0;
+
+	pthread_spin_lock(&zs->lock);
+	found = _ziic_find(zs, ino);
+	if (unlikely(found)) {
+		__atomic_add_fetch(&found->ziic_refs, 1, __ATOMIC_RELAXED);
+	} else {
+		bucket = _ziic_bucket(zs, ino);
+		zii->ziic_ino = ino;
+		zii->ziic_refs = 1;
+		zii->ziic_next = *bucket;
+		*bucket = zii;
+		if (++zs->count > zs->nbuckets * 2)
+			grow = zs->nbuckets;
+	}
+	pthread_spin_unlock(&zs->lock);
+
+	if (unlikely(grow))
+		_ziic_grow(zs, grow);
+	return found;
+}
+
+/* Drops a reference, the last one evicts and frees @zii. @evict is false
+ * for a freed inode, the FS free_inode did it all.
+ */
+static void _zii_put(struct zus_inode_info *zii, bool evict)
+{
+	struct zus_sb_info *sbi = zii->sbi;
+	struct zus_ziic_shard *zs = NULL;
+	int refs;
+
+	if (zii->ziic_ino && sbi->ziic) {
+		zs = _ziic_shard(sbi->ziic, zii->ziic_ino);
+		pthread_spin_lock(&zs->lock);
+	}
+
+	/* Atomic, an unhashed zii is put with no lock */
+	refs = __atomic_sub_fetch(&zii->ziic_refs, 1, __ATOMIC_ACQ_REL);
+	if (!refs && zii->ziic_ino)
+		_ziic_unlink(zs, zii);
+
+	if (zs)
+		pthread_spin_unlock(&zs->lock);
+
+	if (refs > 0)
+		return;
+
+	if (evict && zii->op->evict)
+		zii->op->evict(zii);
+	sbi->op->zii_free(zii);
+}
+
+/* A freed inode's ino can be handed out again, while zii's of it are still
+ * referenced. So it leaves the cache now and is freed on the last put.
+ */
+static void _zii_unhash(struct zus_inode_info *zii)
+{
+	struct zus_ziic_shard *zs;
+
+	if (!zii->ziic_ino || !zii->sbi->ziic)
+		return;
+
+	zs = _ziic_shard(zii->sbi->ziic, zii->ziic_ino);
+	pthread_spin_lock(&zs->lock);
+	if (zii->ziic_ino)
+		_ziic_unlink(zs, zii);
+	pthread_spin_unlock(&zs->lock);
+}
+
+/* The new inode with the Kernel's reference */
+static void _zii_hash_new(struct zus_inode_info *zii)
+{
+	struct zus_inode_info *found;
+
+	zii->ziic_refs = 1;
+	if (unlikely(!zii->sbi->ziic))
+		return;
+
+	found = _ziic_insert(zii->sbi->ziic, zii, zi_ino(zii->zi));
+	if (unlikely(found)) {
+		/* A stale zii of a freed ino. It leaves the cache, it is
+		 * freed on its last put, and ours takes its place.
+		 */
+		ERROR("ino=%ld is cached zii=%p\n", zi_ino(zii->zi), found);
+		_zii_unhash(found);
+		_zii_put(found, true);
+
+		found = _ziic_insert(zii->sbi->ziic, zii, zi_ino(zii->zi));
+		if (unlikely(found)) {
+			/* Raced with another one, keep ours out */
+			_zii_put(found, true);
+			zii->ziic_refs = 1;
+		}
+	}
 }
 
 static void _zus_sbi_fini(struct zus_sb_info *sbi)
 {
-	// zus_iput(sbi->z_root); was this done already
+	_ziic_fini(sbi);
 	if (sbi->zfi->op->sbi_fini)
 		sbi->zfi->op->sbi_fini(sbi);
 	_pmem_ungrab(sbi);
 	sbi->zfi->op->sbi_free(sbi);
 }
 
-int zus_mount(int fd, struct zufs_ioc_mount *zim)
+/* All the mounted sbis. The mount thread adds and removes them while the
+ * mount workers tear down removed ones, and zus_umount_all() takes the
+ * rest at exit.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct zus_sb_info *first;
+	uint count;
+} g_sbis = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void _sbi_register(struct zus_sb_info *sbi)
+{
+	pthread_mutex_lock(&g_sbis.lock);
+	sbi->reg_next = g_sbis.first;
+	g_sbis.first = sbi;
+	++g_sbis.count;
+	pthread_mutex_unlock(&g_sbis.lock);
+}
+
+/* Returns false if @sbi is not mounted */
+static bool _sbi_unregister(struct zus_sb_info *sbi)
+{
+	struct zus_sb_info **pp;
+	bool found = false;
+
+	pthread_mutex_lock(&g_sbis.lock);
+	for (pp = &g_sbis.first; *pp; pp = &(*pp)->reg_next) {
+		if (*pp == sbi) {
+			*pp = sbi->reg_next;
+			--g_sbis.count;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_sbis.lock);
+	return found;
+}
+
+static int _zus_mount(struct zufs_ioc_mount *zim, ulong dram_blocks)
 {
 	struct zus_fs_info *zfi = zim->zus_zfi;
 	struct zus_sb_info *sbi;
@@ -94,12 +776,18 @@ int zus_mount(int fd, struct zufs_ioc_mount *zim)
 
 	sbi = zfi->op->sbi_alloc(zfi);
 	if (unlikely(!sbi)) {
-		err = -ENOMEM;
-		goto err;
+		zim->hdr.err = -ENOMEM;
+		return -ENOMEM;
 	}
 	sbi->zfi = zim->zus_zfi;
+	sbi->reg_next = NULL;
+	sbi->ziic = NULL;
+
+	err = _ziic_init(sbi);
+	if (unlikely(err))
+		goto err;
 
-	err = _pmem_grab(sbi, zim->pmem_kern_id);
+	err = _pmem_grab(sbi, zim->pmem_kern_id, dram_blocks);
 	if (unlikely(err))
 		goto err;
 
@@ -116,6 +804,7 @@ int zus_mount(int fd, struct zufs_ioc_mount *zim)
 	/* zim->zmp = sbi->zmp */
 	zim->s_blocksize_bits	= zim->s_blocksize_bits;
 
+	_sbi_register(sbi);
 	return 0;
 err:
 	zus_sbi_flag_set(sbi, ZUS_SBIF_ERROR);
@@ -124,33 +813,120 @@ err:
 	return err;
 }
 
+int zus_mount(int fd, struct zufs_ioc_mount *zim)
+{
+	return _zus_mount(zim, 0);
+}
+
+int zus_mount_dram(struct zufs_ioc_mount *zim, ulong blocks)
+{
+	if (unlikely(!blocks)) {
+		zim->hdr.err = -EINVAL;
+		return -EINVAL;
+	}
+
+	return _zus_mount(zim, blocks);
+}
+
+struct zus_sb_info *zus_umount_detach(struct zufs_ioc_mount *zim)
+{
+	if (unlikely(!_sbi_unregister(zim->zus_sbi))) {
+		ERROR("umount of unknown sbi=%p\n", zim->zus_sbi);
+		zim->hdr.err = -EINVAL;
+		return NULL;
+	}
+
+	return zim->zus_sbi;
+}
+
+void zus_sbi_teardown(struct zus_sb_info *sbi)
+{
+	_zus_sbi_fini(sbi);
+}
+
 int zus_umount(int fd, struct zufs_ioc_mount *zim)
 {
-	_zus_sbi_fini(zim->zus_sbi);
+	struct zus_sb_info *sbi = zus_umount_detach(zim);
+
+	if (unlikely(!sbi))
+		return -EINVAL;
+
+	zus_sbi_teardown(sbi);
 	return 0;
 }
 
+void zus_umount_all(void)
+{
+	struct zus_sb_info *sbi;
+
+	pthread_mutex_lock(&g_sbis.lock);
+	if (g_sbis.count)
+		INFO("umount of %u still mounted\n", g_sbis.count);
+	while ((sbi = g_sbis.first)) {
+		g_sbis.first = sbi->reg_next;
+		--g_sbis.count;
+		pthread_mutex_unlock(&g_sbis.lock);
+
+		_zus_sbi_fini(sbi);
+
+		pthread_mutex_lock(&g_sbis.lock);
+	}
+	pthread_mutex_unlock(&g_sbis.lock);
+}
+
 /* ~~~ FS operations ~~~~ */
 
 struct zus_inode_info *zus_iget(struct zus_sb_info *sbi, ulong ino)
 {
-	struct zus_inode_info *zii;
+	struct zus_inode_info *zii, *found;
+	struct zus_ziic_shard *zs;
 	int err;
 
+	if (likely(sbi->ziic)) {
+		zs = _ziic_shard(sbi->ziic, ino);
+		pthread_spin_lock(&zs->lock);
+		zii = _ziic_find(zs, ino);
+		if (zii)
+			__atomic_add_fetch(&zii->ziic_refs, 1, __ATOMIC_RELAXED);
+		pthread_spin_unlock(&zs->lock);
+		if (zii)
+			return zii;
+	}
+
 	zii = sbi->op->zii_alloc(sbi);
 	if (!zii)
 		return NULL;
 
 	zii->sbi = sbi;
+	zii->ziic_next = NULL;
+	zii->ziic_ino = 0;
+	zii->ziic_refs = 1;
 	err =  sbi->op->iget(sbi, zii, ino);
 	if (err) {
 		zii->sbi->op->zii_free(zii);
 		return NULL;
 	}
 
+	if (unlikely(!sbi->ziic))
+		return zii;
+
+	found = _ziic_insert(sbi->ziic, zii, ino);
+	if (unlikely(found)) {
+		/* Lost to another lookup of @ino. Like a ZI_LOOKUP_RACE the
+		 * FS saw an iget but gets no evict for it.
+		 */
+		sbi->op->zii_free(zii);
+		return found;
+	}
+
 	return zii;
 }
 
+void zus_iput(struct zus_inode_info *zii)
+{
+	_zii_put(zii, true);
+}
+
 static int _new_inode(void *app_ptr, struct zufs_ioc_hdr *hdr)
 {
 	struct zufs_ioc_new_inode *ioc_new = (void *)hdr;
@@ -163,6 +939,8 @@ static int _new_inode(void *app_ptr, struct zufs_ioc_hdr *hdr)
 		return -ENOMEM;
 
 	zii->sbi = sbi;
+	zii->ziic_next = NULL;
+	zii->ziic_ino = 0;
 
 	/* In ZUS protocol we start zero ref, add_dentry increments the refs
 	 * (Kernel gave us a 1 here expect for O_TMPFILE)
@@ -175,15 +953,16 @@ static int _new_inode(void *app_ptr, struct zufs_ioc_hdr *hdr)
 
 	ioc_new->_zi = pmem_addr_2_offset(&sbi->pmem, zii->zi);
 	ioc_new->zus_ii = zii;
+	zus_trace(zi_ino(ioc_new->dir_ii->zi), 0, zi_ino(zii->zi));
 
-	if (ioc_new->flags & ZI_TMPFILE)
-		return 0;
-
-	err = ioc_new->dir_ii->sbi->op->add_dentry(ioc_new->dir_ii, zii,
-						   &ioc_new->str);
-	if (unlikely(err))
-		goto _err_free_inode;
+	if (!(ioc_new->flags & ZI_TMPFILE)) {
+		err = ioc_new->dir_ii->sbi->op->add_dentry(ioc_new->dir_ii,
+							   zii, &ioc_new->str);
+		if (unlikely(err))
+			goto _err_free_inode;
+	}
 
+	_zii_hash_new(zii);
 	return 0;
 
 _err_free_inode:
@@ -204,22 +983,20 @@ static int _evict(struct zufs_ioc_hdr *hdr)
 	}
 
 	if (hdr->operation == ZUS_OP_FREE_INODE) {
+		_zii_unhash(zii);
 		zii->sbi->op->free_inode(zii);
+		_zii_put(zii, false);
 	} else { /* ZUS_OP_EVICT_INODE */
-		/* NOTE: On lookup Kernel ask's zus to allocate a new zii &&
-		 * retrieve the zi, before it inserts it to inode cache, it is
-		 * possible to race, and have two threads do a lookup. The
-		 * loosing thread calls _evict(ZI_LOOKUP_RACE) to de-allocate
-		 * the extra zii. But fs->evict need not be called. Only
-		 * zii_free.
-		 * (So it is possible at FS to see two fs->igets but one
-		 *  fs->evict)
+		/* NOTE: On lookup Kernel ask's zus for the zii && zi, before
+		 * it inserts it to inode cache, it is possible to race, and
+		 * have two threads do a lookup. The loosing thread calls
+		 * _evict(ZI_LOOKUP_RACE) to drop the extra reference. With
+		 * the zii cache both got the same zii, so it is a plain put
+		 * and the FS evict is only called on the last one.
 		 */
-		if (zii->op->evict && !(ziei->flags & ZI_LOOKUP_RACE))
-			zii->op->evict(zii);
+		_zii_put(zii, true);
 	}
 
-	zii->sbi->op->zii_free(zii);
 	return 0;
 }
 
@@ -230,6 +1007,7 @@ static int _lookup(struct zufs_ioc_hdr *hdr)
 	ulong ino;
 
 	ino  = lookup->dir_ii->sbi->op->lookup(lookup->dir_ii, &lookup->str);
+	zus_trace(zi_ino(lookup->dir_ii->zi), 0, ino);
 	if (!ino) {
 		DBG("[%.*s] NOT FOUND\n", lookup->str.len, lookup->str.name);
 		return -ENOENT;
@@ -294,6 +1072,7 @@ static int _io_read(ulong *app_ptr, struct zufs_ioc_hdr *hdr)
 	struct zufs_ioc_IO *io = (void *)hdr;
 	struct zus_inode_info *zii = io->zus_ii;
 
+	zus_trace(zi_ino(zii->zi), io->filepos, io->hdr.len);
 	return zii->op->read(app_ptr, io);
 }
 
@@ -302,6 +1081,7 @@ static int _io_write(ulong *app_ptr, struct zufs_ioc_hdr *hdr)
 	struct zufs_ioc_IO *io = (void *)hdr;
 	struct zus_inode_info *zii = io->zus_ii;
 
+	zus_trace(zi_ino(zii->zi), io->filepos, io->hdr.len);
 	return zii->op->write(app_ptr, io);
 }
 
@@ -316,6 +1096,7 @@ static int _get_block(struct zufs_ioc_hdr *hdr)
 		return -EIO;
 	}
 
+	zus_trace(zi_ino(zii->zi), get_block->index, get_block->rw);
 	err = 	zii->op->get_block(zii, get_block);
 	return err;
 }
@@ -327,6 +1108,9 @@ static int _symlink(struct zufs_ioc_hdr *hdr)
 	void *sym;
 	int err;
 
+	if (!zii->op->get_symlink)
+		return -ENOTSUP;
+
 	err = zii->op->get_symlink(zii, &sym);
 	if (unlikely(err))
 		return err;
@@ -392,9 +1176,9 @@ static int _statfs(struct zufs_ioc_hdr *hdr)
 	return sbi->op->statfs(sbi, ioc_statfs);
 }
 
-static const char *_op_name(int op)
+const char *zus_op_name(int op)
 {
-#define CASE_ENUM_NAME(e) case e: return "##e"
+#define CASE_ENUM_NAME(e) case e: return #e
 	switch  (op) {
 		CASE_ENUM_NAME(ZUS_OP_NEW_INODE		);
 		CASE_ENUM_NAME(ZUS_OP_FREE_INODE	);
@@ -425,7 +1209,7 @@ static const char *_op_name(int op)
 int zus_do_command(void *app_ptr, struct zufs_ioc_hdr *hdr)
 {
 	DBG("[%s] OP=%d off=0x%x len=0x%x\n",
-	    _op_name(hdr->operation), hdr->operation, hdr->offset, hdr->len);
+	    zus_op_name(hdr->operation), hdr->operation, hdr->offset, hdr->len);
 
 	switch(hdr->operation) {
 	case ZUS_OP_NEW_INODE:
@@ -477,19 +1261,38 @@ int zus_do_command(void *app_ptr, struct zufs_ioc_hdr *hdr)
 }
 
 /* ~~~~ zuf_fs_info stuff ~~~~~ */
+#define ZUS_MAX_FS	8
+
+static struct zus_fs_info *g_zfis[ZUS_MAX_FS];
+static uint g_num_zfis;
+
+/* With @fd < 0 the FS is only known to zus, no Kernel */
 int zus_register_one(int fd, struct zus_fs_info *zfi)
 {
 	int err;
 
-	/* add zfi on a global list ?? */
-
-	err = zuf_register_fs(fd, zfi);
-	if (err)
-		return err;
+	if (fd >= 0) {
+		err = zuf_register_fs(fd, zfi);
+		if (err)
+			return err;
+	}
 
+	if (g_num_zfis < ZUS_MAX_FS)
+		g_zfis[g_num_zfis++] = zfi;
 	return 0;
 }
 
+struct zus_fs_info *zus_find_fs(const char *fsname)
+{
+	uint i;
+
+	for (i = 0; i < g_num_zfis; ++i)
+		if (!strncmp(g_zfis[i]->rfi.fsname, fsname,
+			     sizeof(g_zfis[i]->rfi.fsname)))
+			return g_zfis[i];
+	return NULL;
+}
+
 /* TODO: We need some registry of all fss to load */
 int zus_register_all(int fd)
 {
@@ -503,26 +1306,67 @@ int  fba_alloc(struct fba *fba, size_t size)
 {
 	/* Our buffers are allocated from a tmpfile so all is aligned and easy
 	 */
+	int err;
+
+	fba->ptr = NULL;
+	fba->size = size;
 	fba->fd = open("/tmp/", O_RDWR | O_TMPFILE | O_EXCL, 0666);
 	if (fba->fd < 0) {
 		ERROR("Error opening <%s>: %s\n","/tmp/", strerror(errno));
 		return errno;
 	}
-	ftruncate(fba->fd, size);
+
+	if (unlikely(ftruncate(fba->fd, size))) {
+		err = errno;
+		ERROR("ftruncate(%zu) => %d: %s\n", size, err, strerror(err));
+		fba_free(fba);
+		return err;
+	}
 
 	fba->ptr = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED,
 			fba->fd, 0);
-	if (!fba->ptr) {
-		ERROR("mmap failed=> %d: %s\n", errno, strerror(errno));
+	if (fba->ptr == MAP_FAILED) {
+		err = errno ?: ENOMEM;
+		ERROR("mmap failed=> %d: %s\n", err, strerror(err));
+		fba->ptr = NULL;
 		fba_free(fba);
-		return errno ?: ENOMEM;
+		return err;
+	}
+
+	return 0;
+}
+
+int fba_alloc_node(struct fba *fba, size_t size, int node)
+{
+	ulong nodemask[4] = {};
+	int err;
+
+	err = fba_alloc(fba, size);
+	if (unlikely(err))
+		return err;
+
+	if (node >= 0 && (uint)node < sizeof(nodemask) * 8) {
+		nodemask[node / (sizeof(ulong) * 8)] =
+					1UL << (node % (sizeof(ulong) * 8));
+		/* Best effort. The memset below (on the calling thread's
+		 * node) is what places the pages for most file systems.
+		 */
+		if (syscall(SYS_mbind, fba->ptr, size, MPOL_PREFERRED,
+			    nodemask, sizeof(nodemask) * 8, 0))
+			DBG("mbind(%d) => %d: %s\n", node, errno,
+			    strerror(errno));
 	}
 
+	memset(fba->ptr, 0, size);
 	return 0;
 }
 
 void fba_free(struct fba *fba)
 {
+	if (fba->ptr) {
+		munmap(fba->ptr, fba->size);
+		fba->ptr = NULL;
+	}
 	if (fba->fd >= 0) {
 		close(fba->fd);
 		fba->fd = -1;
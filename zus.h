@@ -15,6 +15,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <linux/stat.h>
 /* This is a nasty hack for getting O_TMPFILE into centos 7.4
@@ -36,6 +37,8 @@
 #define unlikely(x_)	__builtin_expect(!!(x_), 0)
 #endif
 
+#define ZUS_CACHELINE_SIZE	64
+
 extern bool g_verify;
 #define MAX_LFS_FILESIZE 	((loff_t)0x7fffffffffffffffLL)
 
@@ -66,7 +69,7 @@ static inline void mt_to_timespec(struct timespec *t, __le64 *mt)
 /* ~~~~ pmem ~~~~ */
 
 struct fba {
-	int fd; void *ptr;
+	int fd; void *ptr; size_t size;
 };
 
 /* Each FS-type can decide what size to have for the page */
@@ -75,15 +78,43 @@ struct zus_pmem_page {
 	ulong user_info[0];
 };
 
+/* The low bits of zus_pmem_page.flags are the numa_id */
+#define ZUS_PAGE_NUMA_MASK	0xffUL
+
+static inline uint zus_page_numa_id(struct zus_pmem_page *page)
+{
+	return page->flags & ZUS_PAGE_NUMA_MASK;
+}
+
+/* The NUMA node of pmem is sampled once per chunk of blocks at mount.
+ * pmem sections are never smaller than 128M.
+ */
+#define ZUS_NUMA_CHUNK_SHIFT	(27 - PAGE_SHIFT)
+
+/* The zus_pmem_page array of a mount, user_page_size bytes per block. All
+ * of it is reserved at mount, but a chunk (ZUS_NUMA_CHUNK blocks) is only
+ * materialized by the first zus_pmem_page() of one of its blocks. A page
+ * never moves while mounted, the FS may keep pointers to it.
+ */
+struct zus_pmem_pages {
+	void *ptr;
+	size_t size;
+	ulong *ready;		/* Bit per chunk, set once materialized */
+	pthread_mutex_t lock;	/* Of materializing */
+	bool hugetlb;
+};
+
 /* pmem access. One for each zus_super_block */
-/* use one of nv.h for movnt or cl_flush(ing) access */
+/* use nv.h for movnt or cl_flush(ing) access */
 struct zus_pmem {
 	struct zufs_ioc_pmem pmem_info; /* As received from Kernel */
 
 	void *p_pmem_addr;
 	int fd;
 	uint user_page_size;
-	struct fba pages;
+	struct zus_pmem_pages pages;
+
+	__u8 *numa_map;	/* numa_id per chunk, NULL if unknown (all 0) */
 };
 
 static inline ulong pmem_blocks(struct zus_pmem *pmem)
@@ -133,12 +164,38 @@ static inline ulong pmem_addr_2_offset(struct zus_pmem *pmem, void *ptr)
 
 static inline uint pmem_numa_id(struct zus_pmem *pmem, ulong bn)
 {
-	return 0;
+	if (!pmem->numa_map)
+		return 0;
+
+	return pmem->numa_map[bn >> ZUS_NUMA_CHUNK_SHIFT];
 }
 
 /* Not all users need this */
 void pmem_set_numa_id_in_pages(struct zus_pmem *pmem);
 
+void zus_pmem_pages_populate(struct zus_pmem *pmem, ulong chunk);
+
+/* The page of block @bn. Only valid if the zfi has a user_page_size */
+static inline
+struct zus_pmem_page *zus_pmem_page(struct zus_pmem *pmem, ulong bn)
+{
+	ulong chunk = bn >> ZUS_NUMA_CHUNK_SHIFT;
+	ulong *ready = &pmem->pages.ready[chunk / (sizeof(ulong) * 8)];
+
+	if (unlikely(!(__atomic_load_n(ready, __ATOMIC_ACQUIRE) &
+		       (1UL << (chunk % (sizeof(ulong) * 8))))))
+		zus_pmem_pages_populate(pmem, chunk);
+
+	return pmem->pages.ptr + bn * pmem->user_page_size;
+}
+
+/* Returns a block in [@first, @last) that sits on @node. @slot out of
+ * @nslots spreads the callers evenly over all such blocks. If there are
+ * none on @node (or it is unknown), spreads over the whole range.
+ */
+ulong pmem_numa_hint(struct zus_pmem *pmem, int node, ulong first,
+		     ulong last, uint slot, uint nslots);
+
 static inline
 zu_dpp_t pmem_dpp_t(ulong offset) { return (zu_dpp_t)offset; }
 
@@ -147,6 +204,7 @@ zu_dpp_t pmem_dpp_t(ulong offset) { return (zu_dpp_t)offset; }
 
 struct zus_fs_info;
 struct zus_sb_info;
+struct zus_ziic;
 
 struct zus_zii_operations {
 	void (*evict)(struct zus_inode_info *zii);
@@ -169,6 +227,11 @@ struct zus_inode_info {
 
 	struct zus_sb_info *sbi;
 	struct zus_inode *zi;
+
+	/* zus-vfs ino cache, the FS does not touch these */
+	struct zus_inode_info *ziic_next;
+	ulong ziic_ino;		/* 0 when not in the cache */
+	int ziic_refs;
 };
 
 struct zus_sbi_operations {
@@ -200,6 +263,9 @@ struct zus_sb_info {
 
 	struct zus_inode_info	*z_root;
 	ulong			flags;
+
+	struct zus_sb_info	*reg_next;	/* Mounted sbis, for zus only */
+	struct zus_ziic		*ziic;		/* ino => zii, for zus only */
 };
 
 enum E_zus_sbi_flags {
@@ -294,15 +360,135 @@ static inline void zus_std_remove_dentry(struct zus_inode *dir_zi,
 int zuf_root_open_tmp(int *fd);
 void zuf_root_close(int *fd);
 int zus_getztno(void);
+/* zus_getztno() is always below this. For per zu_thread arrays */
+uint zus_max_ztno(void);
+/* A thread not started by zus that calls zus_do_command() itself (a test
+ * tool) takes slot @no. No other running thread may have it. -1, or a
+ * @no not below zus_max_ztno(), is no slot, like any other thread.
+ */
+void zus_set_ztno(int no);
+/* NUMA node of the calling thread. Cached for zu_threads which are pinned */
+int zus_getnuma(void);
+/* Work handed to a background reclaim thread by zus_reclaim_queue */
+struct zus_reclaim_work {
+	struct zus_reclaim_work *next;
+	void (*fn)(struct zus_reclaim_work *zrw);	/* Frees @zrw too */
+};
+
+/* Run @zrw->fn later on a worker of the caller's NUMA node. Returns false
+ * if there is no worker or its queue is full, the caller then does the
+ * work inline (which is the backpressure).
+ */
+bool zus_reclaim_queue(struct zus_reclaim_work *zrw);
+/* Wait for all queued works to finish, returns true if there were any.
+ * Must not be called from a work.
+ */
+bool zus_reclaim_drain(void);
+/* A caller's part of a zus_gcommit. Embedded first in the FS's own
+ * request, which says what the caller needs persisted.
+ */
+struct zus_gcommit_req {
+	struct zus_gcommit_req *next;
+	bool done;
+	int err;
+};
+
+/* Group commit. Concurrent zus_gcommit() callers share one run of
+ * @commit, which must make all of @reqs durable (typically some flushes
+ * and a single fence). Its return is each caller's.
+ */
+struct zus_gcommit {
+	pthread_mutex_t lock;
+	pthread_cond_t done;	/* A commit ended */
+	struct zus_gcommit_req *head;	/* For the next commit */
+	bool busy;		/* A commit is running */
+	int (*commit)(struct zus_gcommit *zgc, struct zus_gcommit_req *reqs);
+};
+
+void zus_gcommit_init(struct zus_gcommit *zgc,
+		      int (*commit)(struct zus_gcommit *zgc,
+				    struct zus_gcommit_req *reqs));
+void zus_gcommit_fini(struct zus_gcommit *zgc);
+/* Returns once what @zgr asks for is durable, by this caller's commit or
+ * another's. Sleeps, no locks may be held that @commit takes.
+ */
+int zus_gcommit(struct zus_gcommit *zgc, struct zus_gcommit_req *zgr);
+/* Mount time scan of blocks [@first, @last). Calls @fn on aligned pieces of
+ * it from all zu_thread CPUs in parallel, each taking the pieces on its own
+ * NUMA node first, and returns when all are done. @fn may run concurrently
+ * with itself. With no zu_threads it is called once for the whole range.
+ */
+void zus_pmem_parallel_for(struct zus_pmem *pmem, ulong first, ulong last,
+			   void (*fn)(void *arg, ulong bn, ulong end),
+			   void *arg);
+
+/* zus-pool.c */
+/* Object pools an FS can use for its zii_alloc/free and sbi_alloc/free */
+#define ZUS_POOL_MAG_SIZE	64
+
+struct zus_pool_mag {
+	uint count;
+	ulong hits;
+	ulong misses;
+	void *objs[ZUS_POOL_MAG_SIZE];
+} __attribute__((aligned(ZUS_CACHELINE_SIZE)));
+
+struct zus_pool {
+	const char *name;
+	size_t obj_size;	/* Rounded up to ZUS_CACHELINE_SIZE */
+	uint nmags;
+	struct zus_pool_mag *mags; /* One per zu_thread */
+
+	pthread_mutex_t lock;	/* Protects all below */
+	void *free_list;
+	void *slabs;
+	ulong nr_slabs;
+	ulong misses;		/* Of non zu_threads */
+
+	struct zus_pool *next;
+};
+
+struct zus_pool_stats {
+	ulong obj_size;
+	ulong slabs;
+	ulong hits;
+	ulong misses;
+};
+
+int zus_pool_init(struct zus_pool *pool, const char *name, size_t obj_size);
+void zus_pool_fini(struct zus_pool *pool);
+void *zus_pool_alloc(struct zus_pool *pool);
+void zus_pool_free(struct zus_pool *pool, void *obj);
+void zus_pool_get_stats(struct zus_pool *pool, struct zus_pool_stats *zps);
+void zus_pool_print_all(void);
 
 /* zus-vfs.c */
 int zus_register_all(int fd);
 int zus_register_one(int fd, struct zus_fs_info *p_zfi);
+/* A registered FS by its rfi.fsname, NULL if none */
+struct zus_fs_info *zus_find_fs(const char *fsname);
 
 int zus_mount(int fd, struct zufs_ioc_mount *zim);
+/* zus_mount over @blocks of anonymous DRAM instead of a Kernel pmem, for
+ * driving an FS with no ZUF (zus-bench). umount with zus_umount.
+ */
+int zus_mount_dram(struct zufs_ioc_mount *zim, ulong blocks);
 int zus_umount(int fd, struct zufs_ioc_mount *zim);
+/* zus_umount in two halves. detach takes @zim's sbi out of the registry
+ * (NULL if it is not mounted) so the Kernel can be answered, teardown
+ * then frees it.
+ */
+struct zus_sb_info *zus_umount_detach(struct zufs_ioc_mount *zim);
+void zus_sbi_teardown(struct zus_sb_info *sbi);
+/* Tear down all the still mounted sbis, at exit */
+void zus_umount_all(void);
+/* The cached zii of @ino, or a new one from the FS iget. Each zus_iget
+ * takes a reference, dropped by zus_iput or the Kernel's evict.
+ */
 struct zus_inode_info *zus_iget(struct zus_sb_info *sbi, ulong ino);
+void zus_iput(struct zus_inode_info *zii);
 int zus_do_command(void *app_ptr, struct zufs_ioc_hdr *hdr);
+const char *zus_op_name(int op);
 
 /* foofs.c */
 int foofs_register_fs(int fd);
@@ -310,9 +496,11 @@ int foofs_register_fs(int fd);
 /* Currently at zus-vfs.c */
 /* File backed Allocator - Gives user an allocated pointer
  * which is derived from a /tmp/O_TMPFILE mmap. The size
- * is round up to 4K alignment.
+ * is round up to 4K alignment. fba_free unmaps it.
  */
 int  fba_alloc(struct fba *fba, size_t size);
+/* Same as fba_alloc but the pages are bound to, and faulted in on, @node */
+int  fba_alloc_node(struct fba *fba, size_t size, int node);
 void fba_free(struct fba *fba);
 
 #endif /* define __ZUS_H__ */
@@ -7,15 +7,183 @@
  *	Boaz Harrosh <boaz@plexistor.com>
  */
 #include <pthread.h>
+#include <sched.h>
 
 #include "zus.h"
 
+/* Default deferred frees queued per NUMA node */
+#define ZUS_RECLAIM_MAX	256
+
 struct thread_param {
 	const char* path;
 	int policy;
-	int rr_priority;
+	int rr_priority;	/* Or the nice value of SCHED_OTHER */
+	cpu_set_t cpus;		/* Where to run zu_threads. Empty is all */
+	uint min_threads;	/* Per CPU, always running */
+	uint max_threads;	/* Per CPU, grown to when busy */
+	uint trace_ents; /* Per thread trace ring. 0 is no tracing */
+	uint pmem_huge_shift; /* Align pmem mappings to 2^shift. 0 is not */
+	bool pmem_prefault;	/* Fault in all of the pmem at mount */
+	uint reclaim_max;	/* Queued frees per node. 0 runs them inline */
+	bool perf;		/* Count the ZUS_PERF_XXX events of each op */
 };
 
 int zus_mount_thread_start(struct thread_param *tp);
 void zus_mount_thread_stop(void);
 void zus_join(void);
+
+/* The parameters zus runs with. NULL before the zu_threads are started */
+const struct thread_param *zus_thread_param(void);
+
+/* ~~~~ per operation statistics ~~~~ */
+
+/* Latency histogram is log2 of nano-seconds with ZUS_STATS_SUB_BITS of
+ * linear sub-buckets per power of two. (~19% resolution, up to ~8 sec)
+ */
+#define ZUS_STATS_SUB_BITS	2
+#define ZUS_STATS_BUCKETS	128
+#define ZUS_STATS_MAX_OP	(ZUS_OP_BREAK + 1)
+
+/* Hardware counters of the zu_thread, in user mode, around each op */
+enum {
+	ZUS_PERF_CYCLES,
+	ZUS_PERF_INSTRUCTIONS,
+	ZUS_PERF_LLC_MISSES,
+	ZUS_PERF_BRANCH_MISSES,
+	ZUS_PERF_NODE_MISSES,	/* Reads from a remote NUMA node */
+	ZUS_PERF_MAX
+};
+
+struct zus_op_stats {
+	ulong count;
+	ulong errors;
+	ulong total_ns;
+	ulong max_ns;
+	ulong hist[ZUS_STATS_BUCKETS];
+	ulong perf_count;		/* Ops counted in @perf */
+	ulong perf[ZUS_PERF_MAX];	/* Totals. 0 if not counted */
+};
+
+/* One per zu_thread. Only the owner thread writes, readers may snapshot
+ * at any time without stopping the threads.
+ */
+struct zus_stats {
+	struct zus_op_stats ops[ZUS_STATS_MAX_OP];
+};
+
+static inline uint zus_stats_bucket(ulong ns)
+{
+	uint msb, sub, b;
+
+	if (ns < (1UL << ZUS_STATS_SUB_BITS))
+		return ns;
+
+	msb = 63 - __builtin_clzl(ns);
+	sub = (ns >> (msb - ZUS_STATS_SUB_BITS)) &
+					((1 << ZUS_STATS_SUB_BITS) - 1);
+	b = ((msb - ZUS_STATS_SUB_BITS + 1) << ZUS_STATS_SUB_BITS) | sub;
+
+	return b < ZUS_STATS_BUCKETS ? b : ZUS_STATS_BUCKETS - 1;
+}
+
+/* Lowest ns value that lands in bucket @b */
+static inline ulong zus_stats_bucket_ns(uint b)
+{
+	uint msb, sub;
+
+	if (b < (1 << ZUS_STATS_SUB_BITS))
+		return b;
+
+	msb = (b >> ZUS_STATS_SUB_BITS) + ZUS_STATS_SUB_BITS - 1;
+	sub = b & ((1 << ZUS_STATS_SUB_BITS) - 1);
+	return ((1UL << ZUS_STATS_SUB_BITS) | sub) <<
+						(msb - ZUS_STATS_SUB_BITS);
+}
+
+/* @permil is in 1/1000 of the population i.e 990 for p99 999 for p99.9
+ * Returns the lower bound of the bucket it falls into
+ */
+static inline
+ulong zus_stats_percentile(struct zus_op_stats *zos, uint permil)
+{
+	ulong total = 0, want, sum = 0;
+	int b;
+
+	for (b = 0; b < ZUS_STATS_BUCKETS; ++b)
+		total += zos->hist[b];
+	if (!total)
+		return 0;
+
+	want = (total * permil + 999) / 1000;
+	for (b = 0; b < ZUS_STATS_BUCKETS; ++b) {
+		sum += zos->hist[b];
+		if (want <= sum)
+			return zus_stats_bucket_ns(b);
+	}
+
+	return zos->max_ns;
+}
+
+void zus_stats_snapshot(struct zus_stats *zs);
+void zus_stats_print(void);
+
+/* ~~~~ binary operation trace ~~~~ */
+
+#define ZUS_TRACE_ENTS		4096	/* Default ring size */
+#define ZUS_TRACE_FILE		"/tmp/zus-trace.%d"	/* %d is the pid */
+#define ZUS_TRACE_MAGIC		0x454341525453555aUL	/* "ZUSTRACE" */
+#define ZUS_TRACE_VERSION	1
+#define ZUS_TRACE_NAME_LEN	24
+
+/* One operation. @ino, @off and @len are filled by the op's tracepoint:
+ *	READ/WRITE	- ino, file offset, length
+ *	GET_BLOCK	- ino, block index, rw
+ *	LOOKUP		- dir ino, 0, found ino
+ *	NEW_INODE	- dir ino, 0, new ino
+ * and are 0 for ops with no tracepoint.
+ */
+struct zus_trace_ent {
+	__u64 start_ns;		/* CLOCK_MONOTONIC */
+	__u32 dur_ns;
+	__u16 op;
+	__s16 err;
+	__u64 ino;
+	__u64 off;
+	__u64 len;
+};
+
+/* The dump file is a zus_trace_file_hdr followed by @nrings of
+ * zus_trace_ring_hdr each followed by its @count entries, oldest first.
+ */
+struct zus_trace_file_hdr {
+	__u64 magic;
+	__u32 version;
+	__u32 ent_size;
+	__u32 nrings;
+	__u32 nops;
+	char op_names[ZUS_STATS_MAX_OP][ZUS_TRACE_NAME_LEN];
+};
+
+struct zus_trace_ring_hdr {
+	__u32 ztno;
+	__s32 cpu;
+	__u64 count;
+	__u64 lost;	/* Overwritten before this dump */
+};
+
+/* The running operation's entry, NULL when not tracing */
+extern __thread struct zus_trace_ent *zus_trace_cur;
+
+/* Tracepoint of the op helpers. Costs a TLS load when not tracing */
+static inline void zus_trace(ulong ino, ulong off, ulong len)
+{
+	struct zus_trace_ent *zte = zus_trace_cur;
+
+	if (zte) {
+		zte->ino = ino;
+		zte->off = off;
+		zte->len = len;
+	}
+}
+
+void zus_trace_dump(void);